@@ -53,6 +53,16 @@
   (this is the zlib license)
 */
 
+/* Altered for moodpd. Every changed or added line lies between a
+   "moodpd: begin" and a "moodpd: end" comment:
+    - const char* overloads of fullPatternMatch/partialPatternMatch, so
+      matching doesn't build temporary std::strings.
+    - Message::buildFromRawData with a time tag.
+    - PacketReader keeps the messages of earlier packets and reuses them,
+      so a reader which is kept doesn't allocate once its messages'
+      buffers are large enough.
+*/
+
 #ifndef OSCPKT_HH
 #define OSCPKT_HH
 
@@ -173,8 +183,14 @@ struct Storage {
 /** check if the path matches the supplied path pattern , according to the OSC spec pattern 
     rules ('*' and '//' wildcards, '{}' alternatives, brackets etc) */
 bool fullPatternMatch(const std::string &pattern, const std::string &path);
+/* moodpd: begin */
+bool fullPatternMatch(const char *pattern, const char *path);
+/* moodpd: end */
 /** check if the path matches the beginning of pattern */
 bool partialPatternMatch(const std::string &pattern, const std::string &path);
+/* moodpd: begin */
+bool partialPatternMatch(const char *pattern, const char *path);
+/* moodpd: end */
 
 #if defined(OSCPKT_DEBUG)
 #define OSCPKT_SET_ERR(errcode) do { if (!err) { err = errcode; std::cerr << "set " #errcode << " at line " << __LINE__ << "\n"; } } while (0)
@@ -361,6 +377,10 @@ public:
   ArgReader arg() const { return ArgReader(*this, OK_NO_ERROR); }
 
   /** build the osc message for raw data (the message will keep a copy of that data) */
+  /* moodpd: begin, same with a time tag */
+  void buildFromRawData(const void *ptr, size_t sz, TimeTag tt) { buildFromRawData(ptr, sz); time_tag = tt; }
+  /* moodpd: end */
+
   void buildFromRawData(const void *ptr, size_t sz) {
     clear();
     storage.assign((const char*)ptr, (const char*)ptr + sz);
@@ -505,29 +525,37 @@ private:
 */
 class PacketReader {
 public:
-  PacketReader() { err = OK_NO_ERROR; }
+  /* moodpd: begin */
+  PacketReader() { err = OK_NO_ERROR; nb_messages = nb_popped = 0; }
+  /* moodpd: end */
   /** pointer and size of the osc packet to be parsed. */
   PacketReader(const void *ptr, size_t sz) { init(ptr, sz); }
 
+  /* moodpd: begin, the messages of earlier packets are kept and reused, so a reader which is kept
+     doesn't allocate once its messages' buffers are large enough */
   void init(const void *ptr, size_t sz) {
-    err = OK_NO_ERROR; messages.clear();
+    err = OK_NO_ERROR; nb_messages = 0; it_free = messages.begin();
     if ((sz%4) == 0) { 
       parse((const char*)ptr, (const char *)ptr+sz, TimeTag::immediate());
     } else OSCPKT_SET_ERR(INVALID_PACKET_SIZE);
-    it_messages = messages.begin();
+    it_messages = messages.begin(); nb_popped = 0;
   }
   
   /** extract the next osc message from the packet. return 0 when all messages have been read, or in case of error. */
   Message *popMessage() {
-    if (!err && !messages.empty() && it_messages != messages.end()) return &*it_messages++;
+    if (!err && nb_popped < nb_messages) { ++nb_popped; return &*it_messages++; }
     else return 0;
   }
+  /* moodpd: end */
   bool isOk() const { return err == OK_NO_ERROR; }
   ErrorCode getErr() const { return err; }
 
 private:
   std::list<Message> messages;
-  std::list<Message>::iterator it_messages;
+  /* moodpd: begin */
+  std::list<Message>::iterator it_messages, it_free;
+  size_t nb_messages, nb_popped;
+  /* moodpd: end */
   ErrorCode err;
   
   void parse(const char *beg, const char *end, TimeTag time_tag) {
@@ -553,8 +581,13 @@ private:
         OSCPKT_SET_ERR(INVALID_BUNDLE);
       }
     } else {
-      messages.push_back(Message(beg, end-beg, time_tag));
-      if (!messages.back().isOk()) OSCPKT_SET_ERR(messages.back().getErr());
+      /* moodpd: begin */
+      if (it_free == messages.end()) it_free = messages.insert(messages.end(), Message());
+      Message &msg = *it_free++;
+      msg.buildFromRawData(beg, end-beg, time_tag);
+      ++nb_messages;
+      if (!msg.isOk()) OSCPKT_SET_ERR(msg.getErr());
+      /* moodpd: end */
     }
   }
 };
@@ -686,16 +719,26 @@ inline const char *internalPatternMatch(const char *pattern, const char *path) {
   return (*path == 0 ? pattern : 0);
 }
 
-inline bool partialPatternMatch(const std::string &pattern, const std::string &test) {
-  const char *q = internalPatternMatch(pattern.c_str(), test.c_str());
+/* moodpd: begin, the const char* versions avoid building temporary std::strings */
+inline bool partialPatternMatch(const char *pattern, const char *test) {
+  const char *q = internalPatternMatch(pattern, test);
   return q != 0;
 }
 
-inline bool fullPatternMatch(const std::string &pattern, const std::string &test) {
-  const char *q = internalPatternMatch(pattern.c_str(), test.c_str());
+inline bool partialPatternMatch(const std::string &pattern, const std::string &test) {
+  return partialPatternMatch(pattern.c_str(), test.c_str());
+}
+
+inline bool fullPatternMatch(const char *pattern, const char *test) {
+  const char *q = internalPatternMatch(pattern, test);
   return q && *q == 0;
 }
 
+inline bool fullPatternMatch(const std::string &pattern, const std::string &test) {
+  return fullPatternMatch(pattern.c_str(), test.c_str());
+}
+/* moodpd: end */
+
 } // namespace oscpkt
 
 #endif // OSCPKT_HH
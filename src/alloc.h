@@ -0,0 +1,80 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+// heap accounting. glibc has dropped its malloc hooks, but every allocation of C++ code (containers,
+// strings, oscpkt's messages) goes through operator new, which is replaced here to count them. once the
+// daemon has warmed up, handling a packet shouldn't allocate at all: buffers are kept and reused and only
+// grow to their high-water mark. the socket statistics and the simulation show how many packets did.
+// the replacement operators are definitions, so this goes into one translation unit per program (each of
+// moodpd's programs is a single one).
+
+#include <new>
+
+struct HeapStats
+{
+    uint64_t allocations, frees, bytes;
+};
+
+static HeapStats heapStats;
+
+void *operator new(size_t size)
+{
+    heapStats.allocations++;
+    heapStats.bytes+= size;
+    void *p= malloc(size? size: 1);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+// the replaced operator new gets its memory from malloc(), so free() is the matching release. gcc only
+// sees the replaceable operator new at the call sites and warns.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *p) noexcept
+{
+    if(p) heapStats.frees++;
+    free(p);
+}
+#pragma GCC diagnostic pop
+
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { operator delete(p); }
+
+inline void printHeapStats(FILE *f)
+{
+    fprintf(f, "heap: %llu allocations (%llu bytes), %llu live\n", (unsigned long long)heapStats.allocations,
+            (unsigned long long)heapStats.bytes, (unsigned long long)(heapStats.allocations-heapStats.frees));
+}
+
+
+// allocations while handling packets. a steady packet stream shouldn't allocate, so the last packet
+// which did should be one of the first.
+struct PacketAllocations
+{
+    uint64_t packets, allocatingPackets, allocations, lastPacket;
+
+    PacketAllocations(): packets(0), allocatingPackets(0), allocations(0), lastPacket(0) {}
+
+    void add(uint64_t n)
+    {
+        packets++;
+        if(!n) return;
+        allocatingPackets++;
+        allocations+= n;
+        lastPacket= packets;
+    }
+
+    void print(FILE *f, const char *indent) const
+    {
+        if(!allocatingPackets) fprintf(f, "%sheap: no allocations in %llu packets\n", indent, (unsigned long long)packets);
+        else fprintf(f, "%sheap: %llu allocations in %llu of %llu packets, the last in packet %llu\n", indent,
+                     (unsigned long long)allocations, (unsigned long long)allocatingPackets,
+                     (unsigned long long)packets, (unsigned long long)lastPacket);
+    }
+};
+
+
+#endif //ALLOC_H
@@ -0,0 +1,681 @@
+/*
+    moodpd-bench: micro benchmarks for moodpd's hot paths.
+
+    run moodpd-bench -h for help.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <libgen.h>
+#include <limits.h>
+#include <deque>
+#include <vector>
+#include <string>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <iostream>
+#include <math.h>
+
+#include <oscpkt.hh>
+
+using namespace std;
+
+#include "utils.h"
+#include "alloc.h"
+#include "capture.h"
+#include "oscpattern.h"
+#include "cmd_handler.h"
+#include "lamps.h"
+#include "protocol.h"
+#include "color.h"
+#include "dmx.h"
+#include "slip.h"
+#include "effects.h"
+#include "net.h"
+#include "output.h"
+#include "merge.h"
+#include "client.h"
+
+uint32_t logMask= 1<<LOG_ERROR;
+
+// keep the compiler from optimizing away benchmarked results.
+static volatile unsigned benchSink;
+
+// run fn 'iterations' times and return ns per iteration.
+template<typename Fn> double timeIt(unsigned iterations, Fn fn)
+{
+    uint64_t start= monotonicNs();
+    for(unsigned i= 0; i<iterations; i++) fn();
+    return double(monotonicNs()-start)/iterations;
+}
+
+
+// compare OscPattern with oscpkt's pattern interpreter on moodpd and andOSC addresses.
+bool benchPatterns(unsigned iterations)
+{
+    static const char *patterns[]=
+    {
+        "/moodpd/lamps/*/rgb",
+        "/ori",
+        "/moodpd/lamps/[0-9a-f][0-9a-f]/{rgb,hsv}",
+        "/moodpd//rgb",
+        "/moodpd/lamps/?[!a-z]/rgb",
+    };
+    static const char *addresses[]=
+    {
+        "/moodpd/lamps/00/rgb",
+        "/moodpd/lamps/17/rgb",
+        "/moodpd/lamps/0f/hsv",
+        "/moodpd/lamps/00/rgb/x",
+        "/ori",
+        "/acc",
+        "/dali/lamps/01/bright",
+    };
+    const int npatterns= sizeof(patterns)/sizeof(patterns[0]), naddresses= sizeof(addresses)/sizeof(addresses[0]);
+
+    // both implementations have to agree before timing means anything.
+    bool ok= true;
+    for(int p= 0; p<npatterns; p++)
+    {
+        OscPattern compiled(patterns[p]);
+        for(int a= 0; a<naddresses; a++)
+            if(compiled.match(addresses[a]) != oscpkt::fullPatternMatch(patterns[p], addresses[a]))
+                printf("MISMATCH: pattern '%s', address '%s'\n", patterns[p], addresses[a]), ok= false;
+    }
+
+    printf("%-44s %12s %12s %8s\n", "pattern (ns per match, all addresses)", "interpreter", "compiled", "speedup");
+    for(int p= 0; p<npatterns; p++)
+    {
+        vector<string> addressStrings(addresses, addresses+naddresses);
+        OscPattern compiled(patterns[p]);
+        string pattern= patterns[p];
+        double tInterp= timeIt(iterations, [&]() {
+            unsigned n= 0;
+            for(int a= 0; a<naddresses; a++) n+= oscpkt::fullPatternMatch(pattern, addressStrings[a]);
+            benchSink= n;
+        }) / naddresses;
+        double tCompiled= timeIt(iterations, [&]() {
+            unsigned n= 0;
+            for(int a= 0; a<naddresses; a++) n+= compiled.match(addressStrings[a]);
+            benchSink= n;
+        }) / naddresses;
+        printf("%-44s %12.1f %12.1f %7.1fx\n", patterns[p], tInterp, tCompiled, tInterp/tCompiled);
+    }
+    return ok;
+}
+
+
+// patch a full Art-Net universe (170 RGB lamps) into the lamp state, changing and unchanging.
+bool benchDmx(unsigned iterations)
+{
+    uint8_t packet[18+DMX_CHANNELS];
+    memset(packet, 0, sizeof(packet));
+    memcpy(packet, "Art-Net\0\0\x50\0\x0e\0\0\x01\0\x02\0", 18);
+    DmxPatch patch;
+    parseDmxPatch("1 1 0 170", patch);
+    vector<DmxPatch> patches(1, patch);
+    LampState lamps;
+
+    printf("%-44s %12s\n", "universe -> lamps", "ns/packet");
+    double tSame= timeIt(iterations, [&]() {
+        int universe, length;
+        const uint8_t *dmx= parseArtDmx(packet, sizeof(packet), universe, length);
+        benchSink= applyDmx(patches, universe, dmx, length, lamps);
+        lamps.clearDirty();
+    });
+    printf("%-44s %12.1f\n", "unchanged universe", tSame);
+    double tChanged= timeIt(iterations, [&]() {
+        packet[18]++;
+        int universe, length;
+        const uint8_t *dmx= parseArtDmx(packet, sizeof(packet), universe, length);
+        benchSink= applyDmx(patches, universe, dmx, length, lamps);
+        lamps.clearDirty();
+    });
+    printf("%-44s %12.1f\n", "one lamp changed", tChanged);
+    return true;
+}
+
+
+// SLIP-frame a typical OSC packet and decode it again, in one read and split over two reads.
+bool benchSlip(unsigned iterations)
+{
+    char packet[64];
+    for(size_t i= 0; i<sizeof(packet); i++) packet[i]= i*7;
+    packet[10]= SLIP_END;
+    packet[20]= SLIP_ESC;
+    char encoded[2*sizeof(packet)+2];
+    size_t encodedSize= slipEncode(packet, sizeof(packet), encoded);
+    SlipDecoder decoder;
+    bool ok= true;
+    auto check= [&](const char *frame, size_t size) {
+        if(size!=sizeof(packet) || memcmp(frame, packet, size)) ok= false;
+        benchSink= size;
+    };
+
+    printf("%-44s %12s\n", "64 byte packet", "ns/packet");
+    double tEncode= timeIt(iterations, [&]() {
+        benchSink= slipEncode(packet, sizeof(packet), encoded);
+    });
+    printf("%-44s %12.1f\n", "encode", tEncode);
+    double tWhole= timeIt(iterations, [&]() {
+        memcpy(decoder.readPtr(), encoded, encodedSize);
+        decoder.received(encodedSize, check);
+    });
+    printf("%-44s %12.1f\n", "decode, one read", tWhole);
+    double tSplit= timeIt(iterations, [&]() {
+        size_t half= encodedSize/2;
+        memcpy(decoder.readPtr(), encoded, half);
+        decoder.received(half, check);
+        memcpy(decoder.readPtr(), encoded+half, encodedSize-half);
+        decoder.received(encodedSize-half, check);
+    });
+    printf("%-44s %12.1f\n", "decode, split over two reads", tSplit);
+    if(!ok) printf("decoded frame differs from the original!\n");
+    return ok;
+}
+
+
+// one frame of each effect over all lamps, times advancing like at 40 fps.
+bool benchEffects(unsigned iterations)
+{
+    static const char *names[]= { "hue", "breathe", "chase", "noise" };
+    LampState lamps;
+    printf("%-44s %12s\n", "effect, 256 lamps", "ns/frame");
+    for(int n= 0; n<4; n++)
+    {
+        EffectsEngine engine;
+        Effect e;
+        memset(&e, 0, sizeof(e));
+        e.type= effectType(names[n]);
+        e.count= MAX_LAMPS;
+        e.speed= 0.5f;
+        e.param= effectDefaultParam(e.type);
+        e.color[0]= e.color[1]= e.color[2]= 255;
+        engine.start(e);
+        uint64_t now= 0;
+        double t= timeIt(iterations, [&]() {
+            now+= 25000000;
+            benchSink= engine.render(now, lamps);
+            lamps.clearDirty();
+        });
+        printf("%-44s %12.1f\n", names[n], t);
+    }
+    return true;
+}
+
+
+// 8 senders each setting all lamps, merged as one frame.
+bool benchMerge(unsigned iterations)
+{
+    static const char *names[]= { "ltp", "htp", "priority" };
+    printf("%-44s %12s\n", "8 sources, 256 lamps", "ns/frame");
+    for(int n= 0; n<3; n++)
+    {
+        MergeEngine engine;
+        LampState out;
+        LampLayer *layers[8];
+        for(int i= 0; i<8; i++)
+        {
+            sockaddr_in sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sin_family= AF_INET;
+            sa.sin_port= htons(1000+i);
+            layers[i]= engine.layer((sockaddr*)&sa, 0);
+            for(int k= 0; k<MAX_LAMPS; k++) layers[i]->lamps.set(k, k*i, k+i, 255-k);
+            engine.stamp(*layers[i], i%WRITE_LANES);
+        }
+        unsigned frame= 0;
+        double t= timeIt(iterations, [&]() {
+            // one source changes every frame, like a fader moving.
+            LampLayer &l= *layers[frame%8];
+            l.lamps.set(frame%MAX_LAMPS, frame, frame>>8, 0);
+            engine.stamp(l, 1);
+            benchSink= engine.merge(out, mergeMode(names[n]));
+            out.clearDirty();
+            frame++;
+        });
+        printf("%-44s %12.1f\n", names[n], t);
+    }
+    return true;
+}
+
+
+// HSV and 16 bit frames for all lamps converted to RGB.
+bool benchColor(unsigned iterations)
+{
+    uint8_t hsv[MAX_LAMPS*3], rgb16[MAX_LAMPS*6];
+    for(int i= 0; i<MAX_LAMPS*3; i++) hsv[i]= i*7;
+    for(int i= 0; i<MAX_LAMPS*6; i++) rgb16[i]= i*13;
+    uint16_t h[MAX_LAMPS];
+    uint8_t s[MAX_LAMPS], v[MAX_LAMPS], r[MAX_LAMPS], g[MAX_LAMPS], b[MAX_LAMPS];
+
+    printf("%-44s %12s %12s\n", "256 lamps", "ns/frame", "ns/lamp");
+    double tHsv= timeIt(iterations, [&]() {
+        unpackHsv(hsv, h, s, v, MAX_LAMPS);
+        hsvToRgb(h, s, v, r, g, b, MAX_LAMPS);
+        benchSink= r[hsv[0]];
+    });
+    printf("%-44s %12.1f %12.2f\n", "HSV -> RGB", tHsv, tHsv/MAX_LAMPS);
+    double tRgb16= timeIt(iterations, [&]() {
+        unpackRgb16(rgb16, r, g, b, MAX_LAMPS);
+        benchSink= r[rgb16[0]];
+    });
+    printf("%-44s %12.1f %12.2f\n", "16 bit RGB -> 8 bit", tRgb16, tRgb16/MAX_LAMPS);
+    return true;
+}
+
+
+// the whole lamp state formatted for the serial line. "fixed" is the loop moodpd had when the protocol was
+// chosen at compile time, the others go through the runtime protocol selection.
+bool benchProtocol(unsigned iterations)
+{
+    uint8_t rgb[MAX_LAMPS][3];
+    for(int i= 0; i<MAX_LAMPS; i++) rgb[i][0]= i, rgb[i][1]= i*3, rgb[i][2]= 255-i;
+    char buf[MAX_LAMPS*MAX_LAMP_COMMAND_SIZE];
+    uint64_t pending[MAX_LAMPS/64];
+    int cursor= 0;
+
+    printf("%-44s %12s %12s\n", "256 lamps", "ns/frame", "ns/lamp");
+    double tFixed= timeIt(iterations, [&]() {
+        memset(pending, 0xff, sizeof(pending));
+        size_t n= 0;
+        int start= cursor;
+        for(int k= 0; k<=MAX_LAMPS/64 && n<sizeof(buf); k++)
+        {
+            int w= (start/64+k) % (MAX_LAMPS/64);
+            uint64_t &bits= pending[w], mask= k? ~0ull: ~0ull<<(start&63);
+            for(uint64_t sel; (sel= bits&mask) && n<sizeof(buf); )
+            {
+                int t= w*64 + __builtin_ctzll(sel);
+                bits&= ~(sel&-sel);
+                n+= formatLampCommand(buf+n, rgb[t][0], rgb[t][1], rgb[t][2], t);
+                cursor= (t+1)%MAX_LAMPS;
+            }
+        }
+        benchSink= n+buf[n/2];
+    });
+    printf("%-44s %12.1f %12.2f\n", "fixed text protocol", tFixed, tFixed/MAX_LAMPS);
+    for(int p= 0; p<PROTOCOLS; p++)
+    {
+        double t= timeIt(iterations, [&]() {
+            memset(pending, 0xff, sizeof(pending));
+            size_t n= formatLamps(p, buf, sizeof(buf), pending, cursor, rgb, [](int) {});
+            benchSink= n+buf[n/2];
+        });
+        printf("%-44s %12.1f %12.2f\n", protocolName(p), t, t/MAX_LAMPS);
+    }
+    return true;
+}
+
+
+// frames sent by the client library to a UNIX datagram socket, which is drained after every frame.
+bool benchClient(unsigned iterations)
+{
+    char path[]= "/tmp/moodpd-bench.XXXXXX";
+    if(!mkdtemp(path)) { perror("mkdtemp"); return false; }
+    string sockPath= string(path) + "/osc";
+    sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family= AF_UNIX;
+    strcpy(sa.sun_path, sockPath.c_str());
+    int rx= socket(AF_UNIX, SOCK_DGRAM, 0);
+    MoodpdClient client;
+    bool ok= rx>=0 && bind(rx, (sockaddr*)&sa, sizeof(sa))==0 && client.connect(sockPath.c_str());
+    if(!ok) perror("client socket");
+    char buf[65536];
+    unsigned frame= 0;
+
+    printf("%-44s %12s %12s\n", "frame", "ns/frame", "bytes/frame");
+    double tFader= timeIt(ok? iterations: 0, [&]() {
+        // a fader dragged over 4 lamps: 100 updates between two frames.
+        for(int k= 0; k<100; k++) client.setRgb(k%4, frame, k, 0);
+        client.flush();
+        benchSink= recv(rx, buf, sizeof(buf), MSG_DONTWAIT);
+        frame++;
+    });
+    uint64_t bytes= client.stats().bytes;
+    printf("%-44s %12.1f %12.1f\n", "100 updates to 4 lamps", tFader, ok? double(bytes)/iterations: 0);
+    double tAll= timeIt(ok? iterations: 0, [&]() {
+        for(int i= 0; i<MAX_LAMPS; i++) client.setRgb(i, frame, i, 0);
+        client.flush();
+        benchSink= recv(rx, buf, sizeof(buf), MSG_DONTWAIT);
+        frame++;
+    });
+    printf("%-44s %12.1f %12.1f\n", "all 256 lamps", tAll, ok? double(client.stats().bytes-bytes)/iterations: 0);
+    bytes= client.stats().bytes;
+    double tSparse= timeIt(ok? iterations: 0, [&]() {
+        // every 16th lamp, one message each.
+        for(int i= 0; i<MAX_LAMPS; i+= 16) client.setRgb(i, frame, i, 0);
+        client.flush();
+        benchSink= recv(rx, buf, sizeof(buf), MSG_DONTWAIT);
+        frame++;
+    });
+    printf("%-44s %12.1f %12.1f\n", "every 16th lamp, bundle of 16", tSparse, ok? double(client.stats().bytes-bytes)/iterations: 0);
+    if(ok) client.printStats(stdout);
+
+    // a run of lamps goes out as a single /moodpd/lamps/rgb message, which moodpd decodes on its fast path.
+    if(ok)
+    {
+        for(int i= 0; i<100; i++) client.setRgb(10+i, i, 255-i, frame);
+        client.flush();
+        ssize_t n= recv(rx, buf, sizeof(buf), MSG_DONTWAIT);
+        int first= -1;
+        size_t size= 0;
+        const uint8_t *rgb= n>0? parseBulkRgb(buf, n, first, size): 0;
+        ok= rgb && first==10 && size==300 && rgb[297]==99 && rgb[298]==156 && rgb[299]==(uint8_t)frame;
+        if(!ok) printf("client datagram doesn't take the /moodpd/lamps/rgb fast path\n");
+    }
+
+    if(rx>=0) close(rx);
+    unlink(sockPath.c_str());
+    rmdir(path);
+    return ok;
+}
+
+
+// a frame of 170 changed lamps through each output driver. the DMX outputs send to a local UDP socket,
+// which checks that the packets parse back to the lamp colors.
+bool benchOutputs(unsigned iterations)
+{
+    int rx= openUdpSocket(0);
+    sockaddr_in6 sa;
+    socklen_t saLen= sizeof(sa);
+    if(rx<0 || getsockname(rx, (sockaddr*)&sa, &saLen)<0) { perror("receiver socket"); return false; }
+    char port[16];
+    snprintf(port, sizeof(port), "%d", ntohs(sa.sin6_port));
+    const string specs[]= { "null", "file /dev/null", string("artnet 127.0.0.1:") + port + " 7 0 170",
+                            string("sacn 7 0 170 127.0.0.1:") + port };
+    LampState lamps;
+    uint8_t frame= 0;
+    bool ok= true;
+
+    printf("%-44s %12s %12s %12s\n", "170 lamps", "ns/frame", "ns/lamp", "received");
+    for(size_t k= 0; k<sizeof(specs)/sizeof(specs[0]); k++)
+    {
+        OutputSpec spec;
+        if(!parseOutputSpec(specs[k], spec)) { printf("bad output spec '%s'\n", specs[k].c_str()); return false; }
+        OutputDriver *output= createOutput(spec);
+        uint8_t packet[SACN_HEADER+DMX_CHANNELS];
+        unsigned received= 0, bad= 0;
+        double t= timeIt(iterations, [&]() {
+            frame++;
+            for(int i= 0; i<170; i++) lamps.set(i, frame, i, 255-frame);
+            output->send(lamps);
+            lamps.clearDirty();
+            output->frame(monotonicNs());
+            for(ssize_t n; (n= recv(rx, packet, sizeof(packet), MSG_DONTWAIT))>0; received++)
+            {
+                int universe, length;
+                const uint8_t *dmx= spec.type==OUTPUT_ARTNET? parseArtDmx(packet, n, universe, length):
+                                                              parseSacn(packet, n, universe, length);
+                if(!dmx || universe!=7 || length<510 || dmx[3]!=lamps.red[1] || dmx[4]!=lamps.green[1] ||
+                   dmx[509]!=lamps.blue[169])
+                    bad++;
+            }
+        });
+        printf("%-44s %12.1f %12.2f %12u\n", specs[k].c_str(), t, t/170, received);
+        if(bad) printf("%u packets didn't match the lamp state\n", bad), ok= false;
+        if(spec.type<=OUTPUT_SACN && !received) ok= false;
+        delete output;
+    }
+    close(rx);
+    return ok;
+}
+
+
+// a NonblockWriter with lazily formatted lamps, like the tty's writer, writing to /dev/null.
+class NullWriter: public NonblockWriter
+{
+    public:
+        NullWriter(): cursor(0)
+        {
+            memset(pending, 0, sizeof(pending));
+            memset(rgb, 0, sizeof(rgb));
+            setFd(open("/dev/null", O_WRONLY|O_CLOEXEC));
+        }
+
+        ~NullWriter() { close(getFd()); }
+
+        void writeFailed(int /*_errno*/) {}
+
+        void setLamp(int t, uint8_t r, uint8_t g, uint8_t b)
+        {
+            rgb[t][0]= r, rgb[t][1]= g, rgb[t][2]= b;
+            pending[t>>6]|= 1ull<<(t&63);
+            lazyDataAdded();
+        }
+
+    protected:
+        bool hasLazyData(int l)
+        {
+            for(int w= 0; w<MAX_LAMPS/64; w++) if(l==getLane() && pending[w]) return true;
+            return false;
+        }
+
+        void produceLazyData(int /*l*/, LaneBuffer &out, size_t maxBytes)
+        {
+            char buf[MAX_LAMPS*MAX_LAMP_COMMAND_SIZE];
+            size_t n= formatLamps(PROTOCOL_TEXT, buf, maxBytes, pending, cursor, rgb, [](int) {});
+            if(n) out.append(buf, n);
+        }
+
+    private:
+        uint64_t pending[MAX_LAMPS/64];
+        int cursor;
+        uint8_t rgb[MAX_LAMPS][3];
+};
+
+// the packet path once it has warmed up must not allocate: OSC bundles parsed by a kept reader, lamps
+// and commands through the serial writer, a frame through the outputs. fails if anything allocates.
+bool benchAlloc(unsigned iterations)
+{
+    oscpkt::PacketWriter pw;
+    oscpkt::Message m;
+    uint8_t rgb[48];
+    memset(rgb, 7, sizeof(rgb));
+    pw.startBundle();
+    pw.addMessage(m.init("/moodpd/lamps/rgb").pushInt32(0).pushBlob(rgb, sizeof(rgb)));
+    pw.addMessage(m.init("/moodpd/lamps/01/hsv").pushFloat(0.5).pushFloat(1).pushFloat(1));
+    pw.addMessage(m.init("/fader/1").pushFloat(0.25));
+    pw.endBundle();
+    vector<char> packet((const char*)pw.packetData(), (const char*)pw.packetData()+pw.packetSize());
+    vector<char> blob;
+    LampState lamps;
+    OutputSet outputs;
+    vector<OutputSpec> specs(2);
+    parseOutputSpec("null", specs[0]);
+    parseOutputSpec("file /dev/null", specs[1]);
+    outputs.setSpecs(specs, lamps);
+    NullWriter writer;
+    OscPattern bulkRgb("/moodpd/lamps/rgb"), hsv("/moodpd/lamps/*/hsv");
+    unsigned n= 0;
+
+    auto handlePacket= [&](oscpkt::PacketReader &pr) {
+        pr.init(&packet[0], packet.size());
+        int first, count= 0;
+        float x, y, z;
+        for(oscpkt::Message *msg; (msg= pr.popMessage()); count++)
+        {
+            if(bulkRgb.match(msg->addressPattern()) && msg->arg().popInt32(first).popBlob(blob).isOkNoMoreArgs())
+                lamps.setPacked(first, (const uint8_t*)&blob[0], blob.size()/3);
+            else if(hsv.match(msg->addressPattern()) && msg->arg().popFloat(x).popFloat(y).popFloat(z).isOkNoMoreArgs())
+                lamps.set(1+n%32, colorFloatTo8(x), colorFloatTo8(y), colorFloatTo8(z+n));
+        }
+        lamps.forEachDirty([&](int i) { writer.setLamp(i, lamps.red[i], lamps.green[i], lamps.blue[i]); });
+        writer.writef("i%02x0000\n", n&255);
+        outputs.send(lamps);
+        lamps.clearDirty();
+        outputs.frame(n++);
+        benchSink= count;
+    };
+
+    printf("%-44s %12s %12s\n", "bundle of 3 messages", "ns/packet", "allocs/packet");
+    uint64_t a0= heapStats.allocations;
+    double tFresh= timeIt(iterations, [&]() {
+        oscpkt::PacketReader pr;
+        handlePacket(pr);
+    });
+    printf("%-44s %12.1f %12.2f\n", "new reader per packet", tFresh, double(heapStats.allocations-a0)/iterations);
+    oscpkt::PacketReader kept;
+    for(int i= 0; i<100; i++) handlePacket(kept);     // warm up
+    a0= heapStats.allocations;
+    double tKept= timeIt(iterations, [&]() { handlePacket(kept); });
+    uint64_t allocs= heapStats.allocations-a0;
+    printf("%-44s %12.1f %12.2f\n", "kept reader, steady state", tKept, double(allocs)/iterations);
+    if(allocs) printf("%llu allocations in steady state, expected none\n", (unsigned long long)allocs);
+    return allocs==0;
+}
+
+// the same through the daemon itself: OSC traffic captured in virtual time and replayed by the moodpd
+// next to this program (moodpd -S), which fails if a packet after the warm-up allocates.
+bool benchSim(unsigned iterations)
+{
+    char path[]= "/tmp/moodpd-bench-XXXXXX";
+    int fd= mkstemp(path);
+    if(fd<0) { logerror("mkstemp"); return false; }
+    close(fd);
+    VirtualClock &clock= virtualClock();
+    clock.enabled= true;
+    clock.now= 0;
+    CaptureWriter capture;
+    if(!capture.open(path)) { clock.enabled= false; unlink(path); return false; }
+    sockaddr_storage from;
+    sockaddr_in *sin= (sockaddr_in*)&from;
+    memset(&from, 0, sizeof(from));
+    sin->sin_family= AF_INET;
+    sin->sin_port= htons(5000);
+    sin->sin_addr.s_addr= htonl(INADDR_LOOPBACK);
+    // single messages, the bulk fast path and bundles of the other lamp formats, 200 packets per second.
+    unsigned packets= min(iterations, 10000u);
+    uint8_t blob[96];
+    oscpkt::PacketWriter pw;
+    oscpkt::Message m;
+    char address[32];
+    for(unsigned i= 0; i<packets; i++)
+    {
+        memset(blob, i, sizeof(blob));
+        snprintf(address, sizeof(address), "/moodpd/lamps/%02x/rgb", i%32);
+        pw.init();
+        switch(i%4)
+        {
+            case 0:
+                pw.addMessage(m.init(address).pushInt32(i&255).pushInt32(0).pushInt32(255));
+                break;
+            case 1:
+                pw.addMessage(m.init("/moodpd/lamps/rgb").pushInt32(i%16).pushBlob(blob, sizeof(blob)));
+                break;
+            case 2:
+                pw.startBundle();
+                pw.addMessage(m.init("/moodpd/lamps/03/hsv").pushFloat((i%100)/100.0f).pushFloat(1).pushFloat(1));
+                pw.addMessage(m.init("/moodpd/lamps/04/rgbf").pushFloat(0.5f).pushFloat((i%10)/10.0f).pushFloat(0));
+                pw.addMessage(m.init("/moodpd/lamps/05/rgb16").pushInt32(i*100%65536).pushInt32(0).pushInt32(65535));
+                pw.endBundle();
+                break;
+            case 3:
+                pw.startBundle();
+                pw.addMessage(m.init("/moodpd/lamps/hsv").pushInt32(8).pushBlob(blob, 48));
+                pw.addMessage(m.init("/moodpd/lamps/rgb16").pushInt32(20).pushBlob(blob, sizeof(blob)));
+                pw.endBundle();
+                break;
+        }
+        capture.write(CAPTURE_OSC, (const sockaddr*)&from, pw.packetData(), pw.packetSize());
+        clock.now+= 5000000;
+    }
+    capture.close();
+    clock.enabled= false;
+
+    char exe[PATH_MAX];
+    ssize_t len= readlink("/proc/self/exe", exe, sizeof(exe)-1);
+    if(len<0) { logerror("readlink"); unlink(path); return false; }
+    exe[len]= 0;
+    string moodpd= string(dirname(exe)) + "/moodpd";
+    printf("%u packets through %s -S %s -A 100\n", packets, moodpd.c_str(), path);
+    fflush(stdout);
+    pid_t pid= fork();
+    if(pid==0)
+    {
+        execl(moodpd.c_str(), moodpd.c_str(), "-S", path, "-A", "100", (char*)0);
+        logerror("exec");
+        _exit(127);
+    }
+    int status= 0;
+    if(pid<0 || waitpid(pid, &status, 0)<0) logerror("fork");
+    unlink(path);
+    return pid>0 && WIFEXITED(status) && WEXITSTATUS(status)==0;
+}
+
+
+struct Benchmark
+{
+    const char *name;
+    bool (*run)(unsigned iterations);
+    const char *description;
+};
+
+static Benchmark benchmarks[]=
+{
+    { "pattern", benchPatterns, "OSC address pattern matching, compiled vs. oscpkt interpreter" },
+    { "dmx", benchDmx, "Art-Net universe patched into the lamp state" },
+    { "slip", benchSlip, "SLIP framing for OSC over stream sockets" },
+    { "color", benchColor, "HSV and 16 bit color conversion" },
+    { "effects", benchEffects, "built-in effects rendered into the lamp state" },
+    { "merge", benchMerge, "layers of several sources merged per frame" },
+    { "protocol", benchProtocol, "lamp state formatted for the serial line, per protocol" },
+    { "client", benchClient, "client library frames sent over a UNIX datagram socket" },
+    { "output", benchOutputs, "a frame of changed lamps through each output driver" },
+    { "alloc", benchAlloc, "heap allocations per packet in steady state (must be none)" },
+    { "sim", benchSim, "the same through moodpd -S, the daemon's own packet path (needs ./moodpd)" },
+};
+
+void printHelp(char *comm)
+{
+    printf("use: %s [options] [BENCHMARK...]\n", comm);
+    printf("options:\n"
+           "    -h              print this text.\n"
+           "    -n ITERATIONS   iterations per measurement [1000000]\n"
+           "benchmarks (default: all):\n");
+    for(size_t i= 0; i<sizeof(benchmarks)/sizeof(benchmarks[0]); i++)
+        printf("    %-15s %s\n", benchmarks[i].name, benchmarks[i].description);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned iterations= 1000000;
+    int opt;
+    while( (opt= getopt(argc, argv, "hn:"))!=-1 )
+        switch(opt)
+        {
+            case 'h':
+                printHelp(argv[0]);
+                exit(0);
+            case 'n':
+                iterations= atoi(optarg);
+                break;
+            default:
+                printHelp(argv[0]);
+                exit(1);
+        }
+
+    bool ok= true;
+    for(size_t i= 0; i<sizeof(benchmarks)/sizeof(benchmarks[0]); i++)
+    {
+        bool selected= (optind==argc);
+        for(int a= optind; a<argc; a++)
+            if(!strcmp(argv[a], benchmarks[i].name)) selected= true;
+        if(!selected) continue;
+        printf("== %s\n", benchmarks[i].name);
+        ok&= benchmarks[i].run(iterations);
+        printf("\n");
+    }
+    return ok? 0: 1;
+}
@@ -0,0 +1,280 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// traffic capture files. moodpd -w FILE appends every received datagram to a memory-mapped log,
+// moodpd-replay feeds such a file back into a daemon.
+//
+// file layout: a CaptureFileHeader, followed by records. each record is a CaptureRecord header and
+// its payload, padded to 8 bytes. every CAPTURE_INDEX_INTERVAL datagrams an index record is written
+// whose payload is a CaptureIndex, so readers can skip ahead without walking every record.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define CAPTURE_MAGIC           "m00dcap"
+#define CAPTURE_VERSION         1
+#define CAPTURE_INDEX_INTERVAL  1024
+#define CAPTURE_GROW_SIZE       (4<<20)     // grow the file in steps of this size
+
+enum CaptureSource
+{
+    CAPTURE_RAW= 1,     // raw command port
+    CAPTURE_OSC= 2,     // OSC port
+    CAPTURE_ARTNET= 3,  // Art-Net port
+    CAPTURE_SACN= 4,    // sACN port
+    CAPTURE_INDEX= 0xFF,
+};
+
+struct CaptureFileHeader
+{
+    char magic[8];          // CAPTURE_MAGIC
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t startTime;     // CLOCK_MONOTONIC ns when the capture was started
+    uint64_t startRealtime; // CLOCK_REALTIME ns, for humans
+    uint64_t dataEnd;       // file offset after the last complete record
+    uint64_t lastIndex;     // file offset of the last index record, 0 if none
+};
+
+struct CaptureRecord
+{
+    uint64_t time;          // ns since startTime
+    uint32_t size;          // payload size
+    uint16_t port;          // sender port, host byte order
+    uint8_t source;         // CaptureSource
+    uint8_t family;         // AF_INET or AF_INET6
+    uint8_t addr[16];       // sender address (first 4 bytes for AF_INET)
+};
+
+struct CaptureIndex
+{
+    uint64_t prevIndex;     // file offset of the previous index record, 0 if none
+    uint64_t firstRecord;   // file offset of the first datagram covered by this index
+    uint64_t firstTime, lastTime;
+    uint32_t count;         // number of datagrams covered
+    uint32_t pad;
+};
+
+inline size_t captureRecordSize(size_t payloadSize)
+{ return (sizeof(CaptureRecord) + payloadSize + 7) & ~(size_t)7; }
+
+
+class CaptureWriter
+{
+    public:
+        CaptureWriter(): fd(-1), map((char*)MAP_FAILED), mapSize(0) {}
+        ~CaptureWriter() { close(); }
+
+        bool open(const char *filename)
+        {
+            fd= ::open(filename, O_RDWR|O_CREAT|O_TRUNC, 0644);
+            if(fd<0) { logerror("capture: open"); return false; }
+            if(!grow(CAPTURE_GROW_SIZE)) { close(); return false; }
+            CaptureFileHeader *h= header();
+            memset(h, 0, sizeof(*h));
+            memcpy(h->magic, CAPTURE_MAGIC, sizeof(h->magic));
+            h->version= CAPTURE_VERSION;
+            h->headerSize= sizeof(CaptureFileHeader);
+            h->startTime= monotonicNs();
+            h->startRealtime= monotonicNs(CLOCK_REALTIME);
+            h->dataEnd= sizeof(CaptureFileHeader);
+            indexStart= h->dataEnd;
+            indexCount= 0;
+            flog(LOG_INFO, "capturing traffic to %s\n", filename);
+            return true;
+        }
+
+        void close()
+        {
+            if(fd<0) return;
+            if(indexCount) writeIndex();
+            if(fd<0) return;    // writeIndex() failed and closed the file
+            uint64_t end= header()->dataEnd;
+            munmap(map, mapSize);
+            map= (char*)MAP_FAILED;
+            if(ftruncate(fd, end)<0) logerror("capture: ftruncate");
+            ::close(fd);
+            fd= -1;
+        }
+
+        bool isOpen() { return fd>=0; }
+
+        // append a received datagram.
+        void write(CaptureSource source, const sockaddr *from, const void *data, size_t size)
+        {
+            if(fd<0) return;
+            CaptureRecord *r= (CaptureRecord*)append(captureRecordSize(size));
+            if(!r) return;
+            memset(r, 0, sizeof(*r));
+            r->time= monotonicNs() - header()->startTime;
+            r->size= size;
+            r->source= source;
+            if(from && from->sa_family==AF_INET)
+            {
+                const sockaddr_in *sin= (const sockaddr_in*)from;
+                r->family= AF_INET;
+                r->port= ntohs(sin->sin_port);
+                memcpy(r->addr, &sin->sin_addr, 4);
+            }
+            else if(from && from->sa_family==AF_INET6)
+            {
+                const sockaddr_in6 *sin6= (const sockaddr_in6*)from;
+                r->family= AF_INET6;
+                r->port= ntohs(sin6->sin6_port);
+                memcpy(r->addr, &sin6->sin6_addr, 16);
+            }
+            memcpy(r+1, data, size);
+            if(!indexCount) indexFirstTime= r->time;
+            indexLastTime= r->time;
+            commit();
+            if(++indexCount==CAPTURE_INDEX_INTERVAL) writeIndex();
+        }
+
+    private:
+        int fd;
+        char *map;
+        size_t mapSize;
+        size_t pending;     // size of the record being appended
+        uint64_t indexStart, indexFirstTime, indexLastTime;
+        uint32_t indexCount;
+
+        CaptureFileHeader *header() { return (CaptureFileHeader*)map; }
+
+        bool grow(size_t newSize)
+        {
+            if(ftruncate(fd, newSize)<0) { logerror("capture: ftruncate"); return false; }
+            char *m= (char*)(map==MAP_FAILED?
+                mmap(0, newSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0):
+                mremap(map, mapSize, newSize, MREMAP_MAYMOVE));
+            if(m==MAP_FAILED) { logerror("capture: mmap"); return false; }
+            map= m;
+            mapSize= newSize;
+            return true;
+        }
+
+        // reserve space for a record at the end of the data. the record becomes visible to readers on commit().
+        char *append(size_t size)
+        {
+            uint64_t end= header()->dataEnd;
+            if(end+size>mapSize && !grow((end+size+CAPTURE_GROW_SIZE) & ~(size_t)(CAPTURE_GROW_SIZE-1)))
+            {
+                flog(LOG_ERROR, "capture: can't grow file, capture stopped.\n");
+                indexCount= 0;
+                close();
+                return 0;
+            }
+            pending= size;
+            return map+end;
+        }
+
+        void commit()
+        { header()->dataEnd+= pending; }
+
+        void writeIndex()
+        {
+            uint64_t offset= header()->dataEnd;
+            CaptureRecord *r= (CaptureRecord*)append(captureRecordSize(sizeof(CaptureIndex)));
+            if(!r) return;
+            memset(r, 0, sizeof(*r));
+            r->time= indexLastTime;
+            r->size= sizeof(CaptureIndex);
+            r->source= CAPTURE_INDEX;
+            CaptureIndex *idx= (CaptureIndex*)(r+1);
+            idx->prevIndex= header()->lastIndex;
+            idx->firstRecord= indexStart;
+            idx->firstTime= indexFirstTime;
+            idx->lastTime= indexLastTime;
+            idx->count= indexCount;
+            idx->pad= 0;
+            commit();
+            header()->lastIndex= offset;
+            indexStart= header()->dataEnd;
+            indexCount= 0;
+        }
+};
+
+
+// read-only view of a capture file.
+class CaptureReader
+{
+    public:
+        CaptureReader(): map((char*)MAP_FAILED), mapSize(0) {}
+        ~CaptureReader() { if(map!=MAP_FAILED) munmap(map, mapSize); }
+
+        bool open(const char *filename)
+        {
+            int fd= ::open(filename, O_RDONLY);
+            if(fd<0) { logerror("capture: open"); return false; }
+            struct stat st;
+            if(fstat(fd, &st)<0 || (size_t)st.st_size<sizeof(CaptureFileHeader))
+            {
+                flog(LOG_ERROR, "capture: %s is too small.\n", filename);
+                ::close(fd);
+                return false;
+            }
+            mapSize= st.st_size;
+            map= (char*)mmap(0, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if(map==MAP_FAILED) { logerror("capture: mmap"); return false; }
+            if(memcmp(header()->magic, CAPTURE_MAGIC, sizeof(header()->magic)) || header()->version!=CAPTURE_VERSION)
+            {
+                flog(LOG_ERROR, "capture: %s is not a moodpd capture file.\n", filename);
+                return false;
+            }
+            pos= header()->headerSize;
+            return true;
+        }
+
+        const CaptureFileHeader *header() { return (const CaptureFileHeader*)map; }
+
+        // return the next datagram record or 0 at the end of the capture. index records are skipped.
+        const CaptureRecord *next()
+        {
+            while(true)
+            {
+                const CaptureRecord *r= recordAt(pos);
+                if(!r) return 0;
+                pos+= captureRecordSize(r->size);
+                if(r->source!=CAPTURE_INDEX) return r;
+            }
+        }
+
+        // position the reader at the first datagram received at or after 'time' (ns since capture start),
+        // using the index chain to skip blocks which end before it.
+        void seek(uint64_t time)
+        {
+            uint64_t start= header()->headerSize;
+            for(uint64_t offset= header()->lastIndex; offset; )
+            {
+                const CaptureRecord *r= recordAt(offset);
+                if(!r || r->source!=CAPTURE_INDEX) break;
+                const CaptureIndex *idx= (const CaptureIndex*)(r+1);
+                if(idx->lastTime<time) { start= offset; break; }
+                offset= idx->prevIndex;
+            }
+            pos= start;
+            uint64_t p;
+            const CaptureRecord *r;
+            do p= pos, r= next();
+            while(r && r->time<time);
+            pos= p;
+        }
+
+    private:
+        char *map;
+        size_t mapSize;
+        uint64_t pos;
+
+        const CaptureRecord *recordAt(uint64_t offset)
+        {
+            uint64_t end= min((uint64_t)mapSize, header()->dataEnd);
+            if(offset+sizeof(CaptureRecord)>end) return 0;
+            const CaptureRecord *r= (const CaptureRecord*)(map+offset);
+            if(offset+captureRecordSize(r->size)>end) return 0;
+            return r;
+        }
+};
+
+
+#endif //CAPTURE_H
@@ -0,0 +1,222 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+// client library for moodpd, header only. needs oscpkt (-Ioscpkt).
+//
+//      MoodpdClient c;
+//      c.connect("/run/moodpd.oscd", "trieste", 4243);     // UNIX datagram socket if it's there, else UDP
+//      c.setRgb(5, 255, 0, 0);                             // as often as you like
+//      c.update();                                         // in the main loop: at most one packet per frame
+//
+// updates wait for the next frame. a lamp set several times in between is sent once with its last color,
+// and lamps which are set to the color they had when last sent aren't sent at all. a frame is one
+// /moodpd/lamps/rgb message per run of changed lamps, in one OSC bundle if there are several. unchanged
+// lamps in a short gap between two runs are sent along, which is cheaper than another message. sends
+// never block: if the socket is full, the lamps stay pending for the next frame.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <oscpkt.hh>
+
+#define CLIENT_LAMPS        256
+#define CLIENT_FRAME_RATE   40      // default frames per second, moodpd's default
+#define CLIENT_MAX_GAP      8       // unchanged lamps between two runs which are sent to join them
+
+enum ClientTransport { TRANSPORT_NONE, TRANSPORT_UNIX, TRANSPORT_UDP };
+
+struct ClientStats
+{
+    uint64_t updates;       // lamp colors set by the application
+    uint64_t changed;       // lamp colors sent because they changed. updates-changed were coalesced
+    uint64_t lamps;         // lamp colors sent, including the ones sent along in gaps
+    uint64_t messages, packets, bytes;
+    uint64_t deferred;      // frames kept for later because the socket was full
+    uint64_t errors;
+};
+
+
+class MoodpdClient
+{
+    public:
+        MoodpdClient(): fd(-1), transport(TRANSPORT_NONE), frameNs(1000000000ull/CLIENT_FRAME_RATE), lastSendNs(0)
+        {
+            memset(want, 0, sizeof(want));
+            memset(sent, 0, sizeof(sent));
+            memset(&counters, 0, sizeof(counters));
+        }
+
+        ~MoodpdClient() { close(); }
+
+        // connect to moodpd's UNIX datagram socket ("unixdgram" in its config) if 'unixPath' is given and
+        // accepts us, else over UDP to its OSC port. the lamps are assumed to be black.
+        bool connect(const char *unixPath, const char *host= "localhost", int port= 4243)
+        {
+            close();
+            if(unixPath && *unixPath && strlen(unixPath)<sizeof(((sockaddr_un*)0)->sun_path))
+            {
+                sockaddr_un sa;
+                memset(&sa, 0, sizeof(sa));
+                sa.sun_family= AF_UNIX;
+                strcpy(sa.sun_path, unixPath);
+                if( (fd= socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0))>=0 && ::connect(fd, (sockaddr*)&sa, sizeof(sa))==0 )
+                {
+                    transport= TRANSPORT_UNIX;
+                    return true;
+                }
+                close();
+            }
+            char service[16];
+            snprintf(service, sizeof(service), "%d", port);
+            addrinfo hints, *res;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_socktype= SOCK_DGRAM;
+            if(getaddrinfo(host, service, &hints, &res)) return false;
+            for(addrinfo *ai= res; ai && fd<0; ai= ai->ai_next)
+            {
+                fd= socket(ai->ai_family, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+                if(fd>=0 && ::connect(fd, ai->ai_addr, ai->ai_addrlen)<0) close();
+            }
+            freeaddrinfo(res);
+            if(fd<0) return false;
+            transport= TRANSPORT_UDP;
+            return true;
+        }
+
+        void close()
+        {
+            if(fd>=0) ::close(fd);
+            fd= -1;
+            transport= TRANSPORT_NONE;
+        }
+
+        int getTransport() const { return transport; }
+
+        const char *transportName() const
+        {
+            static const char *names[]= { "none", "unix", "udp" };
+            return names[transport];
+        }
+
+        // frames per second, 0 sends every update() call.
+        void setFrameRate(int fps)
+        { frameNs= fps>0? 1000000000ull/fps: 0; }
+
+        void setRgb(int lamp, uint8_t r, uint8_t g, uint8_t b)
+        {
+            if(lamp<0 || lamp>=CLIENT_LAMPS) return;
+            uint8_t *p= want+lamp*3;
+            p[0]= r, p[1]= g, p[2]= b;
+            counters.updates++;
+        }
+
+        // 'count' lamps from packed RGB triplets.
+        void setRgb(int first, const uint8_t *rgb, int count)
+        {
+            if(first<0 || first>=CLIENT_LAMPS) return;
+            if(count>CLIENT_LAMPS-first) count= CLIENT_LAMPS-first;
+            memcpy(want+first*3, rgb, count*3);
+            counters.updates+= count;
+        }
+
+        void setAll(uint8_t r, uint8_t g, uint8_t b)
+        {
+            for(int i= 0; i<CLIENT_LAMPS; i++) setRgb(i, r, g, b);
+        }
+
+        // ns until the next frame may be sent.
+        uint64_t nextFrameNs() const
+        {
+            uint64_t now= nowNs();
+            return now-lastSendNs>=frameNs? 0: lastSendNs+frameNs-now;
+        }
+
+        // send what changed if a frame has passed since the last packet. returns false on errors.
+        bool update()
+        {
+            if(nextFrameNs()) return true;
+            return flush();
+        }
+
+        // send what changed now.
+        bool flush()
+        {
+            if(fd<0) return false;
+            int first[CLIENT_LAMPS], last[CLIENT_LAMPS], runs= 0, changed= 0;
+            for(int i= 0; i<CLIENT_LAMPS; i++)
+            {
+                if(!memcmp(want+i*3, sent+i*3, 3)) continue;
+                changed++;
+                if(runs && i-last[runs-1]<=CLIENT_MAX_GAP+1) last[runs-1]= i;
+                else first[runs]= last[runs]= i, runs++;
+            }
+            if(!runs) return true;
+
+            writer.init();
+            if(runs>1) writer.startBundle();
+            int lamps= 0;
+            for(int n= 0; n<runs; n++)
+            {
+                int count= last[n]-first[n]+1;
+                message.init("/moodpd/lamps/rgb").pushInt32(first[n]).pushBlob(want+first[n]*3, count*3);
+                writer.addMessage(message);
+                lamps+= count;
+            }
+            if(runs>1) writer.endBundle();
+
+            ssize_t sz= send(fd, writer.packetData(), writer.packetSize(), MSG_DONTWAIT|MSG_NOSIGNAL);
+            if(sz<0)
+            {
+                // a full socket isn't an error, the lamps go out with the next frame.
+                if(errno==EAGAIN || errno==EWOULDBLOCK || errno==ENOBUFS) { counters.deferred++; return true; }
+                counters.errors++;
+                return false;
+            }
+            memcpy(sent, want, sizeof(sent));
+            lastSendNs= nowNs();
+            counters.changed+= changed;
+            counters.lamps+= lamps;
+            counters.messages+= runs;
+            counters.packets++;
+            counters.bytes+= sz;
+            return true;
+        }
+
+        const ClientStats &stats() const { return counters; }
+
+        void printStats(FILE *f) const
+        {
+            const ClientStats &s= counters;
+            fprintf(f, "moodpd client (%s): %llu updates, %llu coalesced, %llu lamps in %llu messages, %llu packets, "
+                    "%llu bytes, %llu frames deferred, %llu errors\n", transportName(),
+                    (unsigned long long)s.updates, (unsigned long long)(s.updates-s.changed), (unsigned long long)s.lamps,
+                    (unsigned long long)s.messages, (unsigned long long)s.packets, (unsigned long long)s.bytes,
+                    (unsigned long long)s.deferred, (unsigned long long)s.errors);
+        }
+
+    private:
+        int fd, transport;
+        uint64_t frameNs, lastSendNs;
+        uint8_t want[CLIENT_LAMPS*3];       // colors set by the application
+        uint8_t sent[CLIENT_LAMPS*3];       // colors as last sent
+        ClientStats counters;
+        oscpkt::PacketWriter writer;        // kept, so their buffers are reused
+        oscpkt::Message message;
+
+        static uint64_t nowNs()
+        {
+            timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return ts.tv_sec*1000000000ull + ts.tv_nsec;
+        }
+};
+
+
+#endif //CLIENT_H
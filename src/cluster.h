@@ -0,0 +1,131 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+// clustering. every node drives the lamps in its own lamprange and knows which peer owns which other
+// range (config: "peer = 16-31 host:port"). a node accepts packets for any lamp; changes to lamps owned
+// by a peer are noted per peer and sent once per frame, as one OSC bundle of /moodpd/cluster/rgb
+// messages per peer, one message per run of consecutive lamps, with the colors the lamps have then.
+// nodes don't forward what they got from a peer, so misconfigured ranges can't make packets loop.
+
+#define CLUSTER_RGB_ADDRESS "/moodpd/cluster/rgb"   // int32 first lamp, blob RGB triplets
+
+
+struct ClusterPeer
+{
+    string name;                // as written in the config
+    int firstLamp, lastLamp;
+    sockaddr_storage addr;
+    socklen_t addrLen;
+
+    bool operator==(const ClusterPeer &other) const
+    { return name==other.name && firstLamp==other.firstLamp && lastLamp==other.lastLamp; }
+};
+
+// parse "FIRST-LAST HOST[:PORT]". IPv6 addresses with a port are written as [ADDR]:PORT.
+inline bool parseClusterPeer(const string &value, ClusterPeer &peer)
+{
+    char host[256];
+    int n= 0;
+    if(sscanf(value.c_str(), "%d-%d %255s%n", &peer.firstLamp, &peer.lastLamp, host, &n)!=3 ||
+       value.find_first_not_of(" \t", n)!=string::npos ||
+       peer.firstLamp<0 || peer.lastLamp>=MAX_LAMPS || peer.lastLamp<peer.firstLamp)
+        return false;
+
+    if(!resolveHostPort(host, DEFAULT_PORT+1, peer.addr, peer.addrLen)) return false;
+    peer.name= host;
+    return true;
+}
+
+
+class ClusterForwarder
+{
+    public:
+        ClusterForwarder(): address(CLUSTER_RGB_ADDRESS), sentBundles(0), sendErrors(0) {}
+
+        // note the dirty lamps owned by peers and not driven locally (routing target -1) for the next frame.
+        void collect(const LampState &lamps, const LampRouting &routing, const vector<ClusterPeer> &peers)
+        {
+            if(pendingLamps.size()<peers.size()) pendingLamps.resize(peers.size());
+            for(size_t p= 0; p<peers.size(); p++)
+            {
+                const ClusterPeer &peer= peers[p];
+                uint64_t *bits= pendingLamps[p].bits;
+                for(int w= peer.firstLamp/64; w<=peer.lastLamp/64; w++)
+                    for(uint64_t dirty= lamps.dirty[w]; dirty; dirty&= dirty-1)
+                    {
+                        int i= w*64 + __builtin_ctzll(dirty);
+                        if(i<peer.firstLamp || i>peer.lastLamp || routing.target[i]>=0) continue;
+                        bits[w]|= 1ull<<(i&63);
+                    }
+            }
+        }
+
+        bool pending() const
+        {
+            for(size_t p= 0; p<pendingLamps.size(); p++)
+                for(int w= 0; w<MAX_LAMPS/64; w++) if(pendingLamps[p].bits[w]) return true;
+            return false;
+        }
+
+        // send the noted lamps out of 'fd', one bundle per peer. called once per frame, and with the peer
+        // list they were collected for.
+        void flush(const LampState &lamps, const vector<ClusterPeer> &peers, int fd)
+        {
+            for(size_t p= 0; p<peers.size() && p<pendingLamps.size(); p++)
+            {
+                const ClusterPeer &peer= peers[p];
+                uint64_t *bits= pendingLamps[p].bits;
+                bool empty= true;
+                for(int i= peer.firstLamp; i<=peer.lastLamp; i++)
+                {
+                    if(!(bits[i>>6]>>(i&63) & 1)) continue;
+                    int first= i;
+                    for(; i<=peer.lastLamp && (bits[i>>6]>>(i&63) & 1); i++)
+                    {
+                        rgb[(i-first)*3]= lamps.red[i];
+                        rgb[(i-first)*3+1]= lamps.green[i];
+                        rgb[(i-first)*3+2]= lamps.blue[i];
+                    }
+                    if(empty) writer.init().startBundle(), empty= false;
+                    msg.init(address).pushInt32(first).pushBlob(rgb, (i-first)*3);
+                    writer.addMessage(msg);
+                }
+                if(empty) continue;
+                memset(bits, 0, sizeof(pendingLamps[p].bits));
+                writer.endBundle();
+                send(fd, peer);
+            }
+        }
+
+        uint64_t bundlesSent() const { return sentBundles; }
+
+    private:
+        struct PeerLamps
+        {
+            uint64_t bits[MAX_LAMPS/64];
+            PeerLamps() { memset(bits, 0, sizeof(bits)); }
+        };
+
+        oscpkt::PacketWriter writer;
+        oscpkt::Message msg;
+        const string address;
+        uint8_t rgb[MAX_LAMPS*3];
+        vector<PeerLamps> pendingLamps;     // lamps to send, by peer index
+        uint64_t sentBundles, sendErrors;
+
+        void send(int fd, const ClusterPeer &peer)
+        {
+            sockaddr_storage to;
+            socklen_t toLen= sendAddress(fd, peer.addr, peer.addrLen, to);
+            if(sendto(fd, writer.packetData(), writer.packetSize(), MSG_DONTWAIT, (sockaddr*)&to, toLen)<0)
+            {
+                if(sendErrors++%1000==0)
+                    flog(LOG_ERROR, "forwarding to peer %s: %s\n", peer.name.c_str(), strerror(errno));
+                return;
+            }
+            sentBundles++;
+        }
+};
+
+
+#endif //CLUSTER_H
@@ -0,0 +1,77 @@
+#ifndef COLOR_H
+#define COLOR_H
+
+// color conversions for the HSV and 16 bit endpoints. everything is fixed point and works on
+// separate channel arrays, so converting many lamps at once is one branch-free loop the compiler
+// vectorizes.
+//
+// hue is in units of 1/256 of a 60 degree sector, 0..HUE_SCALE-1 for the whole circle. saturation
+// and value are 0..255.
+
+#define HUE_SCALE 1536
+
+// one channel of the HSV -> RGB formula, c= v - v*s*clamp(min(k, 4-k), 0, 1) with k= (n + h/60) mod 6,
+// all scaled by 256. 's' is scaled to 0..256.
+inline uint8_t hsvChannel(int h, int offset, int s, int v)
+{
+    int k= h+offset;
+    k-= (k>=HUE_SCALE? HUE_SCALE: 0);
+    int m= (k<1024-k? k: 1024-k);
+    m= (m<0? 0: m>256? 256: m);
+    return v - ((v*s*m + 32768)>>16);
+}
+
+// convert 'count' lamps. hue values must be below HUE_SCALE.
+inline void hsvToRgb(const uint16_t *h, const uint8_t *s, const uint8_t *v, uint8_t *r, uint8_t *g, uint8_t *b, int count)
+{
+    for(int i= 0; i<count; i++)
+    {
+        int ss= s[i] + (s[i]>>7);   // 255 -> 256, so full saturation gives exactly 0
+        r[i]= hsvChannel(h[i], 5*256, ss, v[i]);
+        g[i]= hsvChannel(h[i], 3*256, ss, v[i]);
+        b[i]= hsvChannel(h[i], 1*256, ss, v[i]);
+    }
+}
+
+// split packed 8 bit H, S, V triplets (hue 0..255 for the whole circle) into channel arrays for hsvToRgb().
+inline void unpackHsv(const uint8_t *hsv, uint16_t *h, uint8_t *s, uint8_t *v, int count)
+{
+    for(int i= 0; i<count; i++)
+    {
+        h[i]= hsv[i*3]*6;
+        s[i]= hsv[i*3+1];
+        v[i]= hsv[i*3+2];
+    }
+}
+
+// 16 bit color value to 8 bit, rounded.
+inline uint8_t color16To8(uint32_t x)
+{ return (x*255 + 32895)>>16; }
+
+// split packed big endian 16 bit R, G, B triplets (6 bytes per lamp) into 8 bit channel arrays.
+inline void unpackRgb16(const uint8_t *rgb, uint8_t *r, uint8_t *g, uint8_t *b, int count)
+{
+    for(int i= 0; i<count; i++)
+    {
+        const uint8_t *p= rgb+i*6;
+        r[i]= color16To8(p[0]<<8 | p[1]);
+        g[i]= color16To8(p[2]<<8 | p[3]);
+        b[i]= color16To8(p[4]<<8 | p[5]);
+    }
+}
+
+// float 0..1 to 8 bit, clamped. NaN gives 0.
+inline uint8_t colorFloatTo8(float x)
+{ return !(x>0)? 0: x>=1? 255: (uint8_t)(x*255.0f+0.5f); }
+
+// float hue in turns (any value, wraps around) to fixed point.
+inline uint16_t hueFromFloat(float h)
+{
+    if(!(h==h) || h>1e6f || h<-1e6f) return 0;
+    h-= floorf(h);
+    int fixed= (int)(h*HUE_SCALE+0.5f);
+    return fixed>=HUE_SCALE? 0: fixed;
+}
+
+
+#endif //COLOR_H
@@ -0,0 +1,318 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// daemon configuration. a Config is built from the defaults, the config file (-c FILE) and the
+// command line options, which override the file. it is never modified after loading: reloading
+// builds a new Config and the main loop swaps it in.
+//
+// config file syntax, one setting per line, '#' starts a comment:
+//
+//      tty = /dev/ttyUSB0          moodlamp tty
+//      protocol = text             protocol of the lamps on the tty: text (new firmware) or muccc
+//      rawport = 4242              raw command port
+//      oscport = 4243              OSC port (default: rawport+1)
+//      rawmode = on                allow raw mode
+//      log = i                     logging flags, like -l
+//      maxpacketrate = 1000        drop packets above this rate (per second, 0: unlimited)
+//      rcvbuf = 1048576            receive buffer size of the raw and OSC sockets in bytes (0: system default)
+//      framerate = 40              frames per second of the built-in effects and inputs
+//      input = /fader/1 0 0-3 red 0 1 lowpass 0.1     map argument 0 of /fader/1 (range 0..1) to the red channel
+//                                  of lamps 0..3, smoothed (lowpass SECONDS or slew RANGES_PER_SECOND), "wrap" for
+//                                  angles, may be repeated.
+//                                  unless /ori is mapped, andOSC's /ori roll, yaw, pitch set red, green, blue of all lamps.
+//      upgradesocket = /run/moodpd.sock    take over from a running instance and listen for upgrades here
+//      multicast = 239.42.42.42    also receive on this multicast group, may be repeated
+//      multicast = ff15::4242 eth0 multicast group on a given interface
+//      lamprange = 16-31           only send lamps 16..31, ignore the rest
+//      peer = 32-63 host2:4243     cluster peer driving lamps 32..63, may be repeated
+//      forward = /dali/ host3:4243 send OSC messages starting with /dali/ to host3 instead, may be repeated
+//      artnet = on                 listen for Art-Net on port 6454
+//      sacn = on                   listen for sACN (E1.31) on port 5568, joining the patched universes' groups
+//      sacninterface = eth0        interface for the sACN multicast groups
+//      dmx = 1 1 0 170             universe 1, channels 1..510 -> lamps 0..169 (R, G, B per lamp)
+//      output = artnet 10.0.0.9 0 0 170    also send lamps 0..169 as Art-Net universe 0 to 10.0.0.9, may be repeated.
+//                                  see output.h for sacn, file and null outputs.
+//      tcpport = 4243              accept SLIP-framed OSC over TCP on this port (0: off)
+//      unixsocket = /run/moodpd.osc        SLIP-framed OSC over a UNIX stream socket
+//      unixdgram = /run/moodpd.oscd        OSC over a UNIX datagram socket
+//      subscribers = 10.0.0.0/24   also allow subscriptions over UDP from this network (only local ones otherwise),
+//                                  may be repeated
+//      priority = interactive port 4243    priority class (interactive, normal, bulk) of packets arriving on a port,
+//      priority = bulk source 10.1.0.0/16  from a sender address or network,
+//      priority = interactive osc /midi/   or with an OSC address starting with a prefix. may be repeated, the most
+//                                  urgent matching class wins, packets matching none are normal.
+//      lanewait = 200              longest time in ms a less urgent class waits for the serial line (0: strict priority)
+//      merge = htp                 combine the sources driving a lamp: off (last packet wins), ltp, htp or priority
+//      mergetimeout = 2500         drop a source after this many ms without packets (0: never)
+//      realtime = 50               run under SCHED_FIFO with this priority, lock memory (0: off)
+//      cpu = 3                     pin moodpd to this CPU (-1: any)
+//      lamp 5 = 12                 send lamp 5 to lamp 12 on the bus
+//      lamp 16-31 = 0              send lamps 16..31 to 0..15
+//      lamp 40 = off               ignore lamp 40
+
+#include <fstream>
+
+
+struct Config
+{
+    string tty;
+    int protocol;
+    int rawPort, oscPort;
+    bool allowRawMode;
+    uint32_t logMask;
+    int maxPacketRate;
+    int receiveBuffer;
+    int frameRate;
+    string upgradeSocket;
+    vector<string> multicastGroups;
+    int firstLamp, lastLamp;
+    vector<ClusterPeer> peers;
+    vector<ForwardRule> forwards;
+    bool artnet, sacn;
+    string sacnInterface;
+    vector<DmxPatch> dmxPatches;
+    vector<OutputSpec> outputs;
+    vector<InputMapping> inputs;
+    int tcpPort;
+    string unixSocket, unixDgram;
+    vector<SubscriberNetwork> subscriberNets;
+    vector<PriorityRule> priorities;
+    int laneWaitMs;
+    int mergeMode;
+    int mergeTimeoutMs;
+    int realtimePriority;
+    int cpu;
+    LampRouting routing;
+
+    Config(): tty("/dev/ttyUSB0"), protocol(PROTOCOL_TEXT), rawPort(DEFAULT_PORT), oscPort(-1), allowRawMode(false),
+        logMask(1<<LOG_ERROR), maxPacketRate(0), receiveBuffer(0), frameRate(40), firstLamp(0), lastLamp(MAX_LAMPS-1),
+        artnet(false), sacn(false), tcpPort(0), laneWaitMs(200), mergeMode(MERGE_OFF), mergeTimeoutMs(2500),
+        realtimePriority(0), cpu(-1)
+    { }
+
+    // load the config file (if any), then apply the command line settings, which use the same
+    // "key = value" syntax. returns false on errors.
+    bool load(const string &filename, const vector<string> &overrides)
+    {
+        if(!filename.empty())
+        {
+            ifstream f(filename.c_str());
+            if(!f)
+            {
+                flog(LOG_ERROR, "can't open config file %s: %s\n", filename.c_str(), strerror(errno));
+                return false;
+            }
+            string line;
+            for(int lineNo= 1; getline(f, line); lineNo++)
+                if(!parseLine(line, filename.c_str(), lineNo)) return false;
+        }
+        for(size_t i= 0; i<overrides.size(); i++)
+            if(!parseLine(overrides[i], "command line", 0)) return false;
+        if(oscPort<0) oscPort= rawPort+1;
+        bool oriMapped= false;
+        for(size_t i= 0; i<inputs.size(); i++) if(inputs[i].address=="/ori") oriMapped= true;
+        if(!oriMapped)
+            for(int i= 0; i<3; i++)
+            {
+                InputMapping m;
+                char spec[64];
+                snprintf(spec, sizeof(spec), "/ori %d all %s -180 180 lowpass 0.1 wrap", i, i==0? "red": i==1? "green": "blue");
+                parseInputMapping(spec, m);
+                inputs.push_back(m);
+            }
+        for(int i= 0; i<MAX_LAMPS; i++)
+            if(i<firstLamp || i>lastLamp) routing.target[i]= -1;
+        return true;
+    }
+
+    static bool parseLogFlags(const char *flags, uint32_t &mask)
+    {
+        for(int i= 0; flags[i]; i++) switch(flags[i])
+        {
+            case 'i':
+                mask|= (1<<LOG_INFO);
+            case 'e':
+                mask|= (1<<LOG_ERROR);
+                break;
+            case 'q':
+                mask= 0;
+                break;
+            default:
+                return false;
+        }
+        return true;
+    }
+
+    private:
+        bool parseLine(string line, const char *source, int lineNo)
+        {
+            size_t hash= line.find('#');
+            if(hash!=string::npos) line.erase(hash);
+            size_t eq= line.find('=');
+            string key= trim(line.substr(0, eq)), value= (eq==string::npos? "": trim(line.substr(eq+1)));
+            if(key.empty() && eq==string::npos) return true;   // empty line
+            if(key.empty() || eq==string::npos)
+                return error(source, lineNo, "expected 'key = value'");
+
+            if(key=="tty") tty= value;
+            else if(key=="protocol") { if( (protocol= lampProtocol(value))<0 ) return error(source, lineNo, "expected text or muccc"); }
+            else if(key=="rawport") { if(!parseInt(value, rawPort, 1, 65535)) return error(source, lineNo, "bad port"); }
+            else if(key=="oscport") { if(!parseInt(value, oscPort, 1, 65535)) return error(source, lineNo, "bad port"); }
+            else if(key=="rawmode") { if(!parseBool(value, allowRawMode)) return error(source, lineNo, "expected on or off"); }
+            else if(key=="log")
+            {
+                logMask= 0;
+                if(!parseLogFlags(value.c_str(), logMask)) return error(source, lineNo, "bad logging flags");
+            }
+            else if(key=="upgradesocket") upgradeSocket= value;
+            else if(key=="multicast")
+            {
+                group_req gr;
+                if(!parseMulticastGroup(value, gr)) return error(source, lineNo, "bad multicast group or interface");
+                multicastGroups.push_back(value);
+            }
+            else if(key=="peer")
+            {
+                ClusterPeer peer;
+                if(!parseClusterPeer(value, peer)) return error(source, lineNo, "expected 'peer = FIRST-LAST HOST[:PORT]'");
+                peers.push_back(peer);
+            }
+            else if(key=="forward")
+            {
+                ForwardRule rule;
+                if(!parseForwardRule(value, rule)) return error(source, lineNo, "expected 'forward = /PREFIX HOST[:PORT]'");
+                forwards.push_back(rule);
+            }
+            else if(key=="artnet") { if(!parseBool(value, artnet)) return error(source, lineNo, "expected on or off"); }
+            else if(key=="sacn") { if(!parseBool(value, sacn)) return error(source, lineNo, "expected on or off"); }
+            else if(key=="sacninterface") sacnInterface= value;
+            else if(key=="dmx")
+            {
+                DmxPatch patch;
+                if(!parseDmxPatch(value, patch)) return error(source, lineNo, "expected 'dmx = UNIVERSE CHANNEL FIRSTLAMP COUNT'");
+                dmxPatches.push_back(patch);
+            }
+            else if(key=="output")
+            {
+                OutputSpec spec;
+                if(!parseOutputSpec(value, spec))
+                    return error(source, lineNo, "expected 'output = artnet HOST[:PORT] UNIVERSE FIRSTLAMP COUNT|sacn UNIVERSE FIRSTLAMP COUNT [HOST[:PORT]]|file PATH|null'");
+                outputs.push_back(spec);
+            }
+            else if(key=="tcpport") { if(!parseInt(value, tcpPort, 0, 65535)) return error(source, lineNo, "bad port"); }
+            else if(key=="unixsocket") unixSocket= value;
+            else if(key=="unixdgram") unixDgram= value;
+            else if(key=="subscribers")
+            {
+                SubscriberNetwork n;
+                if(!parseSubscriberNetwork(value, n)) return error(source, lineNo, "expected an address or ADDRESS/BITS");
+                subscriberNets.push_back(n);
+            }
+            else if(key=="priority")
+            {
+                PriorityRule rule;
+                if(!parsePriorityRule(value, rule))
+                    return error(source, lineNo, "expected 'priority = CLASS port N|source ADDRESS[/BITS]|osc /PREFIX'");
+                priorities.push_back(rule);
+            }
+            else if(key=="lanewait") { if(!parseInt(value, laneWaitMs, 0, 60000)) return error(source, lineNo, "bad time"); }
+            else if(key=="merge") { if( (mergeMode= ::mergeMode(value))<0 ) return error(source, lineNo, "expected off, ltp, htp or priority"); }
+            else if(key=="mergetimeout") { if(!parseInt(value, mergeTimeoutMs, 0, 3600000)) return error(source, lineNo, "bad time"); }
+            else if(key=="realtime") { if(!parseInt(value, realtimePriority, 0, 99)) return error(source, lineNo, "expected a priority of 1..99 or 0"); }
+            else if(key=="cpu") { if(!parseInt(value, cpu, -1, CPU_SETSIZE-1)) return error(source, lineNo, "bad CPU number"); }
+            else if(key=="lamprange")
+            {
+                if(sscanf(value.c_str(), "%d-%d", &firstLamp, &lastLamp)!=2 ||
+                   firstLamp<0 || lastLamp>=MAX_LAMPS || lastLamp<firstLamp)
+                    return error(source, lineNo, "bad lamp range");
+            }
+            else if(key=="input")
+            {
+                InputMapping m;
+                if(!parseInputMapping(value, m)) return error(source, lineNo, "bad input mapping");
+                inputs.push_back(m);
+            }
+            else if(key=="framerate") { if(!parseInt(value, frameRate, 1, 1000)) return error(source, lineNo, "bad frame rate"); }
+            else if(key=="rcvbuf") { if(!parseInt(value, receiveBuffer, 0, 1<<30)) return error(source, lineNo, "bad buffer size"); }
+            else if(key=="maxpacketrate") { if(!parseInt(value, maxPacketRate, 0, 1<<30)) return error(source, lineNo, "bad rate"); }
+            else if(key.compare(0, 5, "lamp ")==0)
+            {
+                int first, last, target= -1;
+                const char *range= key.c_str()+5;
+                if(sscanf(range, "%d-%d", &first, &last)!=2)
+                {
+                    if(sscanf(range, "%d", &first)!=1) return error(source, lineNo, "bad lamp index");
+                    last= first;
+                }
+                if(first<0 || last>=MAX_LAMPS || last<first)
+                    return error(source, lineNo, "bad lamp range");
+                if(value!="off" && !parseInt(value, target, 0, MAX_LAMPS-(last-first)-1))
+                    return error(source, lineNo, "bad lamp target");
+                for(int i= first; i<=last; i++)
+                    routing.target[i]= (target<0? -1: target+i-first);
+            }
+            else
+                return error(source, lineNo, ("unknown setting '" + key + "'").c_str());
+            return true;
+        }
+
+        static bool error(const char *source, int lineNo, const char *msg)
+        {
+            if(lineNo) flog(LOG_ERROR, "%s, line %d: %s\n", source, lineNo, msg);
+            else flog(LOG_ERROR, "%s: %s\n", source, msg);
+            return false;
+        }
+
+        static string trim(const string &s)
+        {
+            size_t b= s.find_first_not_of(" \t\r\n"), e= s.find_last_not_of(" \t\r\n");
+            return b==string::npos? "": s.substr(b, e-b+1);
+        }
+
+        static bool parseInt(const string &s, int &v, int min, int max)
+        {
+            char *end;
+            long l= strtol(s.c_str(), &end, 0);
+            if(s.empty() || *end || l<min || l>max) return false;
+            v= l;
+            return true;
+        }
+
+        static bool parseBool(const string &s, bool &v)
+        {
+            if(s=="on" || s=="yes" || s=="1" || s=="true") v= true;
+            else if(s=="off" || s=="no" || s=="0" || s=="false") v= false;
+            else return false;
+            return true;
+        }
+};
+
+
+// simple token bucket for limiting packet rates.
+class RateLimiter
+{
+    public:
+        RateLimiter(): tokens(0), lastRefill(0), dropped(0) {}
+
+        // returns false if the packet should be dropped. a rate of 0 means unlimited.
+        bool allow(int rate)
+        {
+            if(rate<=0) return true;
+            uint64_t now= monotonicNs();
+            tokens= min(double(rate), tokens + (now-lastRefill)*1e-9*rate);    // allow bursts of up to one second
+            lastRefill= now;
+            if(tokens<1) { dropped++; return false; }
+            tokens-= 1;
+            return true;
+        }
+
+        uint64_t droppedPackets() { return dropped; }
+
+    private:
+        double tokens;
+        uint64_t lastRefill;
+        uint64_t dropped;
+};
+
+
+#endif //CONFIG_H
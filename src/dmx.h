@@ -0,0 +1,131 @@
+#ifndef DMX_H
+#define DMX_H
+
+// DMX ingest: Art-Net (ArtDmx) and sACN (E1.31) data packets. a patch maps runs of RGB channel
+// triplets in a universe onto consecutive lamps; applying it copies each run straight into the lamp
+// state, marking only lamps whose color actually changed (desks resend the whole universe ~40 times a
+// second whether anything changed or not). the same packets are built for DMX outputs (output.h).
+
+#define ARTNET_PORT     6454
+#define SACN_PORT       5568
+#define DMX_CHANNELS    512
+#define SACN_HEADER     126     // bytes before the channel data of an E1.31 data packet
+
+static const uint8_t sacnAcnId[16]= { 0x00, 0x10, 0x00, 0x00, 'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0x00, 0x00, 0x00 };
+
+
+// "dmx = UNIVERSE CHANNEL FIRSTLAMP COUNT": COUNT lamps starting at FIRSTLAMP take their R, G, B values
+// from channels CHANNEL, CHANNEL+1, ... of UNIVERSE. channels count from 1 like on a desk.
+struct DmxPatch
+{
+    int universe;
+    int channel;        // 0-based offset into the universe's data
+    int firstLamp, count;
+
+    bool operator==(const DmxPatch &o) const
+    { return universe==o.universe && channel==o.channel && firstLamp==o.firstLamp && count==o.count; }
+};
+
+inline bool parseDmxPatch(const string &value, DmxPatch &patch)
+{
+    int n= 0;
+    if(sscanf(value.c_str(), "%d %d %d %d%n", &patch.universe, &patch.channel, &patch.firstLamp, &patch.count, &n)!=4 ||
+       value.find_first_not_of(" \t", n)!=string::npos)
+        return false;
+    patch.channel--;
+    return patch.universe>=0 && patch.universe<32768 && patch.channel>=0 && patch.count>0 &&
+           patch.channel+patch.count*3<=DMX_CHANNELS &&
+           patch.firstLamp>=0 && patch.firstLamp+patch.count<=MAX_LAMPS;
+}
+
+
+// ArtDmx: "Art-Net\0", opcode 0x5000 (little endian), protocol version, sequence, physical,
+// 15 bit port address (little endian), length (big endian), data.
+inline const uint8_t *parseArtDmx(const uint8_t *p, size_t size, int &universe, int &length)
+{
+    if(size<18 || memcmp(p, "Art-Net\0", 8) || p[8]!=0x00 || p[9]!=0x50) return 0;
+    universe= (p[14] | p[15]<<8) & 0x7fff;
+    length= p[16]<<8 | p[17];
+    if(length>DMX_CHANNELS || size<18+(size_t)length) return 0;
+    return p+18;
+}
+
+// E1.31 data packet: root layer (ACN identifier, vector 4), framing layer (vector 2, universe at 113),
+// DMP layer (property value count at 123, start code at 125, data from 126).
+inline const uint8_t *parseSacn(const uint8_t *p, size_t size, int &universe, int &length)
+{
+    if(size<SACN_HEADER || memcmp(p, sacnAcnId, sizeof(sacnAcnId))) return 0;
+    if(p[18]!=0 || p[19]!=0 || p[20]!=0 || p[21]!=4) return 0;         // root vector: E1.31 data
+    if(p[40]!=0 || p[41]!=0 || p[42]!=0 || p[43]!=2) return 0;         // framing vector: DMP
+    if(p[112] & 0x40) return 0;                                        // stream terminated
+    if(p[117]!=2 || p[125]!=0) return 0;                               // DMP set property, DMX start code 0
+    universe= p[113]<<8 | p[114];
+    length= (p[123]<<8 | p[124]) - 1;
+    if(length<0 || length>DMX_CHANNELS || size<SACN_HEADER+(size_t)length) return 0;
+    return p+SACN_HEADER;
+}
+
+// an ArtDmx packet with 'length' channels (even, 2..512). returns its size.
+inline size_t buildArtDmx(uint8_t *p, int universe, uint8_t sequence, const uint8_t *data, int length)
+{
+    memcpy(p, "Art-Net\0", 8);
+    p[8]= 0x00; p[9]= 0x50;             // OpDmx
+    p[10]= 0; p[11]= 14;                // protocol version
+    p[12]= sequence;
+    p[13]= 0;                           // physical port
+    p[14]= universe&255; p[15]= universe>>8 & 0x7f;
+    p[16]= length>>8; p[17]= length&255;
+    memcpy(p+18, data, length);
+    return 18+length;
+}
+
+// an E1.31 data packet with priority 100 from the source 'cid' (16 bytes) called 'sourceName'. returns its size.
+inline size_t buildSacn(uint8_t *p, const uint8_t *cid, const char *sourceName, int universe, uint8_t sequence,
+                        const uint8_t *data, int length)
+{
+    size_t size= SACN_HEADER+length;
+    memset(p, 0, SACN_HEADER);
+    memcpy(p, sacnAcnId, sizeof(sacnAcnId));
+    // each layer starts with flags (0x7) and its length in 12 bits.
+    p[16]= 0x70 | (size-16)>>8; p[17]= (size-16)&255;
+    p[21]= 4;                           // root vector: E1.31 data
+    memcpy(p+22, cid, 16);
+    p[38]= 0x70 | (size-38)>>8; p[39]= (size-38)&255;
+    p[43]= 2;                           // framing vector: DMP
+    strncpy((char*)p+44, sourceName, 63);
+    p[108]= 100;                        // priority
+    p[111]= sequence;
+    p[113]= universe>>8; p[114]= universe&255;
+    p[115]= 0x70 | (size-115)>>8; p[116]= (size-115)&255;
+    p[117]= 2;                          // DMP set property
+    p[118]= 0xa1;                       // address and data type
+    p[122]= 1;                          // address increment
+    p[123]= (length+1)>>8; p[124]= (length+1)&255;     // property values: start code and channels
+    memcpy(p+SACN_HEADER, data, length);
+    return size;
+}
+
+// the multicast group a sACN universe is sent to.
+inline string sacnGroup(int universe)
+{
+    char group[32];
+    snprintf(group, sizeof(group), "239.255.%d.%d", (universe>>8)&255, universe&255);
+    return group;
+}
+
+// apply all patches for 'universe'. channels past 'length' (short packets) are left alone.
+// returns the number of lamps that changed.
+inline int applyDmx(const vector<DmxPatch> &patches, int universe, const uint8_t *data, int length, LampState &lamps)
+{
+    int changed= 0;
+    for(size_t i= 0; i<patches.size(); i++)
+    {
+        const DmxPatch &p= patches[i];
+        if(p.universe!=universe || p.channel>=length) continue;
+        changed+= lamps.updatePacked(p.firstLamp, data+p.channel, min(p.count, (length-p.channel)/3));
+    }
+    return changed;
+}
+
+
+#endif //DMX_H
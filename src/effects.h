@@ -0,0 +1,214 @@
+#ifndef EFFECTS_H
+#define EFFECTS_H
+
+// built-in effects. an effect drives a range of lamps and is evaluated once per frame of the frame
+// clock: every effect computes its lamps' colors as float arrays in one pass per channel, without
+// branches, so the compiler can vectorize the loops, and writes them into the lamp state with
+// LampState::updatePlanar(), which only marks lamps whose color changed. a running effect costs no
+// network traffic at all.
+//
+// effects are plain data (time base is the monotonic clock) so they survive a live upgrade.
+
+#define MAX_EFFECTS     16
+#define EFFECT_ADDRESS  "/moodpd/effect"    // string type, int32 first lamp, int32 count, [float speed, [float param, [int32 r, g, b]]]
+
+enum EffectType
+{
+    EFFECT_NONE= 0,
+    EFFECT_HUE,         // color wheel, param: part of the wheel spread over the lamps (1: full rainbow)
+    EFFECT_BREATHE,     // color fading in and out, param: lowest brightness
+    EFFECT_CHASE,       // a dot of color running along the lamps, param: width in lamps
+    EFFECT_NOISE,       // smooth random brightness per lamp, param: lowest brightness
+};
+
+struct Effect
+{
+    int32_t type;
+    int32_t firstLamp, count;
+    float speed;            // cycles per second
+    float param;
+    uint8_t color[3];
+    uint64_t startNs;       // monotonicNs() when started
+};
+
+// effect type by name, -1 if unknown. "off" is EFFECT_NONE.
+inline int effectType(const string &name)
+{
+    static const char *names[]= { "off", "hue", "breathe", "chase", "noise" };
+    for(int i= 0; i<(int)(sizeof(names)/sizeof(names[0])); i++)
+        if(name==names[i]) return i;
+    return -1;
+}
+
+// default param for an effect type.
+inline float effectDefaultParam(int type)
+{
+    return type==EFFECT_HUE? 1.0f: type==EFFECT_CHASE? 3.0f: 0.0f;
+}
+
+
+class EffectsEngine
+{
+    public:
+        EffectsEngine() { memset(effects, 0, sizeof(effects)); }
+
+        // start an effect, replacing effects on overlapping lamps. returns false if all slots are in use.
+        // starting the same effect on the same lamps again only changes its parameters: the time base is
+        // moved so it continues from where it is instead of jumping.
+        bool start(const Effect &e)
+        {
+            Effect n= e;
+            for(int i= 0; i<MAX_EFFECTS; i++)
+            {
+                const Effect &old= effects[i];
+                if(old.type!=e.type || old.firstLamp!=e.firstLamp || old.count!=e.count || e.speed<=0) continue;
+                uint64_t elapsed= (uint64_t)((e.startNs-old.startNs)*(double)old.speed/e.speed);
+                if(elapsed<e.startNs) n.startNs= e.startNs-elapsed;
+            }
+            stop(e.firstLamp, e.count);
+            for(int i= 0; i<MAX_EFFECTS; i++)
+                if(effects[i].type==EFFECT_NONE)
+                {
+                    effects[i]= n;
+                    return true;
+                }
+            return false;
+        }
+
+        // stop all effects on lamps in the range.
+        void stop(int first, int count)
+        {
+            for(int i= 0; i<MAX_EFFECTS; i++)
+                if(effects[i].type!=EFFECT_NONE && effects[i].firstLamp<first+count && first<effects[i].firstLamp+effects[i].count)
+                    effects[i].type= EFFECT_NONE;
+        }
+
+        bool active() const
+        {
+            for(int i= 0; i<MAX_EFFECTS; i++) if(effects[i].type!=EFFECT_NONE) return true;
+            return false;
+        }
+
+        // set covered[i] to 1 for the lamps an effect is running on, 0 for the others.
+        void coverage(uint8_t *covered) const
+        {
+            memset(covered, 0, MAX_LAMPS);
+            for(int i= 0; i<MAX_EFFECTS; i++)
+                if(effects[i].type!=EFFECT_NONE) memset(covered+effects[i].firstLamp, 1, effects[i].count);
+        }
+
+        // compute the frame for time 'nowNs' into the lamp state. returns the number of lamps that changed.
+        int render(uint64_t nowNs, LampState &lamps)
+        {
+            int changed= 0;
+            for(int i= 0; i<MAX_EFFECTS; i++)
+            {
+                const Effect &e= effects[i];
+                if(e.type==EFFECT_NONE) continue;
+                double t= (nowNs-e.startNs)*1e-9*e.speed;
+                switch(e.type)
+                {
+                    case EFFECT_HUE: renderHue(e, t); break;
+                    case EFFECT_BREATHE: renderBreathe(e, t); break;
+                    case EFFECT_CHASE: renderChase(e, t); break;
+                    case EFFECT_NOISE: renderNoise(e, t); break;
+                }
+                toBytes(e.count);
+                changed+= lamps.updatePlanar(e.firstLamp, r8, g8, b8, e.count);
+            }
+            return changed;
+        }
+
+        // copy the running effects out and in, for live upgrades.
+        void save(Effect *out) const { memcpy(out, effects, sizeof(effects)); }
+        void restore(const Effect *in) { memcpy(effects, in, sizeof(effects)); }
+
+    private:
+        Effect effects[MAX_EFFECTS];
+        float r[MAX_LAMPS], g[MAX_LAMPS], b[MAX_LAMPS];     // channels of the effect being rendered, 0..1
+        uint8_t r8[MAX_LAMPS], g8[MAX_LAMPS], b8[MAX_LAMPS];
+
+        static float clamp01(float x) { return x<0.0f? 0.0f: x>1.0f? 1.0f: x; }
+
+        // fractional part of the cycle count, kept in double until here so long running effects stay smooth.
+        static float phase(double t) { return (float)(t-(int64_t)t); }
+
+        void renderHue(const Effect &e, double t)
+        {
+            float p= phase(t), step= e.param/e.count;
+            for(int i= 0; i<e.count; i++)
+            {
+                float h= p + i*step;
+                h= (h-(int)h)*6.0f;
+                float dr= h-3.0f, dg= h-2.0f, db= h-4.0f;
+                r[i]= clamp01((dr<0? -dr: dr)-1.0f);
+                g[i]= clamp01(2.0f-(dg<0? -dg: dg));
+                b[i]= clamp01(2.0f-(db<0? -db: db));
+            }
+        }
+
+        void renderBreathe(const Effect &e, double t)
+        {
+            float level= e.param + (1.0f-e.param)*(0.5f-0.5f*cosf(phase(t)*2.0f*(float)M_PI));
+            for(int i= 0; i<e.count; i++) r[i]= g[i]= b[i]= level;
+            scaleByColor(e);
+        }
+
+        void renderChase(const Effect &e, double t)
+        {
+            float pos= phase(t)*e.count, width= e.param>0? e.param: 1.0f;
+            for(int i= 0; i<e.count; i++)
+            {
+                float d= i-pos;
+                d= d<0? -d: d;
+                float wrapped= e.count-d;
+                d= wrapped<d? wrapped: d;
+                r[i]= g[i]= b[i]= clamp01(1.0f-d/width);
+            }
+            scaleByColor(e);
+        }
+
+        // value noise: a random level per lamp and cycle, smoothly interpolated between cycles.
+        void renderNoise(const Effect &e, double t)
+        {
+            uint32_t cycle= (uint32_t)(int64_t)t;
+            float f= phase(t);
+            f= f*f*(3.0f-2.0f*f);
+            float lo= e.param;
+            for(int i= 0; i<e.count; i++)
+            {
+                float a= hash(i, cycle), c= hash(i, cycle+1);
+                r[i]= g[i]= b[i]= lo + (1.0f-lo)*(a+(c-a)*f);
+            }
+            scaleByColor(e);
+        }
+
+        // random number in [0, 1) from lamp and cycle.
+        static float hash(uint32_t lamp, uint32_t cycle)
+        {
+            uint32_t h= lamp*0x9E3779B1u ^ cycle*0x85EBCA77u;
+            h^= h>>15; h*= 0x2C1B3C6Du;
+            h^= h>>12; h*= 0x297A2D39u;
+            h^= h>>15;
+            return (h>>8)*(1.0f/16777216.0f);
+        }
+
+        void scaleByColor(const Effect &e)
+        {
+            float cr= e.color[0]/255.0f, cg= e.color[1]/255.0f, cb= e.color[2]/255.0f;
+            for(int i= 0; i<e.count; i++) r[i]*= cr, g[i]*= cg, b[i]*= cb;
+        }
+
+        void toBytes(int count)
+        {
+            for(int i= 0; i<count; i++)
+            {
+                r8[i]= (uint8_t)(int)(r[i]*255.0f+0.5f);
+                g8[i]= (uint8_t)(int)(g[i]*255.0f+0.5f);
+                b8[i]= (uint8_t)(int)(b[i]*255.0f+0.5f);
+            }
+        }
+};
+
+
+#endif //EFFECTS_H
@@ -0,0 +1,140 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+// restarting without closing anything. sockets can be inherited from systemd socket activation
+// (LISTEN_FDS), and a running moodpd hands its sockets, serial fd, lamp state and running effects to a new instance
+// over a UNIX socket (SCM_RIGHTS) before exiting, so an upgrade loses no packets and doesn't reset
+// the lamp.
+//
+// live upgrade protocol, on a SOCK_STREAM UNIX socket the running instance listens on:
+//      new instance connects
+//      old instance stops receiving, sends HandoffState with the fds attached, then the unsent serial data
+//      new instance replies with one byte, the old instance exits
+
+
+#define HANDOFF_MAGIC   (*(uint32_t*)"m00h")
+#define HANDOFF_VERSION 3
+
+// fds passed along with HandoffState, in this order.
+enum { HANDOFF_RAW_FD, HANDOFF_OSC_FD, HANDOFF_SERIAL_FD, HANDOFF_NFDS };
+
+struct HandoffState
+{
+    uint32_t magic, version;
+    char tty[256];
+    int protocol;
+    LampState lamps;
+    Effect effects[MAX_EFFECTS];
+    uint32_t serialPending;     // this many bytes of unsent serial data follow
+};
+
+
+// the fds passed by systemd socket activation, if any. see sd_listen_fds(3).
+inline void listenFds(vector<int> &fds)
+{
+    const char *pid= getenv("LISTEN_PID"), *n= getenv("LISTEN_FDS");
+    if(pid && n && atoi(pid)==getpid())
+        for(int fd= 3; fd<3+atoi(n); fd++)
+        {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fds.push_back(fd);
+        }
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+}
+
+// connect to a running instance. returns -1 quietly if there is none.
+inline int connectUnix(const char *path)
+{
+    sockaddr_un sa;
+    if(!unixAddress(path, sa)) return -1;
+    int fd= socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if(fd<0) { logerror("socket"); return -1; }
+    if(connect(fd, (sockaddr*)&sa, sizeof(sa))<0)
+    {
+        if(errno!=ENOENT && errno!=ECONNREFUSED) logerror(path);
+        close(fd);
+        return -1;
+    }
+    timeval tv= { 5, 0 };   // don't hang forever on a stuck instance
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+inline bool writeAll(int fd, const void *data, size_t size)
+{
+    for(size_t done= 0; done<size; )
+    {
+        ssize_t n= write(fd, (const char*)data+done, size-done);
+        if(n<=0) { if(n<0 && errno==EINTR) continue; return false; }
+        done+= n;
+    }
+    return true;
+}
+
+inline bool readAll(int fd, void *data, size_t size)
+{
+    for(size_t done= 0; done<size; )
+    {
+        ssize_t n= read(fd, (char*)data+done, size-done);
+        if(n<=0) { if(n<0 && errno==EINTR) continue; return false; }
+        done+= n;
+    }
+    return true;
+}
+
+// send 'size' bytes with 'nfds' fds attached.
+inline bool sendWithFds(int sock, const void *data, size_t size, const int *fds, int nfds)
+{
+    char control[CMSG_SPACE(sizeof(int)*HANDOFF_NFDS)];
+    if(nfds>HANDOFF_NFDS) return false;
+    iovec iov= { (void*)data, size };
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov= &iov;
+    msg.msg_iovlen= 1;
+    msg.msg_control= control;
+    msg.msg_controllen= CMSG_SPACE(sizeof(int)*nfds);
+    cmsghdr *cmsg= CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level= SOL_SOCKET;
+    cmsg->cmsg_type= SCM_RIGHTS;
+    cmsg->cmsg_len= CMSG_LEN(sizeof(int)*nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int)*nfds);
+    ssize_t n= sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if(n<0) return false;
+    return writeAll(sock, (const char*)data+n, size-n);
+}
+
+// receive 'size' bytes and up to 'nfds' fds. nfds is set to the number of fds received.
+inline bool recvWithFds(int sock, void *data, size_t size, int *fds, int &nfds)
+{
+    char control[CMSG_SPACE(sizeof(int)*HANDOFF_NFDS)];
+    iovec iov= { data, size };
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov= &iov;
+    msg.msg_iovlen= 1;
+    msg.msg_control= control;
+    msg.msg_controllen= sizeof(control);
+    ssize_t n= recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    int maxFds= nfds;
+    nfds= 0;
+    if(n<=0) return false;
+    for(cmsghdr *cmsg= CMSG_FIRSTHDR(&msg); cmsg; cmsg= CMSG_NXTHDR(&msg, cmsg))
+        if(cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SCM_RIGHTS)
+        {
+            int count= (cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int);
+            for(int i= 0; i<count; i++)
+            {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg)+i*sizeof(int), sizeof(fd));
+                if(nfds<maxFds) fds[nfds++]= fd;
+                else close(fd);
+            }
+        }
+    return readAll(sock, (char*)data+n, size-n);
+}
+
+
+#endif //HANDOFF_H
@@ -0,0 +1,72 @@
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+// waiting for a serial device to come back after it went away (USB adapter reset or replugged).
+// inotify on the device's directory reports the node being created and, since udev sets owner and
+// permissions after creating it, its attributes changing. directories which come and go with the
+// device (/dev/serial/by-id) can't be watched while they're gone, so the caller also retries on a timer.
+
+#include <sys/inotify.h>
+
+#define HOTPLUG_RETRY_MS 1000
+
+
+class DeviceWatch
+{
+    public:
+        DeviceWatch(): fd(-1) {}
+        ~DeviceWatch() { stop(); }
+
+        // watch for 'path' to appear. the directory may be missing, then only the retries find the device.
+        bool start(const string &path)
+        {
+            stop();
+            fd= inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+            if(fd<0) { logerror("inotify_init1"); return false; }
+            size_t slash= path.rfind('/');
+            dir= slash==string::npos? ".": slash==0? "/": path.substr(0, slash);
+            name= path.substr(slash==string::npos? 0: slash+1);
+            if(inotify_add_watch(fd, dir.c_str(), IN_CREATE|IN_ATTRIB|IN_MOVED_TO)<0)
+                flog(LOG_INFO, "can't watch %s (%s), retrying every %d ms.\n", dir.c_str(), strerror(errno), HOTPLUG_RETRY_MS);
+            return true;
+        }
+
+        void stop()
+        {
+            if(fd>=0) close(fd);
+            fd= -1;
+        }
+
+        // stop watching, the caller closes the returned fd.
+        int release()
+        {
+            int f= fd;
+            fd= -1;
+            return f;
+        }
+
+        int getFd() const { return fd; }
+        bool active() const { return fd>=0; }
+
+        // read the pending events. returns true if one was about the device.
+        bool changed()
+        {
+            char buf[4096] __attribute__((aligned(__alignof__(inotify_event))));
+            bool found= false;
+            ssize_t n;
+            while( (n= read(fd, buf, sizeof(buf)))>0 )
+                for(char *p= buf; p<buf+n; p+= sizeof(inotify_event) + ((inotify_event*)p)->len)
+                {
+                    inotify_event *ev= (inotify_event*)p;
+                    if(ev->len && name==ev->name) found= true;
+                }
+            return found;
+        }
+
+    private:
+        int fd;
+        string dir, name;
+};
+
+
+#endif //HOTPLUG_H
@@ -0,0 +1,200 @@
+#ifndef INPUTS_H
+#define INPUTS_H
+
+// continuous inputs: sensors and faders sending OSC values at their own rate, often hundreds of
+// messages a second. an input mapping ("input = /fader/1 0 0-3 red 0 1 lowpass 0.1") takes one
+// argument of an OSC address, scales its range to a lamp channel and smooths it. incoming messages
+// only set the target value; the filters advance and write to the lamp state once per frame of the
+// frame clock, so any number of messages per frame makes one update on the bus. angles ("wrap") are
+// circular: MIN and MAX are the same value and the filters take the shorter way round, so a sensor
+// crossing from 180 to -180 degrees moves the value by a step, not through the whole range.
+
+enum InputChannel { INPUT_RED, INPUT_GREEN, INPUT_BLUE, INPUT_WHITE };
+enum InputFilter { INPUT_FILTER_NONE, INPUT_FILTER_LOWPASS, INPUT_FILTER_SLEW };
+
+#define INPUT_ALL_LAMPS -1      // "all": the old firmware's color command for every lamp on the bus
+
+struct InputMapping
+{
+    string address;
+    int arg;                    // index of the int32 or float argument
+    int firstLamp, lastLamp;    // firstLamp INPUT_ALL_LAMPS for "all"
+    int channel;
+    float inMin, inMax;         // input range, mapped to 0..255
+    int filter;
+    float filterValue;          // lowpass: time constant in seconds, slew: full range changes per second
+    bool wrap;                  // circular range (angles)
+
+    bool operator==(const InputMapping &o) const
+    {
+        return address==o.address && arg==o.arg && firstLamp==o.firstLamp && lastLamp==o.lastLamp &&
+               channel==o.channel && inMin==o.inMin && inMax==o.inMax && filter==o.filter && filterValue==o.filterValue &&
+               wrap==o.wrap;
+    }
+};
+
+// parse "ADDRESS ARG LAMPS CHANNEL MIN MAX [lowpass SECONDS | slew PER_SECOND] [wrap]".
+// LAMPS is N, N-M or "all", CHANNEL one of red, green, blue, white.
+inline bool parseInputMapping(const string &value, InputMapping &m)
+{
+    char address[256], lamps[32], channel[16], filter[16];
+    int n= 0;
+    if(sscanf(value.c_str(), "%255s %d %31s %15s %f %f%n", address, &m.arg, lamps, channel, &m.inMin, &m.inMax, &n)!=6 ||
+       address[0]!='/' || m.arg<0 || m.inMin==m.inMax)
+        return false;
+    m.address= address;
+
+    if(!strcmp(lamps, "all")) m.firstLamp= m.lastLamp= INPUT_ALL_LAMPS;
+    else if(sscanf(lamps, "%d-%d", &m.firstLamp, &m.lastLamp)!=2)
+    {
+        if(sscanf(lamps, "%d", &m.firstLamp)!=1) return false;
+        m.lastLamp= m.firstLamp;
+    }
+    if(m.firstLamp!=INPUT_ALL_LAMPS && (m.firstLamp<0 || m.lastLamp>=MAX_LAMPS || m.lastLamp<m.firstLamp))
+        return false;
+
+    static const char *channels[]= { "red", "green", "blue", "white" };
+    m.channel= -1;
+    for(int i= 0; i<4; i++) if(!strcmp(channel, channels[i])) m.channel= i;
+    if(m.channel<0) return false;
+
+    m.filter= INPUT_FILTER_NONE;
+    m.filterValue= 0;
+    m.wrap= false;
+    int n2= 0;
+    string rest= value.substr(n);
+    if(sscanf(rest.c_str(), "%15s %f%n", filter, &m.filterValue, &n2)==2)
+    {
+        if(!strcmp(filter, "lowpass")) m.filter= INPUT_FILTER_LOWPASS;
+        else if(!strcmp(filter, "slew")) m.filter= INPUT_FILTER_SLEW;
+        else return false;
+        if(!(m.filterValue>0)) return false;
+        n= n2;
+    }
+    else n= 0;
+    n2= 0;
+    sscanf(rest.c_str()+n, " wrap%n", &n2);
+    if(n2) m.wrap= true, n+= n2;
+    return rest.find_first_not_of(" \t", n)==string::npos;
+}
+
+
+class InputStage
+{
+    public:
+        InputStage(): lastNs(0), settledCount(0) {}
+
+        // use a new set of mappings. state is kept if they didn't change.
+        void setMappings(const vector<InputMapping> &m)
+        {
+            if(m==mappings) return;
+            mappings= m;
+            state.assign(m.size(), InputState());
+            settledCount= m.size();
+        }
+
+        // take the values of an OSC message received at 'nowNs'. returns false if no mapping uses its address.
+        bool handle(const oscpkt::Message &msg, uint64_t nowNs)
+        {
+            bool used= false;
+            for(size_t i= 0; i<mappings.size(); i++)
+            {
+                const InputMapping &m= mappings[i];
+                if(msg.addressPattern()!=m.address) continue;
+                used= true;
+                float x;
+                if(!argValue(msg, m.arg, x)) continue;
+                float v= (x-m.inMin)/(m.inMax-m.inMin);
+                if(m.wrap) v-= floorf(v);
+                else v= v<0? 0: v>1? 1: v;
+                if(settled()) lastNs= nowNs;    // the frame clock starts now, don't count the idle time
+                InputState &s= state[i];
+                bool first= !s.valid;
+                if(first) s.current= v, s.valid= true;     // start from the first value, not from 0
+                if(s.settled && (first || v!=s.current)) s.settled= false, settledCount--;
+                s.target= v;
+            }
+            return used;
+        }
+
+        // all values have reached their targets and been written out, the frame clock isn't needed.
+        bool settled() const { return settledCount==mappings.size(); }
+
+        // advance the filters to 'nowNs' and write the values to the lamps. 'all lamps' mappings set
+        // 'allRgb' and 'allChanged' instead. returns the number of lamp channels changed.
+        int render(uint64_t nowNs, LampState &lamps, uint8_t *allRgb, bool &allChanged)
+        {
+            float dt= (nowNs-lastNs)*1e-9f;
+            lastNs= nowNs;
+            int changed= 0;
+            for(size_t i= 0; i<mappings.size(); i++)
+            {
+                const InputMapping &m= mappings[i];
+                InputState &s= state[i];
+                if(s.settled) continue;
+                float d= distance(m, s.current, s.target);
+                if(m.filter==INPUT_FILTER_LOWPASS)
+                    s.current+= d*(1.0f-expf(-dt/m.filterValue));
+                else if(m.filter==INPUT_FILTER_SLEW)
+                {
+                    float step= m.filterValue*dt;
+                    s.current+= d>step? step: d<-step? -step: d;
+                }
+                else
+                    s.current= s.target;
+                if(m.wrap) s.current-= floorf(s.current);
+                if(fabsf(distance(m, s.current, s.target))<0.5f/255)
+                    s.current= s.target, s.settled= true, settledCount++;
+
+                uint8_t v= (uint8_t)(s.current*255.0f+0.5f);
+                if(m.firstLamp==INPUT_ALL_LAMPS)
+                {
+                    for(int c= 0; c<3; c++)
+                        if((m.channel==c || m.channel==INPUT_WHITE) && allRgb[c]!=v)
+                            allRgb[c]= v, allChanged= true;
+                    continue;
+                }
+                uint8_t *channels[3]= { lamps.red, lamps.green, lamps.blue };
+                for(int lamp= m.firstLamp; lamp<=m.lastLamp; lamp++)
+                    for(int c= 0; c<3; c++)
+                        if((m.channel==c || m.channel==INPUT_WHITE) && channels[c][lamp]!=v)
+                            channels[c][lamp]= v, lamps.markDirty(lamp), changed++;
+            }
+            return changed;
+        }
+
+    private:
+        struct InputState
+        {
+            float target, current;
+            bool valid;         // got a value yet
+            bool settled;       // current==target and written out
+            InputState(): target(0), current(0), valid(false), settled(true) {}
+        };
+
+        vector<InputMapping> mappings;
+        vector<InputState> state;
+        uint64_t lastNs;
+        size_t settledCount;
+
+        // from 'from' to 'to', the shorter way round on circular ranges.
+        static float distance(const InputMapping &m, float from, float to)
+        {
+            float d= to-from;
+            return m.wrap? d-floorf(d+0.5f): d;
+        }
+
+        static bool argValue(const oscpkt::Message &msg, int index, float &x)
+        {
+            oscpkt::Message::ArgReader arg= msg.arg();
+            for(int i= 0; i<index && arg.nbArgRemaining(); i++) arg.pop();
+            int32_t n;
+            if(arg.isFloat()) arg.popFloat(x);
+            else if(arg.isInt32()) arg.popInt32(n), x= n;
+            else return false;
+            return arg.isOk();
+        }
+};
+
+
+#endif //INPUTS_H
@@ -0,0 +1,170 @@
+#ifndef LAMPS_H
+#define LAMPS_H
+
+// lamp state. every lamp's color as last set by a client, kept as separate red/green/blue arrays,
+// with a dirty bit per lamp so changes can be sent out in one batch.
+
+#define MAX_LAMPS 256
+
+// length of a new-firmware lamp command: "iRRGGBBNN\n"
+#define LAMP_COMMAND_SIZE 10
+
+
+struct LampState
+{
+    uint8_t red[MAX_LAMPS], green[MAX_LAMPS], blue[MAX_LAMPS];
+    uint64_t dirty[MAX_LAMPS/64];
+
+    LampState() { memset(this, 0, sizeof(*this)); }
+
+    void set(int lamp, uint8_t r, uint8_t g, uint8_t b)
+    {
+        red[lamp]= r;
+        green[lamp]= g;
+        blue[lamp]= b;
+        markDirty(lamp);
+    }
+
+    // set 'count' lamps starting at 'first' from packed RGB triplets. lamps past MAX_LAMPS are ignored.
+    // returns the number of lamps set.
+    int setPacked(int first, const uint8_t *rgb, int count)
+    {
+        if(first<0 || first>=MAX_LAMPS) return 0;
+        count= min(count, MAX_LAMPS-first);
+        for(int i= 0; i<count; i++)
+        {
+            red[first+i]= rgb[i*3];
+            green[first+i]= rgb[i*3+1];
+            blue[first+i]= rgb[i*3+2];
+        }
+        markDirty(first, count);
+        return count;
+    }
+
+    // like setPacked(), from separate red/green/blue arrays.
+    int setPlanar(int first, const uint8_t *newRed, const uint8_t *newGreen, const uint8_t *newBlue, int count)
+    {
+        if(first<0 || first>=MAX_LAMPS) return 0;
+        count= min(count, MAX_LAMPS-first);
+        memcpy(red+first, newRed, count);
+        memcpy(green+first, newGreen, count);
+        memcpy(blue+first, newBlue, count);
+        markDirty(first, count);
+        return count;
+    }
+
+    // like setPacked(), but only lamps whose color changes are marked dirty. returns the number of those.
+    // compare and copy are one branch-free pass, dirty bits are only touched for lamps that changed.
+    int updatePacked(int first, const uint8_t *rgb, int count)
+    {
+        if(first<0 || first>=MAX_LAMPS) return 0;
+        count= min(count, MAX_LAMPS-first);
+        uint8_t *r= red+first, *g= green+first, *b= blue+first;
+        uint8_t diff[MAX_LAMPS];
+        for(int i= 0; i<count; i++)
+        {
+            diff[i]= (r[i]^rgb[i*3]) | (g[i]^rgb[i*3+1]) | (b[i]^rgb[i*3+2]);
+            r[i]= rgb[i*3];
+            g[i]= rgb[i*3+1];
+            b[i]= rgb[i*3+2];
+        }
+        int changed= 0;
+        for(int i= 0; i<count; i++)
+            if(diff[i]) markDirty(first+i), changed++;
+        return changed;
+    }
+
+    // like updatePacked(), from separate red/green/blue arrays. the compare-and-copy loop vectorizes.
+    int updatePlanar(int first, const uint8_t *newRed, const uint8_t *newGreen, const uint8_t *newBlue, int count)
+    {
+        if(first<0 || first>=MAX_LAMPS) return 0;
+        count= min(count, MAX_LAMPS-first);
+        uint8_t *r= red+first, *g= green+first, *b= blue+first;
+        uint8_t diff[MAX_LAMPS];
+        for(int i= 0; i<count; i++)
+        {
+            diff[i]= (r[i]^newRed[i]) | (g[i]^newGreen[i]) | (b[i]^newBlue[i]);
+            r[i]= newRed[i];
+            g[i]= newGreen[i];
+            b[i]= newBlue[i];
+        }
+        int changed= 0;
+        for(int i= 0; i<count; i++)
+            if(diff[i]) markDirty(first+i), changed++;
+        return changed;
+    }
+
+    void markDirty(int lamp)
+    { dirty[lamp>>6]|= 1ull<<(lamp&63); }
+
+    void markDirty(int first, int count)
+    { for(int i= first; i<first+count; i++) markDirty(i); }
+
+    bool isDirty(int lamp) const
+    { return dirty[lamp>>6] & (1ull<<(lamp&63)); }
+
+    bool anyDirty() const
+    {
+        for(int i= 0; i<MAX_LAMPS/64; i++) if(dirty[i]) return true;
+        return false;
+    }
+
+    void clearDirty()
+    { memset(dirty, 0, sizeof(dirty)); }
+
+    // call fn(lampIndex) for every dirty lamp, in ascending order.
+    template<typename Fn> void forEachDirty(Fn fn) const
+    {
+        for(int w= 0; w<MAX_LAMPS/64; w++)
+            for(uint64_t bits= dirty[w]; bits; bits&= bits-1)
+                fn(w*64 + __builtin_ctzll(bits));
+    }
+};
+
+
+// maps the lamp indexes clients use to lamp numbers on the bus. -1 means the lamp is not sent out.
+struct LampRouting
+{
+    int16_t target[MAX_LAMPS];
+
+    LampRouting() { for(int i= 0; i<MAX_LAMPS; i++) target[i]= i; }
+
+    bool operator==(const LampRouting &other) const
+    { return !memcmp(target, other.target, sizeof(target)); }
+    bool operator!=(const LampRouting &other) const
+    { return !(*this==other); }
+};
+
+
+// format a new-firmware lamp command ("iRRGGBBNN\n") without going through printf.
+// returns the number of bytes written (LAMP_COMMAND_SIZE).
+inline int formatLampCommand(char *out, uint8_t r, uint8_t g, uint8_t b, uint8_t lamp)
+{
+    static const char hex[]= "0123456789abcdef";
+    out[0]= 'i';
+    out[1]= hex[r>>4]; out[2]= hex[r&15];
+    out[3]= hex[g>>4]; out[4]= hex[g&15];
+    out[5]= hex[b>>4]; out[6]= hex[b&15];
+    out[7]= hex[lamp>>4]; out[8]= hex[lamp&15];
+    out[9]= '\n';
+    return LAMP_COMMAND_SIZE;
+}
+
+
+// a single (unbundled) /moodpd/lamps/rgb message, decoded straight from the datagram without building
+// oscpkt::Message objects. returns the packed RGB triplets (blobSize bytes) for lamps from 'first' on, 0
+// if the datagram is anything else.
+inline const uint8_t *parseBulkRgb(const char *data, size_t size, int &first, size_t &blobSize)
+{
+    // address and type tags, zero padded to 4 bytes each. sizeof counts the 0 ending ",ib".
+    static const char header[]= "/moodpd/lamps/rgb\0\0\0,ib";
+    const size_t headerSize= sizeof(header);
+    if(size<headerSize+8 || memcmp(data, header, headerSize)) return 0;
+    first= oscpkt::bytes2pod<int32_t>(data+headerSize);
+    blobSize= oscpkt::bytes2pod<uint32_t>(data+headerSize+4);
+    if(oscpkt::ceil4(blobSize) != size-headerSize-8) return 0;     // let oscpkt complain
+    return (const uint8_t*)data+headerSize+8;
+}
+
+
+#endif //LAMPS_H
@@ -21,6 +21,8 @@
 #include <termios.h>
 #include <deque>
 #include <vector>
+#include <map>
+#include <algorithm>
 #include <string>
 #include <stdarg.h>
 #include <errno.h>
@@ -28,22 +30,51 @@
 #include <libgen.h>
 #include <iostream>
 #include <stddef.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <math.h>
 
 #include <oscpkt.hh>
 #include <udp.hh>
 
 using namespace std;
 
-// use muccc-style commands. currently disabled, new firmware uses other cmds. 
-// #define MUCPROTOCOL
+#define DEFAULT_PORT 4242
 
 #include "cmd_handler.h"
 #include "utils.h"
+#include "alloc.h"
+#include "uring.h"
+#include "capture.h"
+#include "oscpattern.h"
+#include "lamps.h"
+#include "color.h"
+#include "net.h"
+#include "stats.h"
+#include "cluster.h"
+#include "router.h"
+#include "dmx.h"
+#include "slip.h"
+#include "effects.h"
+#include "inputs.h"
+#include "subscribe.h"
+#include "priority.h"
+#include "merge.h"
+#include "protocol.h"
+#include "output.h"
+#include "sim.h"
+#include "realtime.h"
+#include "hotplug.h"
+#include "config.h"
+#include "handoff.h"
 
 enum moodpd_pkttype
 {
     MOODPD_RAWMSG= '!',
     MOODPD_COLOR= '#',
+    MOODPD_LAMPFRAME= '*',
+    MOODPD_HSVFRAME= 'H',
     MOODPD_SETBRIGHTNESS= 'B',
     MOODPD_FADEMS= 'F',
     MOODPD_PAUSE= 'P',
@@ -62,16 +93,39 @@ struct moodpd_packet
 #define MOODPD_MAGIC    (*(uint32_t*)"m00d")
 
 #define MOODPD_MAXPACKETSIZE    1024    // don't send packets larger than this.
-#define DEFAULT_PORT 4242
+#define MAX_STREAM_CLIENTS      64
+#define DMX_RECV_BATCH          16      // Art-Net/sACN packets taken per recvmmsg() call
 
 uint32_t logMask= 1<<LOG_ERROR;
 
 
+// bytes allowed to wait in the tty's output queue. more would only add latency which the lanes can't
+// help with, and at 230400 baud this is about 11 ms.
+#define SERIAL_QUEUE_LIMIT WRITE_CHUNK_SIZE
+#define SERIAL_BYTES_PER_SECOND (230400/10)
+
 class SerialIO: public NonblockWriter
 {
 	public:
-		SerialIO()
-		{ }
+		SerialIO(): line(0), lost(false), protocol(PROTOCOL_TEXT), frameJitter(0), frameDueNs(0)
+		{
+            memset(lampPending, 0, sizeof(lampPending));
+            memset(lazyCursor, 0, sizeof(lazyCursor));
+            memset(busKnown, 0, sizeof(busKnown));
+        }
+
+        // write to an emulated serial line instead of a tty (simulation mode).
+        void simulate(SimulatedLine *l) { line= l; }
+
+        // the protocol the lamps on the tty speak, see protocol.h.
+        void setProtocol(int p)
+        {
+            protocol= p;
+            if(line) line->setProtocol(p);
+        }
+
+        // which bus lamp each lamp goes to.
+        void setRouting(const LampRouting &r) { routing= r; }
 
         bool open(const char *devname= "/dev/ttyUSB0")
         {
@@ -79,21 +133,58 @@ class SerialIO: public NonblockWriter
             return getFd()>=0;
         }
 
+        // switch to another tty. the old fd is left to the caller, which closes it (the main loop may be
+        // watching it) if the new one could be opened. not while a write is in flight, its buffer must stay.
+        bool reopen(const char *devname)
+        {
+            int fd= openSerial(devname);
+            if(fd<0) return false;
+            clearBuffer();
+            frameDueNs= 0;
+            NonblockWriter::setFd(fd);
+            lost= false;
+            return true;
+        }
+
+        // the device is gone (unplugged, adapter reset). nothing is written until it's reopened, the
+        // main loop closes the fd and waits for the device to come back.
         void writeFailed(int _errno)
         {
-            fail(strerror(_errno));
+            if(lost) return;
+            flog(LOG_ERROR, "serial device lost: %s\n", strerror(_errno));
+            lost= true;
+            frameDueNs= 0;
+        }
+
+        // the output of a frame due at 'dueNs' has been buffered. its lateness goes into 'jitter' once
+        // its last byte has been written. a frame which wrote nothing is done already.
+        void frameQueued(FrameJitter &jitter, uint64_t dueNs)
+        {
+            frameJitter= &jitter;
+            frameDueNs= dueNs;
+            if(writeBufferEmpty()) drained();
         }
 
+        void drained()
+        {
+            if(!frameDueNs) return;
+            uint64_t now= monotonicNs();
+            frameJitter->add(now>frameDueNs? now-frameDueNs: 0);
+            frameDueNs= 0;
+        }
+
+        bool isLost() const { return lost; }
+
+        // forget the fd of a lost device, the caller closes it. what wasn't sent yet is dropped when the
+        // device is reopened, the whole lamp state is sent then.
+        void detach()
+        { NonblockWriter::setFd(-1); }
+
         void writeCommand(const char *commandBytes, int length)
         {
             if(length<=0) fail("writeCommand");
-#ifdef MUCPROTOCOL
-            write("acP\2", 4);
-            write(commandBytes, length);
-            write("ab", 2);
-#else
+            if(lost) return;    // the lamp state is sent again when the device is back, other commands are dropped
             write(commandBytes, length);
-#endif
             if(logMask&(1<<LOG_INFO))
             {
                 flog(LOG_INFO, "writeCommand: '");
@@ -103,18 +194,147 @@ class SerialIO: public NonblockWriter
             }
         }
 
-        void writeCommandF(const char *fmt, ...)
+        // initialize the lamps.
+        void writeInit()
+        {
+            char buf[32];
+            switch(protocol)
+            {
+                case PROTOCOL_MUCCC: write(buf, Encoder<PROTOCOL_MUCCC>::init(buf)); break;
+                default: write(buf, Encoder<PROTOCOL_TEXT>::init(buf)); break;
+            }
+        }
+
+        // set all lamps to one color. it's part of the state to restore.
+        void writeColor(uint8_t r, uint8_t g, uint8_t b)
+        {
+            for(int t= 0; t<MAX_LAMPS; t++)
+                busRgb[t][0]= r, busRgb[t][1]= g, busRgb[t][2]= b;
+            memset(busKnown, 0xff, sizeof(busKnown));
+            char buf[MAX_LAMP_COMMAND_SIZE];
+            switch(protocol)
+            {
+                case PROTOCOL_MUCCC: writeCommand(buf, Encoder<PROTOCOL_MUCCC>::color(buf, r, g, b)); break;
+                default: writeCommand(buf, Encoder<PROTOCOL_TEXT>::color(buf, r, g, b)); break;
+            }
+        }
+
+        // a muccc command (see cmd_handler.h). false if the lamps don't understand those.
+        bool writeMucccCommand(const char *c, int n)
         {
-            char ch[1024];
-            va_list ap;
-            va_start(ap, fmt);
-            int nbytes= vsnprintf(ch, 1023, fmt, ap);
-            va_end(ap);
-            if(nbytes>0) writeCommand(ch, nbytes);
-            else fail("vsnprintf");
+            if(protocol!=PROTOCOL_MUCCC) return false;
+            char buf[32];
+            writeCommand(buf, Encoder<PROTOCOL_MUCCC>::command(buf, c, n));
+            return true;
+        }
+
+        // send the colors of all dirty lamps in the current lane. the lamp commands are only formatted when
+        // the lane gets its turn, so a lamp changing again before that is sent once, with its latest color.
+        // a lamp waiting in a less urgent lane moves up to this one.
+        void send(const LampState &lamps)
+        {
+            int lane= getLane(), n= 0;
+            uint64_t now= line? monotonicNs(): 0;
+            lamps.forEachDirty([&](int i) {
+                int t= routing.target[i];
+                if(t<0) return;
+                if(line) line->lampChanged(t, now);
+                busRgb[t][0]= lamps.red[i];
+                busRgb[t][1]= lamps.green[i];
+                busRgb[t][2]= lamps.blue[i];
+                uint64_t bit= 1ull<<(t&63);
+                busKnown[t>>6]|= bit;
+                bool queuedUrgent= false;
+                for(int l= 0; l<WRITE_LANES; l++)
+                    if(l<lane) queuedUrgent|= (lampPending[l][t>>6] & bit)!=0;
+                    else lampPending[l][t>>6]&= ~bit;
+                if(!queuedUrgent) lampPending[lane][t>>6]|= bit;
+                n++;
+            });
+            if(!n) return;
+            flog(LOG_INFO, "send: %d lamps (%s)\n", n, laneName(lane));
+            lazyDataAdded();
+        }
+
+        // send every lamp color written so far again, in one burst in lane 'lane'. for a device which was
+        // reopened and doesn't know them.
+        void replayState(int lane)
+        {
+            memset(lampPending, 0, sizeof(lampPending));
+            bool uniform= true;
+            for(int t= 0; t<MAX_LAMPS && uniform; t++)
+                uniform= (busKnown[t>>6]>>(t&63) & 1) && !memcmp(busRgb[t], busRgb[0], 3);
+            if(uniform)
+            {
+                // all lamps have the same color, one command does.
+                setLane(lane);
+                writeColor(busRgb[0][0], busRgb[0][1], busRgb[0][2]);
+                return;
+            }
+            memcpy(lampPending[lane], busKnown, sizeof(busKnown));
+            if(hasLazyData(lane)) lazyDataAdded();
+        }
+
+        bool writeThrottled()
+        { return lost || kernelQueued()>=SERIAL_QUEUE_LIMIT; }
+
+        // time until the output queue should be below the limit again.
+        uint64_t drainNs()
+        {
+            int n= kernelQueued()-SERIAL_QUEUE_LIMIT/2;
+            return max(n, 1)*(1000000000ull/SERIAL_BYTES_PER_SECOND);
+        }
+
+        bool hasLazyData(int l)
+        {
+            for(int w= 0; w<MAX_LAMPS/64; w++) if(lampPending[l][w]) return true;
+            return false;
+        }
+
+        // lamps go out in index order, starting where the last call stopped. otherwise lamps with high
+        // indexes would never get their turn while the low ones keep changing faster than the line.
+        void produceLazyData(int l, LaneBuffer &out, size_t maxBytes)
+        {
+            char buf[MAX_LAMPS*MAX_LAMP_COMMAND_SIZE];
+            size_t n= formatLamps(protocol, buf, maxBytes, lampPending[l], lazyCursor[l], busRgb,
+                                  [&](int t) { if(line) line->lampFormatted(t, l); });
+            if(n) out.append(buf, n);
+        }
+
+        void dropLazyData()
+        {
+            memset(lampPending, 0, sizeof(lampPending));
+            if(line) line->dropped();
+        }
+
+        size_t writeToFile(const char *data, size_t size)
+        {
+            if(line) return line->write(data, size, monotonicNs());
+            if(lost) return 0;
+            return NonblockWriter::writeToFile(data, size);
         }
 
 	private:
+        // bytes written but not sent yet (not read yet for pipes, which are handy for testing), -1 if unknown.
+        int kernelQueued()
+        {
+            if(line) return line->queued(monotonicNs());
+            int n;
+            if(ioctl(getFd(), TIOCOUTQ, &n)<0 && ioctl(getFd(), FIONREAD, &n)<0) return -1;
+            return n;
+        }
+
+        SimulatedLine *line;
+        bool lost;
+        int protocol;
+        LampRouting routing;
+        uint8_t busRgb[MAX_LAMPS][3];                       // colors by bus lamp index, as last written
+        uint64_t lampPending[WRITE_LANES][MAX_LAMPS/64];    // lamps to send, in one lane each
+        int lazyCursor[WRITE_LANES];                        // lamp to start from next time
+        uint64_t busKnown[MAX_LAMPS/64];                    // lamps with a color in busRgb
+        FrameJitter *frameJitter;
+        uint64_t frameDueNs;                                // due time of the frame being written, 0: none
+
 		int openSerial(const char* devname= "/dev/ttyUSB0")
 		{
 			struct termios toptions;
@@ -218,6 +438,8 @@ void printHelp(char *comm)
     printf("use: %s [options]\n", comm);
     printf("options:\n"
            "    -h              print this text.\n"
+           "    -c FILE         read configuration from FILE, reloaded on SIGHUP\n"
+           "    -U PATH         take over from the instance listening on PATH, then listen there for upgrades\n"
            "    -r              allow raw mode (default off)\n"
            "    -l FLAGS        set logging flags\n"
            "                        e: log error messages (default)\n"
@@ -226,20 +448,36 @@ void printHelp(char *comm)
            "                    flags can be combined.\n"
            "    -d              daemonize\n"
            "    -t TTYNAME      set moodlamp tty [/dev/ttyUSB0]\n"
-           "\n");
+           "    -u              use the io_uring I/O backend (falls back to poll() if unavailable)\n"
+           "    -w FILE         capture all received packets to FILE (see moodpd-replay)\n"
+           "    -S FILE         simulate: run the packets captured in FILE in virtual time against an\n"
+           "                    emulated serial line, print statistics and exit\n"
+           "    -b BAUD         baud rate of the emulated serial line [%d]\n"
+           "    -A PACKETS      fail the simulation if a packet after the first PACKETS allocates heap memory\n"
+           "\n", SIM_DEFAULT_BAUD);
 }
 
 // main app class
 class moodpd
 {
     public:
-        moodpd(int argc, char *argv[]): allowRawMode(false)
+        moodpd(int argc, char *argv[]): config(0), frameClockRate(0), skippedFrames(0), rawStats("raw"), oscStats("OSC"),
+            lampBulkRgbAddress("/moodpd/lamps/rgb"), inputLane(LANE_NORMAL), simWarmup(-1), frameDueNs(0), serialLostNs(0),
+            upgradeListenFd(-1), handingOver(false), allowRawMode(false),
+            sock(-1), artnetSock(-1), sacnSock(-1), tcpListenFd(-1), unixListenFd(-1), unixDgramFd(-1),
+            useUring(false), serialWriteInFlight(false), reloadPending(false), uringRecvsToArm(0),
+            lampRgbPattern("/moodpd/lamps/*/rgb"), lampBulkRgbPattern("/moodpd/lamps/rgb"),
+            lampHsvPattern("/moodpd/lamps/*/hsv"), lampRgbfPattern("/moodpd/lamps/*/rgbf"), lampRgb16Pattern("/moodpd/lamps/*/rgb16"),
+            lampBulkHsvPattern("/moodpd/lamps/hsv"), lampBulkRgb16Pattern("/moodpd/lamps/rgb16"),
+            subscribePattern(SUBSCRIBE_ADDRESS), unsubscribePattern(UNSUBSCRIBE_ADDRESS),
+            clusterRgbPattern(CLUSTER_RGB_ADDRESS), configReloadPattern("/moodpd/config/reload"),
+            effectPattern(EFFECT_ADDRESS), oscReaderBusy(false), oscReloadRequested(false)
         {
-            string lamptty= "/dev/ttyUSB0";
-            
-            // parse the command line.
+            // parse the command line. settings which are also in the config file are collected
+            // as "key = value" lines and override the file.
             char opt;
-            while( (opt= getopt(argc, argv, "hl:dt:"))!=-1 )
+            bool baudSet= false;
+            while( (opt= getopt(argc, argv, "hc:U:rl:dt:uw:S:b:A:"))!=-1 )
                 switch(opt)
                 {
                     case '?':
@@ -248,205 +486,1703 @@ class moodpd
                     case 'h':
                         printHelp(argv[0]);
                         exit(0);
+                    case 'c':
+                        configFile= optarg;
+                        break;
+                    case 'U':
+                        configOverrides.push_back(string("upgradesocket = ") + optarg);
+                        break;
+                    case 'r':
+                        configOverrides.push_back("rawmode = on");
+                        break;
                     case 'l':
-                        for(int i= 0; optarg[i]; i++) switch(optarg[i])
+                    {
+                        uint32_t mask= 0;
+                        if(!Config::parseLogFlags(optarg, mask))
                         {
-                            case 'i':
-                                logMask|= (1<<LOG_INFO);
-                            case 'e':
-                                logMask|= (1<<LOG_ERROR);
-                                break;
-                            case 'q':
-                                logMask= 0;
-                                break;
-                            default:
-                                printf("unknown logging flag -- '%c'\n", optarg[i]);
-                                printHelp(argv[0]);
-                                exit(1);
+                            printf("unknown logging flags -- '%s'\n", optarg);
+                            printHelp(argv[0]);
+                            exit(1);
                         }
+                        configOverrides.push_back(string("log = ") + optarg);
                         break;
+                    }
                     case 'd':
                         daemonize();
                         break;
                     case 't':
-                        if(optarg)
-                            lamptty= optarg;
-                        else
-                        {
-                            printHelp(argv[0]);
-                            exit(1);
-                        }
+                        configOverrides.push_back(string("tty = ") + optarg);
+                        break;
+                    case 'u':
+                        useUring= true;
+                        break;
+                    case 'w':
+                        if(!capture.open(optarg)) fail("capture");
+                        break;
+                    case 'S':
+                        simulationFile= optarg;
+                        break;
+                    case 'b':
+                        if(atoi(optarg)<=0) { printHelp(argv[0]); exit(1); }
+                        simLine= SimulatedLine(atoi(optarg));
+                        baudSet= true;
+                        break;
+                    case 'A':
+                        if( (simWarmup= atoi(optarg))<0 ) { printHelp(argv[0]); exit(1); }
                         break;
                 }
+            bool simulating= !simulationFile.empty();
+            if(baudSet && !simulating)
+            {
+                printf("-b only applies to the emulated serial line of -S\n");
+                printHelp(argv[0]);
+                exit(1);
+            }
+            if(simWarmup>=0 && !simulating)
+            {
+                printf("-A only applies to -S\n");
+                printHelp(argv[0]);
+                exit(1);
+            }
+            if(simulating)
+            {
+                virtualClock().now= SIM_START_NS;
+                virtualClock().enabled= true;
+                serial.simulate(&simLine);
+            }
 
-            setLineOrientedStdin();
-            atexit(atexitfn);
+            config= new Config;
+            if(!config->load(configFile, configOverrides)) exit(1);
+            logMask= config->logMask;
+            allowRawMode= config->allowRawMode;
+            serial.setProtocol(config->protocol);
+            serial.setRouting(config->routing);
 
-            sock= socket(AF_INET, SOCK_DGRAM, 0);
-            if(sock<0) fail("socket");
+            if(!simulating)
+            {
+                setLineOrientedStdin();
+                atexit(atexitfn);
+            }
 
-            struct sockaddr_in sa;
-            memset(&sa, 0, sizeof(sa));
-            sa.sin_family= AF_INET;
-            sa.sin_addr.s_addr= htonl(INADDR_ANY);
-            sa.sin_port= htons(DEFAULT_PORT);
-            if(bind(sock, (sockaddr*)&sa, sizeof(sa))<0)
-                fail("bind");
+            // SIGHUP reloads the config, SIGUSR1 logs the ingest statistics. they are read through a
+            // signalfd so they can be handled in the main loop.
+            sigset_t sigs;
+            sigemptyset(&sigs);
+            sigaddset(&sigs, SIGHUP);
+            sigaddset(&sigs, SIGUSR1);
+            sigprocmask(SIG_BLOCK, &sigs, 0);
+            signalFd= signalfd(-1, &sigs, SFD_NONBLOCK|SFD_CLOEXEC);
+            if(signalFd<0) fail("signalfd");
+            // a file output whose reader went away gets EPIPE instead.
+            signal(SIGPIPE, SIG_IGN);
 
-            if(!serial.open(lamptty.c_str())) fail("openSerial");
-            
-            if(!oscSocket.bindTo(DEFAULT_PORT+1, oscpkt::UdpSocket::OPTION_UNSPEC)) 
-                fail("osc socket: bindTo() failed");
-            
-            
+            // frame clock for the effects, only armed while an effect is running.
+            frameTimerFd= timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+            if(frameTimerFd<0) fail("timerfd_create");
+            // wakes us up when the tty's output queue has drained, while writes are held back.
+            serialTimerFd= timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+            if(serialTimerFd<0) fail("timerfd_create");
+            // what a new socket gets, "rcvbuf = 0" goes back to it.
+            int probe= socket(AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+            defaultReceiveBuffer= probe>=0? setReceiveBuffer(probe, 0): -1;
+            if(probe>=0) close(probe);
+            // expires subscriptions while the frame clock is stopped.
+            leaseTimerFd= timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+            if(leaseTimerFd<0) fail("timerfd_create");
+
+            // sockets and tty come from a running instance, from systemd, or are opened here, in that order.
+            // a simulation opens none of them, its packets come from the capture.
+            bool tookOver= !simulating && !config->upgradeSocket.empty() && takeOver(config->upgradeSocket.c_str());
+            if(!tookOver && !simulating) inheritListenFds();
 
-#ifdef MUCPROTOCOL
-            // write some magic undocumented initialization bytes...
-            char init0[]= "acI\1\2\2ab";
-            char init1[]= "acW\0ab";
-            serial.write(init0, sizeof(init0)-1);
-            serial.write(init1, sizeof(init1)-1);
-#else
-            serial.write("q\n", 2);
-#endif
+            bool multicast= !config->multicastGroups.empty();
+            if(!simulating)
+            {
+                if(sock<0 && (sock= openUdpSocket(config->rawPort, multicast))<0) fail("raw socket");
+
+                if(oscSocket.socketHandle()<0)
+                {
+                    int fd= openUdpSocket(config->oscPort, multicast);
+                    if(fd<0) fail("osc socket");
+                    adoptOscSocket(fd);
+                }
+                setMulticastGroups(config->multicastGroups, true);
+                if(!openDmxSockets(*config, artnetSock, sacnSock)) fail("dmx sockets");
+                if(!openStreamSockets(*config, tcpListenFd, unixListenFd, unixDgramFd)) fail("stream sockets");
+                setupIngestSockets();
+            }
+
+            if(!tookOver)
+            {
+                if(!simulating && !serial.open(config->tty.c_str())) fail("openSerial");
+                serial.writeInit();
+            }
+
+            if(!config->upgradeSocket.empty() && !simulating)
+                upgradeListenFd= listenUnix(config->upgradeSocket.c_str());
+            inputs.setMappings(config->inputs);
+            router.setRules(config->forwards);
+            if(!simulating) outputs.setSpecs(config->outputs, lamps);   // a simulation doesn't send anything
+            serial.setMaxLaneWait(config->laneWaitMs*1000000ull);
+            ingest= &lamps;
+            effectsLayer= merge.addInternal();
+            inputsLayer= merge.addInternal();
+            syncEffectsLayer();
+            memset(allLampsRgb, 0, sizeof(allLampsRgb));
+            updateFrameClock();
+            if(!simulating) applyRealtime(0);
         }
 
         void run()
         {
+            if(!simulationFile.empty())
+            {
+                runSimulation();
+                return;
+            }
+            if(useUring)
+            {
+                if(setupUring())
+                {
+                    flog(LOG_INFO, "entering main loop (io_uring backend).\n");
+                    runUring();
+                }
+                // only get here if io_uring turned out to be unusable.
+                flog(LOG_ERROR, "io_uring backend unavailable, falling back to poll().\n");
+                uring.close();
+                // closing the ring ended what was in flight, no completions come for it any more.
+                serialWriteInFlight= false;
+                uringPolls.clear();
+                uringRecvsToArm= 0;
+                serial.setDeferredFlush(false);
+                serial.flush();
+                if(reloadPending)
+                    reloadPending= false, reloadConfig();
+            }
+
             flog(LOG_INFO, "entering main loop.\n");
 
-            fd_set readset;
+            vector<pollfd> pollfds;
             while(true)
             {
-                vector<pollfd> pollfds;
-
-                pollfds.push_back( (pollfd){ sock, POLLIN, 0 } );
-                pollfds.push_back( (pollfd){ serial.getFd(), (isatty(serial.getFd())? POLLIN: 0) | (serial.writeBufferEmpty()? 0: POLLOUT), 0 } );
-                if(isatty(STDIN_FILENO)) pollfds.push_back( (pollfd){ STDIN_FILENO, POLLIN, 0 } );
-                pollfds.push_back( (pollfd){ oscSocket.socketHandle(), POLLIN, 0 } );
+                checkSerial();
+                getPollFds(pollfds);
 
                 if(poll(&pollfds.front(), pollfds.size(), -1)<0)
                     fail("poll");
  
                 for(int i= 0; i<pollfds.size(); i++)
+                    handlePollEvent(pollfds[i]);
+            }
+        }
+
+        // collect the fds the main loop waits on.
+        void getPollFds(vector<pollfd> &pollfds)
+        {
+            pollfds.clear();
+            pollfds.push_back( (pollfd){ sock, POLLIN, 0 } );
+            bool serialPending= !serial.writeBufferEmpty(), throttled= serialPending && serial.writeThrottled();
+            if(serial.getFd()>=0)
+                pollfds.push_back( (pollfd){ serial.getFd(), (short)((isatty(serial.getFd())? POLLIN: 0) | (serialPending && !throttled? POLLOUT: 0)), 0 } );
+            if(isatty(STDIN_FILENO)) pollfds.push_back( (pollfd){ STDIN_FILENO, POLLIN, 0 } );
+            pollfds.push_back( (pollfd){ oscSocket.socketHandle(), POLLIN, 0 } );
+            pollfds.push_back( (pollfd){ signalFd, POLLIN, 0 } );
+            pollfds.push_back( (pollfd){ frameTimerFd, POLLIN, 0 } );
+            pollfds.push_back( (pollfd){ serialTimerFd, POLLIN, 0 } );
+            pollfds.push_back( (pollfd){ leaseTimerFd, POLLIN, 0 } );
+            if(throttled && !serial.isLost())
+                armTimer(serialTimerFd, serial.drainNs());
+            if(deviceWatch.active()) pollfds.push_back( (pollfd){ deviceWatch.getFd(), POLLIN, 0 } );
+            if(upgradeListenFd>=0) pollfds.push_back( (pollfd){ upgradeListenFd, POLLIN, 0 } );
+            if(artnetSock>=0) pollfds.push_back( (pollfd){ artnetSock, POLLIN, 0 } );
+            if(sacnSock>=0) pollfds.push_back( (pollfd){ sacnSock, POLLIN, 0 } );
+            if(tcpListenFd>=0) pollfds.push_back( (pollfd){ tcpListenFd, POLLIN, 0 } );
+            if(unixListenFd>=0) pollfds.push_back( (pollfd){ unixListenFd, POLLIN, 0 } );
+            if(unixDgramFd>=0) pollfds.push_back( (pollfd){ unixDgramFd, POLLIN, 0 } );
+            for(map<int, StreamClient*>::iterator it= streamClients.begin(); it!=streamClients.end(); ++it)
+                pollfds.push_back( (pollfd){ it->first, POLLIN, 0 } );
+        }
+
+        void handlePollEvent(const pollfd &pfd)
+        {
+            // stream clients hanging up is normal, deal with them before checking for bad fds.
+            if(streamClients.count(pfd.fd))
+            {
+                if(pfd.revents) handleStreamClient(pfd.fd);
+                return;
+            }
+            if(pfd.fd==serial.getFd() && (pfd.revents & (POLLERR|POLLHUP|POLLNVAL)))
+            {
+                serial.writeFailed(EIO);
+                checkSerial();
+                return;
+            }
+            if(pfd.revents & (POLLERR|POLLRDHUP|POLLHUP|POLLNVAL))
+                flog(LOG_CRIT, "poll: %sfd went bad.\n", pfd.fd==sock? "socket ": pfd.fd==serial.getFd()? "serial ": ""),
+                exit(1);
+            if(pfd.fd==sock)
+            {
+                if(!(pfd.revents&POLLIN)) return;
+                sockaddr_storage sa_from;
+                char buf[MOODPD_MAXPACKETSIZE+1];
+                RecvInfo info;
+                memset(&sa_from, 0, sizeof(sa_from));
+                ssize_t sz= recvDatagram(sock, buf, sizeof(buf)-1, sa_from, info);
+                if(sz<0)
                 {
-                    pollfd &pfd= pollfds[i];
-                    if(pfd.revents & (POLLERR|POLLRDHUP|POLLHUP|POLLNVAL))
-                        flog(LOG_CRIT, "poll: %sfd went bad.\n", pfd.fd==sock? "socket ": pfd.fd==serial.getFd()? "serial ": ""),
-                        exit(1);
-                    if(pfd.fd==sock)
+                    if(errno!=EAGAIN) logerror("recvfrom");
+                    return;
+                }
+                rawStats.received(info);
+                uint64_t t0= monotonicNs(), a0= heapStats.allocations;
+                handleRawPacket(buf, sz, (const sockaddr*)&sa_from);
+                rawStats.processed(monotonicNs()-t0, heapStats.allocations-a0);
+            }
+            else if(pfd.fd==serial.getFd())
+            {
+                if(pfd.revents&POLLIN)
+                {
+                    char txt[1024];
+                    int n= read(serial.getFd(), txt, 1023);
+                    if(logMask & (1<<LOG_INFO))
                     {
-                        if(!pfd.revents&POLLIN) continue;
-                        sockaddr_in sa_from;
-                        socklen_t sa_len= sizeof(sa_from);
-                        char buf[MOODPD_MAXPACKETSIZE+1];
-                        memset(&sa_from, 0, sizeof(sa_from));
-                        ssize_t sz= recvfrom(sock, buf, sizeof(buf)-1, 0, (sockaddr*)&sa_from, &sa_len);
-                        if(sz<=0)
-                        {
-                            logerror("recvfrom");
-                            continue;
-                        }
-                        buf[sz]= 0; // zero-terminate message string
-                        moodpd_packet *p= (moodpd_packet*)buf;
-                        if(p->magic != MOODPD_MAGIC || (unsigned)sz<=sizeof(moodpd_packet))
-                        {
-                            flog(LOG_ERROR, "received malformed packet from %s.\n", inet_ntoa(sa_from.sin_addr));
-                            continue;
-                        }
-                        int msgsize= sz-offsetof(moodpd_packet, message);
-                        parseMessage(p->type, p->message, msgsize);
+                        if(n<=0) return; // read error
+                        txt[n]= 0;
+                        flog(LOG_INFO, "the mood lamp says: '");
+                        fflush(stderr);
+                        n= write(STDERR_FILENO, txt, n);
+                        fprintf(stderr, "'\n");
                     }
-                    else if(pfd.fd==serial.getFd())
+                }
+                if(pfd.revents&POLLOUT)
+                    flog(LOG_INFO, "serial ready for writing. buffer size: %d\n", serial.getWritebufferSize()),
+                    serial.flush();
+            }
+            else if(pfd.fd==STDIN_FILENO)
+            {
+                if(!(pfd.revents&POLLIN)) return;
+                char c;
+                ssize_t s= read(STDIN_FILENO, &c, 1);
+                if(s!=1) return;
+                switch(c)
+                {
+                    case '?':
+                        printf( "KEYS:\n"
+                                "\t?\tshow this text\n"
+                                "\tv\tset verbosity\n"
+                                "\tr\tallow raw mode on/off\n"
+                                "\tc\treload configuration\n"
+                                "\ts\tshow ingest statistics\n");
+                        break;
+                    case 'v':
+                        if(!logMask) { logMask|= (1<<LOG_ERROR); puts("verbosity: errors only"); }
+                        else if(logMask&(1<<LOG_INFO)) { logMask= 0; puts("verbosity: quiet"); }
+                        else if(logMask&(1<<LOG_ERROR)) { logMask|= (1<<LOG_INFO); puts("verbosity: errors+info"); }
+                        break;
+                    case 'r':
+                        allowRawMode^= 1;
+                        puts(allowRawMode? "allow raw mode ON": "allow raw mode OFF");
+                        break;
+                    case 'c':
+                        reloadConfig();
+                        break;
+                    case 's':
+                        printStats(stdout);
+                        break;
+                }
+            }
+            else if(pfd.fd==signalFd)
+            {
+                if(!(pfd.revents&POLLIN)) return;
+                signalfd_siginfo si;
+                while(read(signalFd, &si, sizeof(si))==sizeof(si))
+                    if(si.ssi_signo==SIGHUP) reloadConfig();
+                    else if(si.ssi_signo==SIGUSR1) printStats(stderr);
+            }
+            else if(pfd.fd==serialTimerFd)
+            {
+                if(!(pfd.revents&POLLIN)) return;
+                uint64_t expirations;
+                if(read(serialTimerFd, &expirations, sizeof(expirations))!=sizeof(expirations)) return;
+                if(serial.isLost()) reconnectSerial();
+                else if(!uring.isOpen()) serial.flush();    // the io_uring loop submits writes itself
+            }
+            else if(pfd.fd==frameTimerFd)
+            {
+                if(!(pfd.revents&POLLIN)) return;
+                uint64_t expirations;
+                if(read(frameTimerFd, &expirations, sizeof(expirations))==sizeof(expirations))
+                    frameTick(expirations);
+            }
+            else if(pfd.fd==leaseTimerFd)
+            {
+                if(!(pfd.revents&POLLIN)) return;
+                uint64_t expirations;
+                if(read(leaseTimerFd, &expirations, sizeof(expirations))!=sizeof(expirations)) return;
+                subscriptions.expire(monotonicNs());
+                armLeaseTimer();
+            }
+            else if(pfd.fd==artnetSock || pfd.fd==sacnSock)
+            {
+                if(!(pfd.revents&POLLIN)) return;
+                // a desk sends all its universes every frame, so take everything queued, a batch per call.
+                sockaddr_storage from[DMX_RECV_BATCH];
+                uint8_t buf[DMX_RECV_BATCH][1024];
+                iovec iov[DMX_RECV_BATCH];
+                mmsghdr msgs[DMX_RECV_BATCH];
+                int n;
+                do
+                {
+                    memset(msgs, 0, sizeof(msgs));
+                    for(int i= 0; i<DMX_RECV_BATCH; i++)
                     {
-                        if(pfd.revents&POLLIN)
-                        {
-                            char txt[1024];
-                            int n= read(serial.getFd(), txt, 1023);
-                            if(logMask & (1<<LOG_INFO))
-                            {
-                                if(n<=0) continue; // read error
-                                txt[n]= 0;
-                                flog(LOG_INFO, "the mood lamp says: '");
-                                fflush(stderr);
-                                n= write(STDERR_FILENO, txt, n);
-                                fprintf(stderr, "'\n");
-                            }
-                        }
-                        if(pfd.revents&POLLOUT)
-                            flog(LOG_INFO, "serial ready for writing. buffer size: %d\n", serial.getWritebufferSize()),
-                            serial.flush();
+                        iov[i].iov_base= buf[i];
+                        iov[i].iov_len= sizeof(buf[i]);
+                        msgs[i].msg_hdr.msg_name= &from[i];
+                        msgs[i].msg_hdr.msg_namelen= sizeof(from[i]);
+                        msgs[i].msg_hdr.msg_iov= &iov[i];
+                        msgs[i].msg_hdr.msg_iovlen= 1;
                     }
-                    else if(pfd.fd==STDIN_FILENO)
+                    if( (n= recvmmsg(pfd.fd, msgs, DMX_RECV_BATCH, MSG_DONTWAIT, 0))<0 )
                     {
-                        if(!pfd.revents&POLLIN) continue;
-                        char c;
-                        ssize_t s= read(STDIN_FILENO, &c, 1);
-                        if(s!=1) continue;
-                        switch(c)
-                        {
-                            case '?':
-                                printf( "KEYS:\n"
-                                        "\t?\tshow this text\n"
-                                        "\tv\tset verbosity\n"
-                                        "\tr\tallow raw mode on/off\n");
-                                break;
-                            case 'v':
-                                if(!logMask) { logMask|= (1<<LOG_ERROR); puts("verbosity: errors only"); }
-                                else if(logMask&(1<<LOG_INFO)) { logMask= 0; puts("verbosity: quiet"); }
-                                else if(logMask&(1<<LOG_ERROR)) { logMask|= (1<<LOG_INFO); puts("verbosity: errors+info"); }
-                                break;
-                            case 'r':
-                                allowRawMode^= 1;
-                                puts(allowRawMode? "allow raw mode ON": "allow raw mode OFF");
-                                break;
-                        }
+                        if(errno!=EAGAIN) logerror("recvmmsg");
+                        return;
+                    }
+                    for(int i= 0; i<n; i++)
+                        handleDmxPacket(buf[i], msgs[i].msg_len, (const sockaddr*)&from[i], pfd.fd==sacnSock);
+                } while(n==DMX_RECV_BATCH);
+            }
+            else if(pfd.fd==tcpListenFd || pfd.fd==unixListenFd)
+            {
+                if(!(pfd.revents&POLLIN)) return;
+                acceptStreamClient(pfd.fd);
+            }
+            else if(pfd.fd==unixDgramFd)
+            {
+                if(!(pfd.revents&POLLIN)) return;
+                sockaddr_storage sa_from;
+                socklen_t sa_len= sizeof(sa_from);
+                memset(&sa_from, 0, sizeof(sa_from));
+                dgramBuffer.resize(SLIP_MAX_FRAME);
+                ssize_t sz= recvfrom(unixDgramFd, &dgramBuffer[0], dgramBuffer.size(), MSG_DONTWAIT, (sockaddr*)&sa_from, &sa_len);
+                if(sz<0)
+                {
+                    if(errno!=EAGAIN) logerror("recvfrom");
+                    return;
+                }
+                handleOscPacket(&dgramBuffer[0], sz, (const sockaddr*)&sa_from, 0, unixDgramFd);
+            }
+            else if(pfd.fd==deviceWatch.getFd())
+            {
+                if(!(pfd.revents&POLLIN)) return;
+                if(deviceWatch.changed()) reconnectSerial();
+            }
+            else if(pfd.fd==upgradeListenFd)
+            {
+                if(!(pfd.revents&POLLIN) || handingOver) return;
+                handOver();
+            }
+            else if(pfd.fd==oscSocket.socketHandle())
+            {
+                if(!(pfd.revents&POLLIN)) return;
+                sockaddr_storage sa_from;
+                RecvInfo info;
+                memset(&sa_from, 0, sizeof(sa_from));
+                oscBuffer.resize(65536);
+                ssize_t sz= recvDatagram(oscSocket.socketHandle(), &oscBuffer[0], oscBuffer.size(), sa_from, info);
+                if(sz<0)
+                {
+                    if(errno!=EAGAIN) logerror("recvfrom");
+                    return;
+                }
+                oscStats.received(info);
+                uint64_t t0= monotonicNs(), a0= heapStats.allocations;
+                handleOscPacket(&oscBuffer[0], sz, (const sockaddr*)&sa_from, config->oscPort, oscSocket.socketHandle());
+                oscStats.processed(monotonicNs()-t0, heapStats.allocations-a0);
+            }
+        }
+
+        // start waiting for a serial device which went away: close it, watch for it to come back and retry
+        // opening it periodically.
+        void checkSerial()
+        {
+            if(!serial.isLost() || deviceWatch.active()) return;
+            closePolledFd(serial.getFd());
+            serial.detach();
+            serialLostNs= monotonicNs();
+            deviceWatch.start(config->tty);
+            armTimer(serialTimerFd, HOTPLUG_RETRY_MS*1000000ull, HOTPLUG_RETRY_MS*1000000ull);
+            flog(LOG_ERROR, "waiting for %s to come back.\n", config->tty.c_str());
+        }
+
+        // reopen a lost serial device if it's there again. it's initialized and gets the whole lamp state
+        // in one burst, ahead of everything else.
+        void reconnectSerial()
+        {
+            // the buffer of a write still in flight must stay valid. there's another try on the next timer tick.
+            if(serialWriteInFlight || access(config->tty.c_str(), R_OK|W_OK)<0) return;
+            if(!serial.reopen(config->tty.c_str())) return;     // detached, there's no old fd
+            closePolledFd(deviceWatch.release());
+            armTimer(serialTimerFd, 0);
+            serial.setLane(LANE_INTERACTIVE);
+            serial.writeInit();
+            serial.replayState(LANE_INTERACTIVE);
+            flog(LOG_ERROR, "%s is back after %.3f s, lamp state restored.\n", config->tty.c_str(),
+                 (monotonicNs()-serialLostNs)/1e9);
+        }
+
+        // arm a timerfd, 0 disarms it.
+        void armTimer(int fd, uint64_t ns, uint64_t intervalNs= 0)
+        {
+            itimerspec its;
+            its.it_value.tv_sec= ns/1000000000;
+            its.it_value.tv_nsec= ns%1000000000;
+            its.it_interval.tv_sec= intervalNs/1000000000;
+            its.it_interval.tv_nsec= intervalNs%1000000000;
+            if(timerfd_settime(fd, 0, &its, 0)<0) logerror("timerfd_settime");
+        }
+
+        // kernel receive timestamps and drop counts for the statistics, and the configured receive buffer
+        // size, on the raw and OSC sockets.
+        void setupIngestSockets()
+        {
+            int fds[2]= { sock, oscSocket.socketHandle() };
+            for(int i= 0; i<2; i++)
+            {
+                enableRecvInfo(fds[i]);
+                if(!config->receiveBuffer)
+                {
+                    // back to the system default if an earlier config enlarged it.
+                    if(defaultReceiveBuffer>0 && setReceiveBuffer(fds[i], 0)!=defaultReceiveBuffer)
+                        setReceiveBuffer(fds[i], defaultReceiveBuffer/2);
+                    continue;
+                }
+                // the kernel reports twice the size asked for, the other half is for its bookkeeping.
+                int actual= setReceiveBuffer(fds[i], config->receiveBuffer);
+                if(actual<0) logerror("SO_RCVBUF");
+                else if(actual/2<config->receiveBuffer)
+                    flog(LOG_ERROR, "receive buffer is %d bytes instead of %d, raise net.core.rmem_max or give moodpd CAP_NET_ADMIN.\n",
+                         actual/2, config->receiveBuffer);
+            }
+        }
+
+        void printStats(FILE *f)
+        {
+            rawStats.print(f, sock);
+            oscStats.print(f, oscSocket.socketHandle());
+            if(config->mergeMode!=MERGE_OFF) fprintf(f, "merging %d sources\n", merge.sources());
+            router.print(f);
+            outputs.print(f);
+            frameJitter.print(f);
+            printHeapStats(f);
+            fflush(f);
+        }
+
+        // handle a datagram received on the raw command port. buf must have room for a terminating 0 at buf[sz].
+        void handleRawPacket(char *buf, ssize_t sz, const sockaddr *from)
+        {
+            capture.write(CAPTURE_RAW, from, buf, sz);
+            if(!checkRateLimit()) return;
+            buf[sz]= 0; // zero-terminate message string
+            moodpd_packet *p= (moodpd_packet*)buf;
+            if(p->magic != MOODPD_MAGIC || (unsigned)sz<=sizeof(moodpd_packet))
+            {
+                flog(LOG_ERROR, "received malformed packet from %s.\n", addressString(from).c_str());
+                return;
+            }
+            int msgsize= sz-offsetof(moodpd_packet, message);
+            int lane= packetClass(config->rawPort, from);
+            serial.setLane(lane);
+            selectLayer(from);
+            parseMessage(p->type, p->message, msgsize);
+            layerDone(lane);
+            flushLamps();
+        }
+
+        // 'localPort' is the port the packet arrived on (0 for UNIX sockets), 'replyFd' the datagram socket
+        // it came in on, -1 for streams. subscriptions need one.
+        void handleOscPacket(const void *data, size_t size, const sockaddr *from, int localPort, int replyFd= -1)
+        {
+            capture.write(CAPTURE_OSC, from, data, size);
+            if(!checkRateLimit()) return;
+            flog(LOG_INFO, "OSC packet\n");
+            int lane= packetLane(config->priorities, localPort, from);
+            // a packet routed to other hosts only gets a layer (see selectLayer()) once one of its
+            // messages is handled here.
+            bool routed= router.route((const char*)data, size, oscSocket.socketHandle())>0;
+            if(routed) updateFrameClock();
+            else selectLayer(from);
+            if(!routed && decodeBulkRgb((const char*)data, size))
+            {
+                lane= oscLane(config->priorities, lampBulkRgbAddress, lane);
+                serial.setLane(lane<0? LANE_NORMAL: lane);
+                layerDone(serial.getLane());
+                flushLamps();
+                return;
+            }
+            bool fromPeer= false;   // where the lamp changes not flushed yet came from
+            // the kept reader reuses its messages' buffers. a packet handled while another one is being
+            // read (queued packets drained by a config reload) gets a reader of its own.
+            oscpkt::PacketReader nestedReader;
+            oscpkt::PacketReader &pr= oscReaderBusy? nestedReader: oscReader;
+            bool outerPacket= !oscReaderBusy;
+            oscReaderBusy= true;
+            // lamp writes which bypass the layers (writeColor for 'all', muccc) go out on this packet's lane.
+            serial.setLane(lane<0? LANE_NORMAL: lane);
+            oscpkt::Message *msg;
+            pr.init(data, size);
+            while(pr.isOk() && (msg = pr.popMessage()) != 0)
+            {
+                int r, g, b;
+                float x, y, z;
+                if(routed && router.match(msg->addressPattern().c_str())>=0) continue;
+                if(routed && ingest==&lamps) selectLayer(from);
+                // changes from a peer aren't forwarded to the cluster again, those from clients are. a bundle
+                // can have both, so what came from one side is flushed before the other side's messages.
+                bool peerMessage= clusterRgbPattern.match(msg->addressPattern());
+                if(peerMessage!=fromPeer)
+                {
+                    flushLamps(!fromPeer);
+                    fromPeer= peerMessage;
+                }
+                lane= oscLane(config->priorities, msg->addressPattern(), lane);
+                serial.setLane(lane<0? LANE_NORMAL: lane);
+                if(inputs.handle(*msg, monotonicNs()))
+                {
+                    inputLane= lane<0? LANE_NORMAL: lane;
+                    continue;
+                }
+                if(lampRgbPattern.match(msg->addressPattern()) && msg->arg()
+                    .popInt32(r)
+                    .popInt32(g)
+                    .popInt32(b)
+                    .isOkNoMoreArgs())
+                {
+                    r= min(255, max(r, 0));
+                    g= min(255, max(g, 0));
+                    b= min(255, max(b, 0));
+                    int lampIndex= lampIndexFromAddress(msg->addressPattern());
+                    flog(LOG_INFO, "osc: lamp %d -> red %d, green %d, blue %d\n", lampIndex, r, g, b);
+                    ingest->set(lampIndex, r, g, b);
+                }
+                else if(lampBulkRgbPattern.match(msg->addressPattern()) && msg->arg()
+                    .popInt32(r)
+                    .popBlob(blobBuffer)
+                    .isOkNoMoreArgs())
+                {
+                    setLampsPacked(r, (const uint8_t*)blobBuffer.data(), blobBuffer.size());
+                }
+                else if(lampHsvPattern.match(msg->addressPattern()) && msg->arg()
+                    .popFloat(x)
+                    .popFloat(y)
+                    .popFloat(z)
+                    .isOkNoMoreArgs())
+                {
+                    uint16_t h= hueFromFloat(x);
+                    uint8_t s= colorFloatTo8(y), v= colorFloatTo8(z), rgb[3];
+                    hsvToRgb(&h, &s, &v, rgb, rgb+1, rgb+2, 1);
+                    ingest->set(lampIndexFromAddress(msg->addressPattern()), rgb[0], rgb[1], rgb[2]);
+                }
+                else if(lampRgbfPattern.match(msg->addressPattern()) && msg->arg()
+                    .popFloat(x)
+                    .popFloat(y)
+                    .popFloat(z)
+                    .isOkNoMoreArgs())
+                {
+                    ingest->set(lampIndexFromAddress(msg->addressPattern()), colorFloatTo8(x), colorFloatTo8(y), colorFloatTo8(z));
+                }
+                else if(lampRgb16Pattern.match(msg->addressPattern()) && msg->arg()
+                    .popInt32(r)
+                    .popInt32(g)
+                    .popInt32(b)
+                    .isOkNoMoreArgs())
+                {
+                    ingest->set(lampIndexFromAddress(msg->addressPattern()),
+                              color16To8(min(65535, max(r, 0))), color16To8(min(65535, max(g, 0))), color16To8(min(65535, max(b, 0))));
+                }
+                else if(lampBulkHsvPattern.match(msg->addressPattern()) && msg->arg()
+                    .popInt32(r)
+                    .popBlob(blobBuffer)
+                    .isOkNoMoreArgs())
+                {
+                    setLampsHsv(r, (const uint8_t*)blobBuffer.data(), blobBuffer.size());
+                }
+                else if(lampBulkRgb16Pattern.match(msg->addressPattern()) && msg->arg()
+                    .popInt32(r)
+                    .popBlob(blobBuffer)
+                    .isOkNoMoreArgs())
+                {
+                    setLampsRgb16(r, (const uint8_t*)blobBuffer.data(), blobBuffer.size());
+                }
+                else if(peerMessage && msg->arg()
+                    .popInt32(r)
+                    .popBlob(blobBuffer)
+                    .isOkNoMoreArgs())
+                {
+                    setLampsPacked(r, (const uint8_t*)blobBuffer.data(), blobBuffer.size());
+                }
+                else if(configReloadPattern.match(msg->addressPattern()) && msg->arg().isOkNoMoreArgs())
+                    oscReloadRequested= true;
+                else if(effectPattern.match(msg->addressPattern()))
+                    handleEffectMessage(*msg);
+                else if(subscribePattern.match(msg->addressPattern()))
+                    handleSubscribeMessage(*msg, from, replyFd);
+                else if(unsubscribePattern.match(msg->addressPattern()) && msg->arg().isOkNoMoreArgs())
+                {
+                    socklen_t len= sockaddrLength(from);
+                    if(replyFd>=0 && len) subscriptions.unsubscribe(replyFd, from, len);
+                }
+                else
+                    flog(LOG_INFO, "osc: no handler or route for %s\n", msg->addressPattern().c_str());
+            }
+            if(!inputs.settled()) updateFrameClock();
+            serial.setLane(lane<0? LANE_NORMAL: lane);
+            layerDone(serial.getLane());
+            flushLamps(!fromPeer);
+            if(!outerPacket) return;
+            // the reload drains queued packets, which would take over the layer and reader of this one.
+            // it runs once the packet is done, the drained packets are nested ones.
+            while(oscReloadRequested)
+                oscReloadRequested= false, reloadConfig();
+            oscReaderBusy= false;
+        }
+
+        void handleDmxPacket(const uint8_t *data, size_t size, const sockaddr *from, bool sacn)
+        {
+            capture.write(sacn? CAPTURE_SACN: CAPTURE_ARTNET, from, data, size);
+            if(!checkRateLimit()) return;
+            int universe, length;
+            const uint8_t *dmx= sacn? parseSacn(data, size, universe, length): parseArtDmx(data, size, universe, length);
+            if(!dmx) return;    // not DMX data (polls, sync packets etc.)
+            int lane= packetClass(sacn? SACN_PORT: ARTNET_PORT, from);
+            serial.setLane(lane);
+            selectLayer(from);
+            int changed= applyDmx(config->dmxPatches, universe, dmx, length, *ingest);
+            layerDone(lane);
+            if(changed) flog(LOG_INFO, "%s universe %d: %d lamps changed\n", sacn? "sACN": "Art-Net", universe, changed);
+            flushLamps();
+        }
+
+        // /moodpd/effect TYPE FIRST COUNT [SPEED [PARAM [R G B]]]: start, retune or (TYPE "off") stop an effect.
+        void handleEffectMessage(const oscpkt::Message &msg)
+        {
+            Effect e;
+            memset(&e, 0, sizeof(e));
+            string name;
+            int r= 255, g= 255, b= 255;
+            oscpkt::Message::ArgReader arg= msg.arg();
+            arg.popStr(name).popInt32(e.firstLamp).popInt32(e.count);
+            e.type= effectType(name);
+            e.speed= 1.0f;
+            e.param= effectDefaultParam(e.type);
+            if(arg.nbArgRemaining()) arg.popFloat(e.speed);
+            if(arg.nbArgRemaining()) arg.popFloat(e.param);
+            if(arg.nbArgRemaining()) arg.popInt32(r).popInt32(g).popInt32(b);
+            if(!arg.isOkNoMoreArgs() || e.type<0 || e.firstLamp<0 || e.count<=0 || e.firstLamp+e.count>MAX_LAMPS ||
+               !(e.speed>=0))
+            {
+                flog(LOG_ERROR, "bad effect message.\n");
+                return;
+            }
+            e.color[0]= min(255, max(r, 0));
+            e.color[1]= min(255, max(g, 0));
+            e.color[2]= min(255, max(b, 0));
+            e.startNs= monotonicNs();
+
+            if(e.type==EFFECT_NONE)
+                effects.stop(e.firstLamp, e.count);
+            else if(!effects.start(e))
+                flog(LOG_ERROR, "too many effects running, '%s' not started.\n", name.c_str());
+            syncEffectsLayer();
+            flog(LOG_INFO, "effect %s on lamps %d..%d, speed %g, param %g\n",
+                 name.c_str(), e.firstLamp, e.firstLamp+e.count-1, e.speed, e.param);
+            updateFrameClock();
+        }
+
+        // /moodpd/subscribe FIRST COUNT [MAXRATE]: send changes of these lamps to the sender.
+        void handleSubscribeMessage(const oscpkt::Message &msg, const sockaddr *from, int replyFd)
+        {
+            int first, count, maxRate= config->frameRate;
+            oscpkt::Message::ArgReader arg= msg.arg();
+            arg.popInt32(first).popInt32(count);
+            if(arg.nbArgRemaining()) arg.popInt32(maxRate);
+            socklen_t len= sockaddrLength(from);
+            if(!arg.isOkNoMoreArgs() || first<0 || count<=0 || first+count>MAX_LAMPS || maxRate<=0)
+            {
+                flog(LOG_ERROR, "bad subscribe message.\n");
+                return;
+            }
+            if(replyFd<0 || !len)
+            {
+                flog(LOG_ERROR, "subscription from %s refused, only datagram clients with an address can subscribe.\n",
+                     addressString(from).c_str());
+                return;
+            }
+            if(!subscriberAllowed(config->subscriberNets, from))
+            {
+                flog(LOG_ERROR, "subscription from %s refused, not a local or listed address.\n", addressString(from).c_str());
+                return;
+            }
+            if(!subscriptions.subscribe(replyFd, from, len, first, count, min(maxRate, config->frameRate), monotonicNs()))
+            {
+                flog(LOG_ERROR, "too many subscribers, subscription from %s refused.\n", addressString(from).c_str());
+                return;
+            }
+            flog(LOG_INFO, "%s subscribed to lamps %d..%d.\n", addressString(from).c_str(), first, first+count-1);
+            armLeaseTimer();
+            updateFrameClock();
+        }
+
+        // wake up when the next subscription expires.
+        void armLeaseTimer()
+        {
+            uint64_t next= subscriptions.nextExpiryNs(), now= monotonicNs();
+            armTimer(leaseTimerFd, !next? 0: next>now? next-now: 1);
+        }
+
+        // run the frame clock while effects are running, inputs are still moving, subscribers or peers wait
+        // for changes or outputs need frames, stop it otherwise.
+        void updateFrameClock()
+        {
+            int rate= (effects.active() || !inputs.settled() || subscriptions.pending() || router.pending() ||
+                       cluster.pending() || outputs.wantsFrames() || (config->mergeMode!=MERGE_OFF && merge.active()))? config->frameRate: 0;
+            if(rate==frameClockRate) return;
+            frameClockRate= rate;
+            frameDueNs= rate? monotonicNs()+1000000000ull/rate: 0;
+            if(virtualClock().enabled) return;
+            itimerspec its;
+            memset(&its, 0, sizeof(its));
+            if(rate)
+            {
+                its.it_interval.tv_nsec= 1000000000/rate;
+                if(rate==1) its.it_interval.tv_sec= 1, its.it_interval.tv_nsec= 0;
+                its.it_value= its.it_interval;
+            }
+            if(timerfd_settime(frameTimerFd, 0, &its, 0)<0) logerror("timerfd_settime");
+        }
+
+        // the frame clock ticked 'expirations' times since the last tick. the frame is rendered once, its
+        // lateness against the last missed tick goes into the jitter statistics when its output has been
+        // written to the tty.
+        void frameTick(uint64_t expirations)
+        {
+            if(!frameClockRate || !expirations) return;
+            uint64_t interval= 1000000000ull/frameClockRate, due= frameDueNs+(expirations-1)*interval;
+            frameDueNs+= expirations*interval;
+            frameJitter.missedTicks(expirations-1);
+            if(renderFrame()) serial.frameQueued(frameJitter, due);
+        }
+
+        // one frame of the frame clock. if the tty hasn't caught up with the last frame yet this one is
+        // skipped instead of queueing up output. false if it was.
+        bool renderFrame()
+        {
+            router.flush(oscSocket.socketHandle());
+            cluster.flush(lamps, config->peers, oscSocket.socketHandle());
+            if(!subscriptions.empty())
+                subscriptions.send(lamps, monotonicNs(), oscSocket);
+            if(!serial.writeBufferEmpty())
+            {
+                if(skippedFrames++%100==0)
+                    flog(LOG_INFO, "serial output busy, %llu frames skipped so far.\n", (unsigned long long)skippedFrames);
+                outputs.frame(monotonicNs());
+                return false;
+            }
+            uint64_t now= monotonicNs();
+            bool merging= config->mergeMode!=MERGE_OFF;
+            serial.setLane(inputs.settled()? LANE_NORMAL: inputLane);
+            effects.render(now, merging? effectsLayer->lamps: lamps);
+            bool allChanged= false;
+            inputs.render(now, merging? inputsLayer->lamps: lamps, allLampsRgb, allChanged);
+            if(allChanged)
+                serial.writeColor(allLampsRgb[0], allLampsRgb[1], allLampsRgb[2]);
+            if(merging)
+            {
+                merge.stamp(*effectsLayer, LANE_NORMAL);
+                merge.stamp(*inputsLayer, inputLane);
+                merge.expire(now, config->mergeTimeoutMs*1000000ull);
+                merge.merge(lamps, config->mergeMode);
+                int lane= merge.takeChangedLane();
+                if(lane>=0) serial.setLane(lane);
+            }
+            flushLamps();
+            outputs.frame(now);
+            updateFrameClock();
+            return true;
+        }
+
+        // OSC over streams. every client has its own SLIP decoder and read buffer for as long as it's connected.
+        struct StreamClient
+        {
+            SlipDecoder decoder;
+            sockaddr_storage peer;
+            int port;           // local port, 0 for UNIX sockets
+        };
+
+        bool openStreamSockets(const Config &c, int &tcp, int &unixStream, int &unixDgram)
+        {
+            tcp= unixStream= unixDgram= -1;
+            if( (c.tcpPort && (tcp= openTcpListener(c.tcpPort))<0) ||
+                (!c.unixSocket.empty() && (unixStream= listenUnix(c.unixSocket.c_str(), SOCK_STREAM, 0666))<0) ||
+                (!c.unixDgram.empty() && (unixDgram= listenUnix(c.unixDgram.c_str(), SOCK_DGRAM, 0666))<0) )
+            {
+                if(tcp>=0) close(tcp);
+                if(unixStream>=0) close(unixStream);
+                tcp= unixStream= -1;
+                return false;
+            }
+            return true;
+        }
+
+        void acceptStreamClient(int listenFd)
+        {
+            sockaddr_storage peer;
+            socklen_t len= sizeof(peer);
+            memset(&peer, 0, sizeof(peer));
+            int fd= accept4(listenFd, (sockaddr*)&peer, &len, SOCK_NONBLOCK|SOCK_CLOEXEC);
+            if(fd<0)
+            {
+                if(errno!=EAGAIN) logerror("accept");
+                return;
+            }
+            if(streamClients.size()>=MAX_STREAM_CLIENTS)
+            {
+                flog(LOG_ERROR, "too many stream clients, connection refused.\n");
+                close(fd);
+                return;
+            }
+            StreamClient *client= new StreamClient;
+            client->peer= peer;
+            client->port= listenFd==tcpListenFd? config->tcpPort: 0;
+            streamClients[fd]= client;
+            flog(LOG_INFO, "stream client %d connected.\n", fd);
+        }
+
+        void handleStreamClient(int fd)
+        {
+            StreamClient *client= streamClients[fd];
+            ssize_t n= read(fd, client->decoder.readPtr(), client->decoder.readSpace());
+            if(n>0)
+                client->decoder.received(n, [&](const char *frame, size_t size) {
+                    handleOscPacket(frame, size, (const sockaddr*)&client->peer, client->port);
+                });
+            else if(n==0 || errno!=EAGAIN)
+            {
+                if(n<0) logerror("stream client");
+                flog(LOG_INFO, "stream client %d disconnected.\n", fd);
+                closePolledFd(fd);
+                delete client;
+                streamClients.erase(fd);
+            }
+        }
+
+        // close an fd the main loop watches. its io_uring poll is removed right away since the fd number
+        // may be reused (e.g. by accept) before the next round.
+        void closePolledFd(int fd)
+        {
+            if(fd<0) return;
+            if(uring.isOpen() && uringPolls.count(fd))
+            {
+                uring.prepPollRemove(uringTag(URING_POLL, fd), uringTag(URING_POLL_REMOVE));
+                uringPolls.erase(fd);
+            }
+            close(fd);
+        }
+
+        // open the Art-Net and sACN sockets the config asks for. sACN joins the groups of all patched universes.
+        bool openDmxSockets(const Config &c, int &artnet, int &sacn)
+        {
+            artnet= sacn= -1;
+            if(c.artnet && (artnet= openUdpSocket(ARTNET_PORT, true))<0) return false;
+            if(c.sacn)
+            {
+                if( (sacn= openUdpSocket(SACN_PORT, true))<0 )
+                {
+                    if(artnet>=0) close(artnet), artnet= -1;
+                    return false;
+                }
+                vector<int> universes;
+                for(size_t i= 0; i<c.dmxPatches.size(); i++)
+                    if(find(universes.begin(), universes.end(), c.dmxPatches[i].universe)==universes.end())
+                    {
+                        universes.push_back(c.dmxPatches[i].universe);
+                        string group= sacnGroup(c.dmxPatches[i].universe);
+                        if(!c.sacnInterface.empty()) group+= " " + c.sacnInterface;
+                        setMulticastMembership(sacn, group, true);
+                    }
+            }
+            return true;
+        }
+
+        // send changed lamps to the tty and the outputs and, if 'forward' is set, to the cluster peers owning them.
+        void flushLamps(bool forward= true)
+        {
+            if(forward && !config->peers.empty() && lamps.anyDirty())
+            {
+                cluster.collect(lamps, config->routing, config->peers);
+                updateFrameClock();
+            }
+            if(!subscriptions.empty() && lamps.anyDirty())
+            {
+                subscriptions.collect(lamps);
+                updateFrameClock();
+            }
+            if(!outputs.empty() && lamps.anyDirty())
+            {
+                outputs.send(lamps);
+                updateFrameClock();
+            }
+            serial.send(lamps);
+            lamps.clearDirty();
+        }
+
+        // set lamps from packed RGB triplets, as sent with /moodpd/lamps/rgb and raw '*' packets.
+        void setLampsPacked(int first, const uint8_t *rgb, size_t size)
+        {
+            if(size%3 || first<0 || first>=MAX_LAMPS)
+            {
+                flog(LOG_ERROR, "bad lamp frame (first lamp %d, %zu bytes)\n", first, size);
+                return;
+            }
+            int n= ingest->setPacked(first, rgb, size/3);
+            flog(LOG_INFO, "lamp frame: lamps %d..%d\n", first, first+n-1);
+        }
+
+        // set lamps from packed H, S, V byte triplets (/moodpd/lamps/hsv and raw 'H' packets).
+        void setLampsHsv(int first, const uint8_t *hsv, size_t size)
+        {
+            if(size%3 || first<0 || first>=MAX_LAMPS)
+            {
+                flog(LOG_ERROR, "bad HSV lamp frame (first lamp %d, %zu bytes)\n", first, size);
+                return;
+            }
+            int count= min((int)size/3, MAX_LAMPS-first);
+            uint16_t h[MAX_LAMPS];
+            uint8_t s[MAX_LAMPS], v[MAX_LAMPS], r[MAX_LAMPS], g[MAX_LAMPS], b[MAX_LAMPS];
+            unpackHsv(hsv, h, s, v, count);
+            hsvToRgb(h, s, v, r, g, b, count);
+            ingest->setPlanar(first, r, g, b, count);
+            flog(LOG_INFO, "HSV lamp frame: lamps %d..%d\n", first, first+count-1);
+        }
+
+        // set lamps from packed big endian 16 bit R, G, B triplets (/moodpd/lamps/rgb16).
+        void setLampsRgb16(int first, const uint8_t *rgb, size_t size)
+        {
+            if(size%6 || first<0 || first>=MAX_LAMPS)
+            {
+                flog(LOG_ERROR, "bad 16 bit lamp frame (first lamp %d, %zu bytes)\n", first, size);
+                return;
+            }
+            int count= min((int)size/6, MAX_LAMPS-first);
+            uint8_t r[MAX_LAMPS], g[MAX_LAMPS], b[MAX_LAMPS];
+            unpackRgb16(rgb, r, g, b, count);
+            ingest->setPlanar(first, r, g, b, count);
+            flog(LOG_INFO, "16 bit lamp frame: lamps %d..%d\n", first, first+count-1);
+        }
+
+        // lamp index of a /moodpd/lamps/NN/... address, NN in hex.
+        static int lampIndexFromAddress(const string &address)
+        {
+            int lampIndex= 0;
+            sscanf(address.c_str() + sizeof("/moodpd/lamps/")-1, "%02X", &lampIndex);
+            if(lampIndex<0||lampIndex>255) lampIndex= 0;
+            return lampIndex;
+        }
+
+        // fast path for the most common bulk message, see parseBulkRgb().
+        bool decodeBulkRgb(const char *data, size_t size)
+        {
+            int first;
+            size_t blobSize;
+            const uint8_t *rgb= parseBulkRgb(data, size, first, blobSize);
+            if(!rgb) return false;
+            setLampsPacked(first, rgb, blobSize);
+            return true;
+        }
+
+        // in merge mode lamp changes from a packet go to the sender's layer, which is merged into the lamp
+        // state on the next frame. otherwise they go to the lamp state directly.
+        void selectLayer(const sockaddr *from)
+        {
+            if(config->mergeMode==MERGE_OFF) return;
+            packetLayer= merge.layer(from, monotonicNs());
+            ingest= &packetLayer->lamps;
+        }
+
+        void layerDone(int lane)
+        {
+            if(ingest==&lamps) return;
+            merge.stamp(*packetLayer, lane);
+            ingest= &lamps;
+            updateFrameClock();
+        }
+
+        // the effects layer covers exactly the lamps effects are running on.
+        void syncEffectsLayer()
+        {
+            uint8_t covered[MAX_LAMPS];
+            effects.coverage(covered);
+            merge.restrict(*effectsLayer, covered);
+        }
+
+        // switch real-time mode (see realtime.h) to what the config says. 'old' is the config it was set
+        // up for, 0 at startup.
+        void applyRealtime(const Config *old)
+        {
+            if( (!old && config->cpu>=0) || (old && config->cpu!=old->cpu) )
+                if(pinToCpu(config->cpu) && config->cpu>=0) flog(LOG_INFO, "pinned to CPU %d.\n", config->cpu);
+            bool wasRealtime= old && old->realtimePriority;
+            if(config->realtimePriority && !wasRealtime)
+            {
+                // everything the main loop needs is allocated now, before memory gets locked.
+                oscBuffer.resize(65536);
+                dgramBuffer.resize(SLIP_MAX_FRAME);
+                blobBuffer.reserve(65536);
+                if(lockMemory()) flog(LOG_INFO, "memory locked.\n");
+            }
+            else if(!config->realtimePriority && wasRealtime)
+                unlockMemory();
+            if( (!old && config->realtimePriority) || (old && config->realtimePriority!=old->realtimePriority) )
+                if(setRealtimePriority(config->realtimePriority) && config->realtimePriority)
+                    flog(LOG_INFO, "running with SCHED_FIFO priority %d.\n", config->realtimePriority);
+        }
+
+        // priority class of a packet which has no OSC addresses.
+        int packetClass(int localPort, const sockaddr *from)
+        {
+            int lane= packetLane(config->priorities, localPort, from);
+            return lane<0? LANE_NORMAL: lane;
+        }
+
+        bool checkRateLimit()
+        {
+            if(rateLimiter.allow(config->maxPacketRate)) return true;
+            if(rateLimiter.droppedPackets()%1000==1)
+                flog(LOG_INFO, "packet rate limit exceeded, %llu packets dropped so far.\n",
+                     (unsigned long long)rateLimiter.droppedPackets());
+            return false;
+        }
+
+        // build a new config and swap it in. new sockets and ttys are opened before the old ones are
+        // closed and whatever is still queued on the old sockets is handled first, so nothing is lost.
+        // if anything fails the old config stays active.
+        void reloadConfig()
+        {
+            flog(LOG_INFO, "reloading configuration.\n");
+            Config *newConfig= new Config;
+            if(!newConfig->load(configFile, configOverrides))
+            {
+                flog(LOG_ERROR, "config reload failed, keeping old configuration.\n");
+                delete newConfig;
+                return;
+            }
+            // a different tty replaces the serial buffer, which a write in flight is still sending from.
+            // the reload is retried once the write has completed.
+            if(newConfig->tty!=config->tty && serialWriteInFlight)
+            {
+                flog(LOG_INFO, "serial write in flight, reloading when it's done.\n");
+                reloadPending= true;
+                delete newConfig;
+                return;
+            }
+
+            int newSock= -1;
+            oscpkt::UdpSocket newOscSocket;
+            bool ok= true;
+            bool multicast= !newConfig->multicastGroups.empty();
+            if(newConfig->rawPort!=config->rawPort)
+                ok= (newSock= openUdpSocket(newConfig->rawPort, multicast))>=0;
+            if(ok && newConfig->oscPort!=config->oscPort)
+                ok= (newOscSocket.handle= openUdpSocket(newConfig->oscPort, multicast))>=0;
+            int newArtnetSock= -1, newSacnSock= -1;
+            bool dmxChanged= newConfig->artnet!=config->artnet || newConfig->sacn!=config->sacn ||
+                             newConfig->sacnInterface!=config->sacnInterface || newConfig->dmxPatches!=config->dmxPatches;
+            if(ok && dmxChanged)
+                ok= openDmxSockets(*newConfig, newArtnetSock, newSacnSock);
+            int newTcpFd= -1, newUnixFd= -1, newUnixDgramFd= -1, oldSerialFd= serial.getFd();
+            bool streamChanged= newConfig->tcpPort!=config->tcpPort || newConfig->unixSocket!=config->unixSocket ||
+                                newConfig->unixDgram!=config->unixDgram;
+            if(ok && streamChanged)
+                ok= openStreamSockets(*newConfig, newTcpFd, newUnixFd, newUnixDgramFd);
+            if(ok && newConfig->tty!=config->tty)
+                ok= serial.reopen(newConfig->tty.c_str());
+            if(!ok)
+            {
+                flog(LOG_ERROR, "config reload failed, keeping old configuration.\n");
+                if(newSock>=0) close(newSock);
+                if(newArtnetSock>=0) close(newArtnetSock);
+                if(newSacnSock>=0) close(newSacnSock);
+                if(newTcpFd>=0) close(newTcpFd);
+                if(newUnixFd>=0) close(newUnixFd);
+                if(newUnixDgramFd>=0) close(newUnixDgramFd);
+                delete newConfig;
+                return;
+            }
+
+            // DMX is resent continuously, so the old DMX sockets are simply replaced.
+            if(dmxChanged)
+            {
+                closePolledFd(artnetSock);
+                closePolledFd(sacnSock);
+                artnetSock= newArtnetSock;
+                sacnSock= newSacnSock;
+            }
+
+            // connected stream clients stay, only the listeners are replaced.
+            if(streamChanged)
+            {
+                closePolledFd(tcpListenFd);
+                closePolledFd(unixListenFd);
+                subscriptions.dropFd(unixDgramFd);
+                closePolledFd(unixDgramFd);
+                tcpListenFd= newTcpFd;
+                unixListenFd= newUnixFd;
+                unixDgramFd= newUnixDgramFd;
+            }
+
+            if(newConfig->tty!=config->tty || newConfig->protocol!=config->protocol)
+            {
+                // a different lamp, initialize it and send it the current state. stop waiting for the old one.
+                if(newConfig->tty!=config->tty) closePolledFd(oldSerialFd);
+                closePolledFd(deviceWatch.release());
+                armTimer(serialTimerFd, 0);
+                serial.setProtocol(newConfig->protocol);
+                serial.writeInit();
+                lamps.markDirty(0, MAX_LAMPS);
+            }
+
+            // leave the groups which are gone, the new list is joined below. groups in both lists stay joined.
+            vector<string> goneGroups;
+            for(size_t i= 0; i<config->multicastGroups.size(); i++)
+                if(find(newConfig->multicastGroups.begin(), newConfig->multicastGroups.end(), config->multicastGroups[i])==newConfig->multicastGroups.end())
+                    goneGroups.push_back(config->multicastGroups[i]);
+            setMulticastGroups(goneGroups, false);
+
+            if(newSock>=0)
+            {
+                sockaddr_storage sa_from;
+                socklen_t sa_len= sizeof(sa_from);
+                char buf[MOODPD_MAXPACKETSIZE+1];
+                ssize_t sz;
+                while( (sz= recvfrom(sock, buf, sizeof(buf)-1, MSG_DONTWAIT, (sockaddr*)&sa_from, &sa_len))>0 )
+                    handleRawPacket(buf, sz, (const sockaddr*)&sa_from), sa_len= sizeof(sa_from);
+                if(uring.isOpen()) uring.prepCancel(uringTag(URING_RAW_RECV), uringTag(URING_CANCEL));
+                close(sock);
+                sock= newSock;
+                rawStats.socketChanged();
+            }
+            if(newOscSocket.socketHandle()>=0)
+            {
+                while(oscSocket.receiveNextPacket(0))
+                    handleOscPacket(oscSocket.packetData(), oscSocket.packetSize(), &oscSocket.packetOrigin().addr(), config->oscPort, oscSocket.socketHandle());
+                if(uring.isOpen()) uring.prepCancel(uringTag(URING_OSC_RECV), uringTag(URING_CANCEL));
+                adoptOscSocket(newOscSocket.handle);
+                newOscSocket.handle= -1;
+                oscStats.socketChanged();
+            }
+
+            if(newConfig->routing!=config->routing)
+                lamps.markDirty(0, MAX_LAMPS);
+
+            if(newConfig->upgradeSocket!=config->upgradeSocket)
+            {
+                if(upgradeListenFd>=0) closePolledFd(upgradeListenFd), unlink(config->upgradeSocket.c_str());
+                upgradeListenFd= newConfig->upgradeSocket.empty()? -1: listenUnix(newConfig->upgradeSocket.c_str());
+            }
+
+            // the layers are only kept up to date while merging.
+            if(newConfig->mergeMode!=config->mergeMode)
+            {
+                merge.clear();
+                if(newConfig->mergeMode!=MERGE_OFF) syncEffectsLayer();
+            }
+
+            // the noted peer lamps are indexed by the old peer list.
+            cluster.flush(lamps, config->peers, oscSocket.socketHandle());
+            Config *oldConfig= config;
+            config= newConfig;
+            applyRealtime(oldConfig);
+            delete oldConfig;
+            setMulticastGroups(config->multicastGroups, true);
+            logMask= config->logMask;
+            allowRawMode= config->allowRawMode;
+            inputs.setMappings(config->inputs);
+            router.flush(oscSocket.socketHandle());
+            router.setRules(config->forwards);
+            if(simulationFile.empty()) outputs.setSpecs(config->outputs, lamps);
+            serial.setRouting(config->routing);
+            serial.setMaxLaneWait(config->laneWaitMs*1000000ull);
+            setupIngestSockets();
+            updateFrameClock();
+            flushLamps();
+            flog(LOG_INFO, "configuration reloaded.\n");
+        }
+
+        void setMulticastGroups(const vector<string> &groups, bool join)
+        {
+            for(size_t i= 0; i<groups.size(); i++)
+            {
+                setMulticastMembership(sock, groups[i], join);
+                setMulticastMembership(oscSocket.socketHandle(), groups[i], join);
+            }
+        }
+
+        // replace the OSC socket's fd with an already bound one.
+        void adoptOscSocket(int fd)
+        {
+            subscriptions.dropFd(oscSocket.socketHandle());
+            oscSocket.close();
+            oscSocket.handle= fd;
+            setNonblocking(fd, true);       // subscribers' bundles go out with sendPacketTo(), which mustn't block a frame
+            socklen_t len= oscSocket.local_addr.maxLen();
+            getsockname(fd, &oscSocket.local_addr.addr(), &len);
+        }
+
+        // pick our sockets from the fds passed by systemd socket activation, by port.
+        void inheritListenFds()
+        {
+            vector<int> fds;
+            listenFds(fds);
+            for(size_t i= 0; i<fds.size(); i++)
+            {
+                int port= udpSocketPort(fds[i]);
+                if(port==config->rawPort && sock<0)
+                    sock= fds[i];
+                else if(port==config->oscPort && oscSocket.socketHandle()<0)
+                    adoptOscSocket(fds[i]);
+                else
+                {
+                    flog(LOG_ERROR, "ignoring inherited fd %d (port %d).\n", fds[i], port);
+                    close(fds[i]);
+                    continue;
+                }
+                flog(LOG_INFO, "using inherited socket for port %d.\n", port);
+            }
+        }
+
+        // live upgrade, new instance side: get sockets, tty and lamp state from a running instance.
+        // returns false if there is none or the handoff failed, we then start from scratch.
+        bool takeOver(const char *path)
+        {
+            int s= connectUnix(path);
+            if(s<0) return false;
+            flog(LOG_INFO, "taking over from running instance.\n");
+
+            HandoffState *state= new HandoffState;
+            int fds[HANDOFF_NFDS], nfds= HANDOFF_NFDS;
+            vector<char> pending;
+            bool ok= recvWithFds(s, state, sizeof(*state), fds, nfds) && nfds==HANDOFF_NFDS &&
+                     state->magic==HANDOFF_MAGIC && state->version==HANDOFF_VERSION;
+            if(ok)
+            {
+                pending.resize(state->serialPending);
+                ok= readAll(s, pending.data(), pending.size()) && writeAll(s, "k", 1);
+            }
+            close(s);
+            if(!ok)
+            {
+                flog(LOG_ERROR, "handoff from running instance failed.\n");
+                for(int i= 0; i<nfds; i++) close(fds[i]);
+                delete state;
+                return false;
+            }
+
+            sock= fds[HANDOFF_RAW_FD];
+            adoptOscSocket(fds[HANDOFF_OSC_FD]);
+            serial.setFd(fds[HANDOFF_SERIAL_FD]);
+            if(!pending.empty()) serial.write(pending.data(), pending.size());
+            lamps= state->lamps;
+            effects.restore(state->effects);
+
+            // the new config may differ from the one the old instance ran with.
+            if(udpSocketPort(sock)!=config->rawPort)
+                close(sock), sock= -1;
+            if(udpSocketPort(oscSocket.socketHandle())!=config->oscPort)
+                oscSocket.close();
+            state->tty[sizeof(state->tty)-1]= 0;
+            if(config->tty!=state->tty)
+            {
+                int oldFd= serial.getFd();
+                if(!serial.reopen(config->tty.c_str())) fail("openSerial");
+                close(oldFd);
+            }
+            if(config->tty!=state->tty || config->protocol!=state->protocol)
+            {
+                serial.writeInit();
+                lamps.markDirty(0, MAX_LAMPS);
+            }
+            delete state;
+            flog(LOG_INFO, "took over from running instance.\n");
+            return true;
+        }
+
+        // live upgrade, old instance side: stop receiving, pass everything to the new instance and exit.
+        void handOver()
+        {
+            int client= accept4(upgradeListenFd, 0, 0, SOCK_CLOEXEC);
+            if(client<0) { logerror("accept"); return; }
+            flog(LOG_INFO, "handing over to new instance.\n");
+            handingOver= true;
+
+            // packets already received into the ring are handled here, anything after that stays
+            // queued in the sockets for the new instance.
+            if(uring.isOpen())
+                drainUring();
+            router.flush(oscSocket.socketHandle());
+            cluster.flush(lamps, config->peers, oscSocket.socketHandle());
+
+            HandoffState *state= new HandoffState();   // value-initialized: zeroed, then the lamp state constructed
+            state->magic= HANDOFF_MAGIC;
+            state->version= HANDOFF_VERSION;
+            strncpy(state->tty, config->tty.c_str(), sizeof(state->tty)-1);
+            state->protocol= config->protocol;
+            state->lamps= lamps;
+            effects.save(state->effects);
+            const char *pending= 0;
+            state->serialPending= serial.writeBufferEmpty()? 0: serial.allPendingData(pending);
+            int fds[HANDOFF_NFDS];
+            fds[HANDOFF_RAW_FD]= sock;
+            fds[HANDOFF_OSC_FD]= oscSocket.socketHandle();
+            fds[HANDOFF_SERIAL_FD]= serial.getFd();
+
+            timeval tv= { 5, 0 };
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            char ack;
+            bool ok= sendWithFds(client, state, sizeof(*state), fds, HANDOFF_NFDS) &&
+                     writeAll(client, pending, state->serialPending) &&
+                     read(client, &ack, 1)==1;
+            delete state;
+            close(client);
+            if(!ok)
+            {
+                logerror("handoff");
+                flog(LOG_ERROR, "handoff failed, continuing.\n");
+                handingOver= false;
+                if(uring.isOpen())
+                {
+                    armUringRecv(true);
+                    armUringRecv(false);
+                }
+                return;
+            }
+            capture.close();
+            flog(LOG_INFO, "handed over to new instance, exiting.\n");
+            exit(0);
+        }
+
+        // simulation mode main loop (see sim.h). events are handled in time order: packets from the capture,
+        // frame clock ticks, and the serial line having room again. the capture's first packet arrives
+        // right at the start. ends when the capture is over and everything it caused has left the line.
+        void runSimulation()
+        {
+            CaptureReader reader;
+            if(!reader.open(simulationFile.c_str())) exit(1);
+            timespec wallStart, wallEnd;
+            clock_gettime(CLOCK_MONOTONIC, &wallStart);
+            uint64_t &now= virtualClock().now, start= now;
+            const CaptureRecord *r= reader.next();
+            uint64_t base= start - (r? r->time: 0), lastPacketNs= start;
+            uint64_t packets[CAPTURE_SACN+1]= { 0 }, bytes= 0, frames= 0;
+            char rawBuf[MOODPD_MAXPACKETSIZE+1];
+            bool serialPending;
+            PacketAllocations allocs;
+
+            serial.flush();
+            while(true)
+            {
+                serialPending= !serial.writeBufferEmpty();
+                if(!r && (!serialPending || now-lastPacketNs>SIM_DRAIN_LIMIT)) break;
+                uint64_t next= ~0ull;
+                if(r) next= base+r->time;
+                if(frameClockRate) next= min(next, frameDueNs);
+                if(serialPending) next= min(next, simLine.belowNs(SERIAL_QUEUE_LIMIT));
+                now= max(now, next);
+
+                if(r && base+r->time<=now)
+                {
+                    sockaddr_storage from;
+                    capturedSender(*r, from);
+                    uint64_t a0= heapStats.allocations;
+                    if(r->source==CAPTURE_RAW)
+                    {
+                        size_t size= min((size_t)r->size, sizeof(rawBuf)-1);
+                        memcpy(rawBuf, r+1, size);
+                        handleRawPacket(rawBuf, size, (sockaddr*)&from);
+                    }
+                    else if(r->source==CAPTURE_OSC)
+                        handleOscPacket(r+1, r->size, (sockaddr*)&from, config->oscPort);
+                    else if(r->source==CAPTURE_ARTNET || r->source==CAPTURE_SACN)
+                        handleDmxPacket((const uint8_t*)(r+1), r->size, (sockaddr*)&from, r->source==CAPTURE_SACN);
+                    allocs.add(heapStats.allocations-a0);
+                    if(r->source<=CAPTURE_SACN) packets[r->source]++;
+                    bytes+= r->size;
+                    lastPacketNs= now;
+                    r= reader.next();
+                }
+                else if(frameClockRate && frameDueNs<=now)
+                {
+                    frames++;
+                    frameTick(1);
+                }
+                serial.flush();
+            }
+            now= max(now, simLine.idleNs());
+
+            clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+            double wall= (wallEnd.tv_sec-wallStart.tv_sec) + (wallEnd.tv_nsec-wallStart.tv_nsec)/1e9, simulated= (now-start)/1e9;
+            printf("simulated %.3f s in %.3f s (%.0fx real time)\n", simulated, wall, wall>0? simulated/wall: 0);
+            printf("packets: %llu raw, %llu OSC, %llu Art-Net, %llu sACN, %llu bytes\n",
+                   (unsigned long long)packets[CAPTURE_RAW], (unsigned long long)packets[CAPTURE_OSC],
+                   (unsigned long long)packets[CAPTURE_ARTNET], (unsigned long long)packets[CAPTURE_SACN], (unsigned long long)bytes);
+            printf("frames: %llu rendered, %llu skipped because the line was busy\n",
+                   (unsigned long long)(frames-skippedFrames), (unsigned long long)skippedFrames);
+            allocs.print(stdout, "");
+            if(serialPending) printf("stopped %.3f s after the last packet, the line didn't become idle.\n", SIM_DRAIN_LIMIT/1e9);
+            simLine.print(stdout, now-start);
+            if(simWarmup>=0 && allocs.lastPacket>(uint64_t)simWarmup)
+            {
+                printf("packet %llu allocated, expected none after the first %d.\n", (unsigned long long)allocs.lastPacket, simWarmup);
+                exit(1);
+            }
+        }
+
+        // sender address of a captured datagram.
+        static void capturedSender(const CaptureRecord &r, sockaddr_storage &sa)
+        {
+            memset(&sa, 0, sizeof(sa));
+            if(r.family==AF_INET6)
+            {
+                sockaddr_in6 *sin6= (sockaddr_in6*)&sa;
+                sin6->sin6_family= AF_INET6;
+                sin6->sin6_port= htons(r.port);
+                memcpy(&sin6->sin6_addr, r.addr, 16);
+            }
+            else
+            {
+                sockaddr_in *sin= (sockaddr_in*)&sa;
+                sin->sin_family= AF_INET;
+                sin->sin_port= htons(r.port);
+                memcpy(&sin->sin_addr, r.addr, 4);
+            }
+        }
+
+        // io_uring backend. the two udp sockets get multishot receives into provided buffer rings,
+        // serial output goes out as poll->write links, everything else from getPollFds() is watched
+        // with multishot polls and dispatched through handlePollEvent() like in the poll() loop.
+        enum UringTag
+        {
+            URING_RAW_RECV= 1,
+            URING_OSC_RECV,
+            URING_POLL,             // fd in the low 32 bits
+            URING_SERIAL_POLLOUT,
+            URING_SERIAL_WRITE,
+            URING_POLL_REMOVE,
+            URING_CANCEL,
+        };
+        enum { URING_RAW_BGID= 0, URING_OSC_BGID= 1 };
+
+        static uint64_t uringTag(UringTag tag, int fd= 0)
+        { return ((uint64_t)tag<<32) | (uint32_t)fd; }
+
+        bool setupUring()
+        {
+            if(!uring.open(64)) return false;
+            // raw packets are small, give them an extra byte for the terminating 0 like the poll() path.
+            if(!uring.setupBufferRing(URING_RAW_BGID, 64,
+                                      sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in6) + RECV_CONTROL_SIZE + MOODPD_MAXPACKETSIZE, 1))
+                return false;
+            if(!uring.setupBufferRing(URING_OSC_BGID, 16,
+                                      sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_storage) + RECV_CONTROL_SIZE + 65536))
+                return false;
+
+            memset(&rawRecvMsg, 0, sizeof(rawRecvMsg));
+            rawRecvMsg.msg_namelen= sizeof(sockaddr_in6);
+            rawRecvMsg.msg_controllen= RECV_CONTROL_SIZE;
+            memset(&oscRecvMsg, 0, sizeof(oscRecvMsg));
+            oscRecvMsg.msg_namelen= sizeof(sockaddr_storage);
+            oscRecvMsg.msg_controllen= RECV_CONTROL_SIZE;
+            uringRecvsToArm= 0;
+            armUringRecv(true);
+            armUringRecv(false);
+
+            serial.setDeferredFlush(true);
+            return true;
+        }
+
+        // (re)arm the multishot receive of the raw or the OSC socket. when the submission queue is full
+        // it's retried on the next round of the loop, the socket would stop receiving otherwise.
+        void armUringRecv(bool raw)
+        {
+            unsigned bit= raw? 1: 2;
+            if(raw? uring.prepRecvMsgMultishot(sock, &rawRecvMsg, URING_RAW_BGID, uringTag(URING_RAW_RECV)):
+                    uring.prepRecvMsgMultishot(oscSocket.socketHandle(), &oscRecvMsg, URING_OSC_BGID, uringTag(URING_OSC_RECV)))
+                uringRecvsToArm&= ~bit;
+            else
+                uringRecvsToArm|= bit;
+        }
+
+        // returns only if io_uring can't do what we need (e.g. old kernel without multishot recvmsg).
+        void runUring()
+        {
+            vector<pollfd> pollfds;
+            while(true)
+            {
+                if(uringRecvsToArm&1) armUringRecv(true);
+                if(uringRecvsToArm&2) armUringRecv(false);
+                // keep the multishot polls in sync with what the poll() loop would wait on.
+                checkSerial();
+                getPollFds(pollfds);
+                for(int i= 0; i<pollfds.size(); i++)
+                {
+                    int fd= pollfds[i].fd;
+                    short events= pollfds[i].events & POLLIN;
+                    if(fd==sock || fd==oscSocket.socketHandle() || !events) continue;
+                    if(!uringPolls.count(fd))
+                        if(uring.prepPoll(fd, events, uringTag(URING_POLL, fd), true))
+                            uringPolls[fd]= events;
+                }
+                for(map<int, short>::iterator it= uringPolls.begin(); it!=uringPolls.end(); )
+                {
+                    bool stillWanted= false;
+                    for(int i= 0; i<pollfds.size(); i++)
+                        if(pollfds[i].fd==it->first && (pollfds[i].events&POLLIN)) stillWanted= true;
+                    if(!stillWanted) uring.prepPollRemove(uringTag(URING_POLL, it->first), uringTag(URING_POLL_REMOVE)),
+                                     uringPolls.erase(it++);
+                    else it++;
+                }
+
+                // the POLLOUT and the write are linked, they go in together or not at all: a POLLOUT linked
+                // to nothing would leave the write in flight forever. what didn't fit is retried right after
+                // submitting, without waiting.
+                bool retry= uringRecvsToArm!=0;
+                if(!serialWriteInFlight && !serial.writeBufferEmpty() && !serial.writeThrottled())
+                {
+                    if(uring.sqSpace()<2)
+                        retry= true;
+                    else
+                    {
+                        const char *data= 0;
+                        size_t size= serial.pendingData(data);
+                        uring.prepPoll(serial.getFd(), POLLOUT, uringTag(URING_SERIAL_POLLOUT), false, true);
+                        uring.prepWrite(serial.getFd(), data, size, uringTag(URING_SERIAL_WRITE));
+                        serialWriteInFlight= true;
                     }
-                    else if(pfd.fd==oscSocket.socketHandle())
+                }
+
+                int r= uring.submitAndWait(retry? 0: 1);
+                if(r<0 && r!=-EINTR)
+                    errno= -r, fail("io_uring_enter");
+
+                io_uring_cqe *cqe;
+                while( (cqe= uring.peekCqe()) )
+                {
+                    uint64_t userData= cqe->user_data;
+                    int res= cqe->res;
+                    unsigned flags= cqe->flags;
+                    uring.cqeSeen();
+                    if(!handleUringCompletion(userData, res, flags))
+                        return;
+                }
+            }
+        }
+
+        // cancel the receives and wait until they and any serial write in flight have completed.
+        // called with handingOver set, so the receives are not re-armed.
+        void drainUring()
+        {
+            uring.prepCancel(uringTag(URING_RAW_RECV), uringTag(URING_CANCEL));
+            uring.prepCancel(uringTag(URING_OSC_RECV), uringTag(URING_CANCEL));
+            uringRecvsStopped= __builtin_popcount(uringRecvsToArm);    // not armed, nothing to cancel
+            uringRecvsToArm= 0;
+            while(uringRecvsStopped<2 || serialWriteInFlight)
+            {
+                int r= uring.submitAndWait(1);
+                if(r<0 && r!=-EINTR)
+                    errno= -r, fail("io_uring_enter");
+                io_uring_cqe *cqe;
+                while( (cqe= uring.peekCqe()) )
+                {
+                    uint64_t userData= cqe->user_data;
+                    int res= cqe->res;
+                    unsigned flags= cqe->flags;
+                    uring.cqeSeen();
+                    handleUringCompletion(userData, res, flags);
+                }
+            }
+        }
+
+        bool handleUringCompletion(uint64_t userData, int res, unsigned flags)
+        {
+            int fd= (int)(uint32_t)userData;
+            switch(userData>>32)
+            {
+                case URING_RAW_RECV:
+                case URING_OSC_RECV:
+                {
+                    bool raw= (userData>>32)==URING_RAW_RECV;
+                    uint16_t bgid= raw? URING_RAW_BGID: URING_OSC_BGID;
+                    msghdr *msg= raw? &rawRecvMsg: &oscRecvMsg;
+                    if(res<0)
                     {
-                        if(!pfd.revents&POLLIN) continue;
-                        flog(LOG_INFO, "OSC packet\n");
-                        if(oscSocket.receiveNextPacket(0))
-                        {
-                            oscpkt::PacketReader pr;
-                            oscpkt::Message *msg;
-                            pr.init(oscSocket.packetData(), oscSocket.packetSize());
-                            while(pr.isOk() && (msg = pr.popMessage()) != 0)
-                            {
-                                int r, g, b;
-                                if(msg->match("/moodpd/lamps/*/rgb")
-                                    .popInt32(r)
-                                    .popInt32(g)
-                                    .popInt32(b)
-                                    .isOkNoMoreArgs())
-                                {
-                                    r= min(255, max(r, 0));
-                                    g= min(255, max(g, 0));
-                                    b= min(255, max(b, 0));
-                                    int lampIndex= 0;
-                                    sscanf(msg->addressPattern().c_str() + sizeof("/moodpd/lamps/")-1, 
-                                           "%02X", &lampIndex);
-                                    if(lampIndex<0||lampIndex>255) lampIndex= 0;
-                                    flog(LOG_INFO, "osc: lamp %d -> red %d, green %d, blue %d\n", lampIndex, r, g, b);
-                                    serial.writeCommandF("i%02x%02x%02x%02x\n", r, g, b, lampIndex);
-                                }
-                                else if(msg->match("/ori") // andOSC android app thingy
-                                    .popInt32(r)
-                                    .popInt32(g)
-                                    .popInt32(b)
-                                    .isOkNoMoreArgs())
-                                {
-                                    flog(LOG_INFO, "andOSC orientation: %d, %d, %d\n", r, g, b);
-                                    r= (r+180)%360*255/360;
-                                    g= (g+180)%360*255/360;
-                                    b= (b+180)%360*255/360;
-                                    serial.writeCommandF("i%02x%02x%02x\n", r, g, b);
-                                }
-                            }
-                        }
+                        if(res==-EINVAL || res==-EOPNOTSUPP)
+                            return false;   // no multishot recvmsg in this kernel
+                        if(res!=-ENOBUFS && res!=-ECANCELED)    // out of buffers is ok, they are recycled as we go
+                            errno= -res, logerror("io_uring recvmsg");
                     }
+                    else if(flags & IORING_CQE_F_BUFFER)
+                    {
+                        uint16_t bid= flags>>IORING_CQE_BUFFER_SHIFT;
+                        char *name, *control, *payload;
+                        io_uring_recvmsg_out *out= IoUring::recvMsgOut(uring.buffer(bgid, bid), msg, name, control, payload);
+                        SocketStats &stats= raw? rawStats: oscStats;
+                        RecvInfo info;
+                        parseRecvInfo(control, out->controllen, info);
+                        stats.received(info);
+                        uint64_t t0= monotonicNs(), a0= heapStats.allocations;
+                        if(out->flags & MSG_TRUNC)
+                            flog(LOG_ERROR, "%s packet truncated, dropped.\n", raw? "raw": "OSC");
+                        else if(raw)
+                            handleRawPacket(payload, out->payloadlen, (const sockaddr*)name);
+                        else
+                            handleOscPacket(payload, out->payloadlen, (const sockaddr*)name, config->oscPort, oscSocket.socketHandle());
+                        stats.processed(monotonicNs()-t0, heapStats.allocations-a0);
+                        uring.recycleBuffer(bgid, bid);
+                    }
+                    if(!(flags & IORING_CQE_F_MORE))
+                    {
+                        if(handingOver) uringRecvsStopped++;
+                        else armUringRecv(raw);
+                    }
+                    break;
                 }
+                case URING_POLL:
+                {
+                    if(res==-ECANCELED || !uringPolls.count(fd))
+                        break;  // removed with closePolledFd(), the fd may already be in use again
+                    if(res>=0)
+                        handlePollEvent( (pollfd){ fd, uringPolls[fd], (short)res } );
+                    else if(res==-EINVAL)
+                        return false;
+                    if(!(flags & IORING_CQE_F_MORE))
+                        uringPolls.erase(fd);   // re-armed on the next round
+                    break;
+                }
+                case URING_SERIAL_POLLOUT:
+                    if(res>=0 && (res & (POLLERR|POLLHUP|POLLNVAL)))
+                        handlePollEvent( (pollfd){ serial.getFd(), POLLOUT, (short)res } );
+                    break;
+                case URING_SERIAL_WRITE:
+                    serialWriteInFlight= false;
+                    if(res>0)
+                        serial.consume(res);
+                    else if(res<0 && res!=-EAGAIN && res!=-EINTR && res!=-ECANCELED)
+                        errno= -res, logerror("write"),
+                        serial.writeFailed(-res);
+                    if(reloadPending && !handingOver)
+                        reloadPending= false, reloadConfig();
+                    break;
             }
+            return true;
         }
 
         void parseMessage(char type, char *message, int msgsize)
@@ -468,6 +2204,20 @@ class moodpd
                     }
                     break;
                 }
+                case MOODPD_LAMPFRAME:
+                {
+                    // first lamp index byte, then packed RGB triplets
+                    if(msgsize<1) { flog(LOG_ERROR, "empty lamp frame\n"); break; }
+                    setLampsPacked((uint8_t)message[0], (const uint8_t*)message+1, msgsize-1);
+                    break;
+                }
+                case MOODPD_HSVFRAME:
+                {
+                    // like MOODPD_LAMPFRAME, with H, S, V triplets
+                    if(msgsize<1) { flog(LOG_ERROR, "empty lamp frame\n"); break; }
+                    setLampsHsv((uint8_t)message[0], (const uint8_t*)message+1, msgsize-1);
+                    break;
+                }
                 case MOODPD_COLOR:
                 {
                     chomp(message);
@@ -478,14 +2228,9 @@ class moodpd
                         flog(LOG_ERROR, "bad color string %s\n", message);
                         break;
                     }
-#ifdef MUCPROTOCOL
-                    serial.writeCommandF("C%c%c%c", r, g, b);
-#else
-                    serial.writeCommandF("i%02x%02x%02x\n", r, g, b);
-#endif
+                    serial.writeColor(r, g, b);
                     break;
                 }
-#ifdef MUCPROTOCOL
                 case MOODPD_SETBRIGHTNESS:
                 {
                     chomp(message);
@@ -497,7 +2242,8 @@ class moodpd
                     }
                     int b;
                     sscanf(message, "%02x", &b);
-                    serial.writeCommandF("%c%c", CMD_SET_BRIGHTNESS, b);
+                    const char c[]= { CMD_SET_BRIGHTNESS, (char)b };
+                    if(!serial.writeMucccCommand(c, sizeof(c))) flog(LOG_ERROR, "packet type '%c' needs protocol muccc.\n", type);
                     break;
                 }
                 case MOODPD_FADEMS:
@@ -511,20 +2257,22 @@ class moodpd
                     }
                     int r, g, b, time;
                     sscanf(message, "%02x%02x%02x%04x", &r, &g, &b, &time);
-                    serial.writeCommandF("%c%c%c%c%c%c", CMD_FADEMS, r,g,b, (time>>8)&0xff, time&0xff);
+                    const char c[]= { CMD_FADEMS, (char)r, (char)g, (char)b, (char)(time>>8), (char)time };
+                    if(!serial.writeMucccCommand(c, sizeof(c))) flog(LOG_ERROR, "packet type '%c' needs protocol muccc.\n", type);
                     break;
                 }
                 case MOODPD_PAUSE:
                 {
-                    serial.writeCommandF("%c", CMD_PAUSE);
+                    const char c[]= { CMD_PAUSE };
+                    if(!serial.writeMucccCommand(c, sizeof(c))) flog(LOG_ERROR, "packet type '%c' needs protocol muccc.\n", type);
                     break;
                 }
                 case MOODPD_POWER:
                 {
-                    serial.writeCommandF("%c", CMD_POWER);
+                    const char c[]= { CMD_POWER };
+                    if(!serial.writeMucccCommand(c, sizeof(c))) flog(LOG_ERROR, "packet type '%c' needs protocol muccc.\n", type);
                     break;
                 }
-#endif // MUCPROTOCOL
                 default:
                     flog(LOG_ERROR, "unknown packet type 0x%02X.\n", type);
                     break;
@@ -532,10 +2280,63 @@ class moodpd
         }
 
     private:
+        string configFile;
+        vector<string> configOverrides;
+        Config *config;
+        RateLimiter rateLimiter;
+        int signalFd;
+        int frameTimerFd;
+        int serialTimerFd;
+        int leaseTimerFd;
+        int defaultReceiveBuffer;       // of a new socket, as SO_RCVBUF reports it
+        EffectsEngine effects;
+        InputStage inputs;
+        Subscriptions subscriptions;
+        uint8_t allLampsRgb[3];         // last color sent to all lamps by 'all' input mappings
+        int frameClockRate;             // 0: stopped
+        uint64_t skippedFrames;
+        SocketStats rawStats, oscStats;
+        const string lampBulkRgbAddress;
+        int inputLane;                  // priority class of the last packet for the inputs
+        string simulationFile;
+        SimulatedLine simLine;
+        int simWarmup;                  // packets which may allocate (-A), -1: no check
+        uint64_t frameDueNs;            // when the frame clock ticks next, 0: stopped
+        FrameJitter frameJitter;
+        DeviceWatch deviceWatch;        // active while the serial device is gone
+        uint64_t serialLostNs;
+        MergeEngine merge;
+        LampState *ingest;              // where packets' lamp changes go: 'lamps' or a merge layer
+        LampLayer *packetLayer, *effectsLayer, *inputsLayer;
+        int upgradeListenFd;
+        bool handingOver;
         bool allowRawMode;
         int sock;
+        int artnetSock, sacnSock;
+        int tcpListenFd, unixListenFd, unixDgramFd;
+        map<int, StreamClient*> streamClients;
+        vector<char> dgramBuffer, oscBuffer;
         SerialIO serial;
         oscpkt::UdpSocket oscSocket;
+        bool useUring;
+        IoUring uring;
+        msghdr rawRecvMsg, oscRecvMsg;  // templates for the multishot receives
+        map<int, short> uringPolls;     // fds with an active multishot poll
+        bool serialWriteInFlight;
+        bool reloadPending;             // a reload waits for the serial write in flight
+        int uringRecvsStopped;
+        unsigned uringRecvsToArm;       // receives to re-arm, bit 0: raw, bit 1: OSC
+        CaptureWriter capture;
+        OscPattern lampRgbPattern, lampBulkRgbPattern, lampHsvPattern, lampRgbfPattern, lampRgb16Pattern;
+        OscPattern lampBulkHsvPattern, lampBulkRgb16Pattern, subscribePattern, unsubscribePattern, clusterRgbPattern, configReloadPattern, effectPattern;
+        ClusterForwarder cluster;
+        OscRouter router;
+        OutputSet outputs;
+        LampState lamps;
+        oscpkt::PacketReader oscReader;
+        bool oscReaderBusy;
+        bool oscReloadRequested;        // a reload message waits for the end of its packet
+        vector<char> blobBuffer;
 
 	void daemonize()
 	{
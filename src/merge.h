@@ -0,0 +1,268 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+// merging several controllers. without a merge mode every packet writes straight into the lamp state and
+// the last one wins, so two controllers driving the same lamps make them flicker between both. with one,
+// every source (sender address and port, and the effects and inputs inside moodpd) writes into a layer of
+// its own, and once per frame the layers are combined per lamp:
+//
+//      ltp         latest takes precedence: the source which changed the lamp last
+//      htp         highest takes precedence, per channel
+//      priority    the source in the most urgent priority class (see priority.h), the latest among equals
+//
+// every pass over the layers is a branch-free loop over all lamps which the compiler vectorizes. only the
+// merged result goes into the lamp state, so only its changes reach the bus. a source silent for longer
+// than the merge timeout is dropped; lamps no source covers anymore keep their color.
+
+enum MergeMode { MERGE_OFF, MERGE_LTP, MERGE_HTP, MERGE_PRIORITY };
+
+#define MAX_LAYERS      32          // including the internal ones
+#define STAMP_LIMIT     (1u<<30)    // the bits above are the priority class in MERGE_PRIORITY
+
+// merge mode by name, -1 if unknown.
+inline int mergeMode(const string &name)
+{
+    static const char *names[]= { "off", "ltp", "htp", "priority" };
+    for(int i= 0; i<4; i++) if(name==names[i]) return i;
+    return -1;
+}
+
+struct LampLayer
+{
+    LampState lamps;                // colors as set by the source. dirty bits: changes not stamped yet
+    uint32_t stamp[MAX_LAMPS];      // sequence number of the last change of each lamp, 0: not set
+    sockaddr_storage addr;
+    socklen_t addrLen;
+    int lane;                       // priority class of the last change
+    bool used, internal;            // internal layers (effects, inputs) never time out
+    uint64_t lastSeenNs;
+};
+
+
+class MergeEngine
+{
+    public:
+        MergeEngine(): sequence(0), changed(false), changedLane(-1)
+        { for(int i= 0; i<MAX_LAYERS; i++) layers[i].used= false; }
+
+        // a layer for moodpd's own use.
+        LampLayer *addInternal()
+        {
+            LampLayer *l= freeLayer();
+            if(l) l->internal= true;
+            return l;
+        }
+
+        // the layer of a sender, created if needed. when all are in use the one silent for longest is replaced.
+        LampLayer *layer(const sockaddr *from, uint64_t nowNs)
+        {
+            socklen_t len= sockaddrLength(from);
+            LampLayer *oldest= 0;
+            for(int i= 0; i<MAX_LAYERS; i++)
+            {
+                LampLayer &l= layers[i];
+                if(!l.used || l.internal) continue;
+                if(l.addrLen==len && !memcmp(&l.addr, from, len))
+                {
+                    l.lastSeenNs= nowNs;
+                    return &l;
+                }
+                if(!oldest || l.lastSeenNs<oldest->lastSeenNs) oldest= &l;
+            }
+            LampLayer *l= freeLayer();
+            if(!l)
+            {
+                flog(LOG_ERROR, "too many sources, dropping %s.\n", addressString((sockaddr*)&oldest->addr).c_str());
+                l= oldest;
+                release(*l);
+            }
+            memcpy(&l->addr, from, len);
+            l->addrLen= len;
+            l->internal= false;
+            l->lastSeenNs= nowNs;
+            flog(LOG_INFO, "new source %s.\n", addressString(from).c_str());
+            return l;
+        }
+
+        // take the changes made to a layer's lamps (its dirty bits) into the next merge.
+        void stamp(LampLayer &l, int lane)
+        {
+            if(!l.lamps.anyDirty()) return;
+            uint32_t s= nextStamp();
+            l.lamps.forEachDirty([&](int i) { l.stamp[i]= s; });
+            l.lamps.clearDirty();
+            l.lane= lane;
+            changedLane= changedLane<0? lane: min(changedLane, lane);
+            changed= true;
+        }
+
+        // limit a layer to the lamps with covered[i] set. newly covered lamps count as changed now.
+        void restrict(LampLayer &l, const uint8_t *covered)
+        {
+            uint32_t s= nextStamp();
+            for(int i= 0; i<MAX_LAMPS; i++)
+                if(!covered[i] != !l.stamp[i])
+                    l.stamp[i]= covered[i]? s: 0, changed= true;
+        }
+
+        // drop senders not heard from for 'timeoutNs' (0: never).
+        void expire(uint64_t nowNs, uint64_t timeoutNs)
+        {
+            if(!timeoutNs) return;
+            for(int i= 0; i<MAX_LAYERS; i++)
+                if(layers[i].used && !layers[i].internal && nowNs-layers[i].lastSeenNs>timeoutNs)
+                {
+                    flog(LOG_INFO, "source %s timed out.\n", addressString((sockaddr*)&layers[i].addr).c_str());
+                    release(layers[i]);
+                }
+        }
+
+        // drop all senders and forget what the internal layers set.
+        void clear()
+        {
+            for(int i= 0; i<MAX_LAYERS; i++)
+                if(layers[i].internal) memset(layers[i].stamp, 0, sizeof(layers[i].stamp)), layers[i].lamps.clearDirty();
+                else if(layers[i].used) release(layers[i]);
+        }
+
+        // combine the layers into 'out' if anything changed since the last time. returns the number of
+        // lamps whose color changed, which are marked dirty in 'out'.
+        int merge(LampState &out, int mode)
+        {
+            if(!changed) return 0;
+            changed= false;
+            memcpy(r, out.red, MAX_LAMPS);
+            memcpy(g, out.green, MAX_LAMPS);
+            memcpy(b, out.blue, MAX_LAMPS);
+            if(mode==MERGE_HTP)
+                mergeHtp();
+            else
+                mergeLatest(mode==MERGE_PRIORITY);
+            return out.updatePlanar(0, r, g, b, MAX_LAMPS);
+        }
+
+        // most urgent priority class of the changes merged since the last call, -1 if none.
+        int takeChangedLane()
+        {
+            int l= changedLane;
+            changedLane= -1;
+            return l;
+        }
+
+        // senders to time out or changes to merge, the frame clock has to run.
+        bool active() const
+        {
+            return changed || sources();
+        }
+
+        int sources() const
+        {
+            int n= 0;
+            for(int i= 0; i<MAX_LAYERS; i++) if(layers[i].used && !layers[i].internal) n++;
+            return n;
+        }
+
+    private:
+        LampLayer layers[MAX_LAYERS];
+        uint32_t sequence;
+        bool changed;
+        int changedLane;
+        uint8_t r[MAX_LAMPS], g[MAX_LAMPS], b[MAX_LAMPS];
+
+        LampLayer *freeLayer()
+        {
+            for(int i= 0; i<MAX_LAYERS; i++)
+                if(!layers[i].used)
+                {
+                    LampLayer &l= layers[i];
+                    l.lamps= LampState();
+                    memset(l.stamp, 0, sizeof(l.stamp));
+                    l.addrLen= 0;
+                    l.lane= WRITE_LANES/2;
+                    l.used= true;
+                    l.internal= false;
+                    l.lastSeenNs= 0;
+                    return &l;
+                }
+            return 0;
+        }
+
+        void release(LampLayer &l)
+        {
+            l.used= false;
+            changed= true;
+        }
+
+        // sequence numbers only need to keep their order. before they run into the priority bits they
+        // are moved down, the oldest ones end up all equal.
+        uint32_t nextStamp()
+        {
+            if(++sequence>=STAMP_LIMIT)
+            {
+                const uint32_t shift= STAMP_LIMIT/2;
+                for(int i= 0; i<MAX_LAYERS; i++)
+                    for(int k= 0; k<MAX_LAMPS; k++)
+                    {
+                        uint32_t &s= layers[i].stamp[k];
+                        s= !s? 0: s>shift? s-shift: 1;
+                    }
+                sequence-= shift;
+            }
+            return sequence;
+        }
+
+        // per channel maximum of all layers covering a lamp.
+        void mergeHtp()
+        {
+            uint8_t hr[MAX_LAMPS], hg[MAX_LAMPS], hb[MAX_LAMPS], covered[MAX_LAMPS];
+            memset(hr, 0, sizeof(hr));
+            memset(hg, 0, sizeof(hg));
+            memset(hb, 0, sizeof(hb));
+            memset(covered, 0, sizeof(covered));
+            for(int n= 0; n<MAX_LAYERS; n++)
+            {
+                if(!layers[n].used) continue;
+                const LampLayer &l= layers[n];
+                for(int i= 0; i<MAX_LAMPS; i++)
+                {
+                    uint8_t m= l.stamp[i]? 0xff: 0;
+                    uint8_t lr= l.lamps.red[i]&m, lg= l.lamps.green[i]&m, lb= l.lamps.blue[i]&m;
+                    hr[i]= hr[i]>lr? hr[i]: lr;
+                    hg[i]= hg[i]>lg? hg[i]: lg;
+                    hb[i]= hb[i]>lb? hb[i]: lb;
+                    covered[i]|= m;
+                }
+            }
+            for(int i= 0; i<MAX_LAMPS; i++)
+            {
+                r[i]= (hr[i]&covered[i]) | (r[i]&~covered[i]);
+                g[i]= (hg[i]&covered[i]) | (g[i]&~covered[i]);
+                b[i]= (hb[i]&covered[i]) | (b[i]&~covered[i]);
+            }
+        }
+
+        // per lamp the layer with the highest key: its stamp, with the priority class above it if wanted.
+        void mergeLatest(bool byPriority)
+        {
+            uint32_t best[MAX_LAMPS];
+            memset(best, 0, sizeof(best));
+            for(int n= 0; n<MAX_LAYERS; n++)
+            {
+                if(!layers[n].used) continue;
+                const LampLayer &l= layers[n];
+                uint32_t weight= byPriority? (uint32_t)(WRITE_LANES-l.lane)<<30: 0;
+                for(int i= 0; i<MAX_LAMPS; i++)
+                {
+                    uint32_t key= l.stamp[i]? weight|l.stamp[i]: 0;
+                    bool take= key>best[i];
+                    best[i]= take? key: best[i];
+                    r[i]= take? l.lamps.red[i]: r[i];
+                    g[i]= take? l.lamps.green[i]: g[i];
+                    b[i]= take? l.lamps.blue[i]: b[i];
+                }
+            }
+        }
+};
+
+
+#endif //MERGE_H
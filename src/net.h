@@ -0,0 +1,386 @@
+#ifndef NET_H
+#define NET_H
+
+// socket helpers: dual-stack listening sockets, multicast group membership, UNIX sockets.
+
+#include <netdb.h>
+#include <net/if.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+
+// bind a udp socket to 'port' on all addresses. an IPv6 socket with IPV6_V6ONLY off receives IPv4 as
+// well (as mapped addresses), if IPv6 is unavailable it's a plain IPv4 socket. reuseAddr lets several
+// daemons on one host listen to the same multicast groups.
+inline int openUdpSocket(int port, bool reuseAddr= false)
+{
+    int fd= socket(AF_INET6, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+    if(fd>=0)
+    {
+        int off= 0, on= 1;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        if(reuseAddr) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        sockaddr_in6 sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin6_family= AF_INET6;
+        sa.sin6_addr= in6addr_any;
+        sa.sin6_port= htons(port);
+        if(bind(fd, (sockaddr*)&sa, sizeof(sa))==0) return fd;
+        logerror("bind");
+        close(fd);
+        return -1;
+    }
+    if(errno!=EAFNOSUPPORT) { logerror("socket"); return -1; }
+
+    fd= socket(AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+    if(fd<0) { logerror("socket"); return -1; }
+    int on= 1;
+    if(reuseAddr) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family= AF_INET;
+    sa.sin_addr.s_addr= htonl(INADDR_ANY);
+    sa.sin_port= htons(port);
+    if(bind(fd, (sockaddr*)&sa, sizeof(sa))<0)
+    {
+        logerror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// listening TCP socket on 'port', dual-stack like openUdpSocket(). SO_REUSEPORT lets a new instance
+// listen before the old one is gone (live upgrade).
+inline int openTcpListener(int port)
+{
+    int fd= socket(AF_INET6, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+    bool v6= fd>=0;
+    if(!v6 && errno==EAFNOSUPPORT) fd= socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+    if(fd<0) { logerror("socket"); return -1; }
+    int off= 0, on= 1;
+    if(v6) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    sockaddr_storage sa;
+    memset(&sa, 0, sizeof(sa));
+    socklen_t len;
+    if(v6)
+    {
+        sockaddr_in6 *sa6= (sockaddr_in6*)&sa;
+        sa6->sin6_family= AF_INET6;
+        sa6->sin6_addr= in6addr_any;
+        sa6->sin6_port= htons(port);
+        len= sizeof(*sa6);
+    }
+    else
+    {
+        sockaddr_in *sa4= (sockaddr_in*)&sa;
+        sa4->sin_family= AF_INET;
+        sa4->sin_addr.s_addr= htonl(INADDR_ANY);
+        sa4->sin_port= htons(port);
+        len= sizeof(*sa4);
+    }
+    if(bind(fd, (sockaddr*)&sa, len)<0 || listen(fd, 16)<0)
+    {
+        logerror("tcp listener");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline bool unixAddress(const char *path, sockaddr_un &sa)
+{
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family= AF_UNIX;
+    if(strlen(path)>=sizeof(sa.sun_path))
+    {
+        flog(LOG_ERROR, "socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(sa.sun_path, path);
+    return true;
+}
+
+// bind a UNIX socket to 'path' (and listen, for stream sockets). a stale socket file from a previous
+// instance is replaced.
+inline int listenUnix(const char *path, int type= SOCK_STREAM, mode_t mode= 0600)
+{
+    sockaddr_un sa;
+    if(!unixAddress(path, sa)) return -1;
+    int fd= socket(AF_UNIX, type|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+    if(fd<0) { logerror("socket"); return -1; }
+    unlink(path);
+    if(bind(fd, (sockaddr*)&sa, sizeof(sa))<0 || chmod(path, mode)<0 || (type==SOCK_STREAM && listen(fd, 16)<0))
+    {
+        logerror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// local port of a bound UDP socket, -1 if fd is something else.
+inline int udpSocketPort(int fd)
+{
+    int type;
+    socklen_t len= sizeof(type);
+    if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len)<0 || type!=SOCK_DGRAM) return -1;
+    sockaddr_storage sa;
+    len= sizeof(sa);
+    if(getsockname(fd, (sockaddr*)&sa, &len)<0) return -1;
+    if(sa.ss_family==AF_INET) return ntohs(((sockaddr_in*)&sa)->sin_port);
+    if(sa.ss_family==AF_INET6) return ntohs(((sockaddr_in6*)&sa)->sin6_port);
+    return -1;
+}
+
+// what the kernel tells about a received datagram: its receive timestamp (CLOCK_REALTIME, 0 if not
+// reported) and the socket's cumulative count of datagrams dropped for lack of buffer space, as it was
+// when this datagram was queued (-1 if not reported, the kernel leaves it out while it's 0).
+struct RecvInfo
+{
+    uint64_t kernelNs;
+    int64_t drops;
+};
+
+// control buffer size for the messages enableRecvInfo() turns on.
+#define RECV_CONTROL_SIZE (CMSG_SPACE(sizeof(timespec)) + CMSG_SPACE(sizeof(uint32_t)))
+
+inline void enableRecvInfo(int fd)
+{
+    int on= 1;
+    if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on))<0) logerror("SO_TIMESTAMPNS");
+    if(setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on))<0) logerror("SO_RXQ_OVFL");
+}
+
+inline void parseRecvInfo(void *control, size_t controlLen, RecvInfo &info)
+{
+    info.kernelNs= 0;
+    info.drops= -1;
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control= control;
+    msg.msg_controllen= controlLen;
+    for(cmsghdr *c= CMSG_FIRSTHDR(&msg); c; c= CMSG_NXTHDR(&msg, c))
+    {
+        if(c->cmsg_level!=SOL_SOCKET) continue;
+        if(c->cmsg_type==SCM_TIMESTAMPNS)
+        {
+            timespec ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            info.kernelNs= (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+        }
+        else if(c->cmsg_type==SO_RXQ_OVFL)
+        {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+            info.drops= drops;
+        }
+    }
+}
+
+// recvfrom() plus RecvInfo. nonblocking.
+inline ssize_t recvDatagram(int fd, void *buf, size_t size, sockaddr_storage &from, RecvInfo &info)
+{
+    char control[RECV_CONTROL_SIZE];
+    iovec iov= { buf, size };
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name= &from;
+    msg.msg_namelen= sizeof(from);
+    msg.msg_iov= &iov;
+    msg.msg_iovlen= 1;
+    msg.msg_control= control;
+    msg.msg_controllen= sizeof(control);
+    ssize_t n= recvmsg(fd, &msg, MSG_DONTWAIT);
+    if(n>=0) parseRecvInfo(control, msg.msg_controllen, info);
+    return n;
+}
+
+// set a socket's receive buffer size, beyond net.core.rmem_max if we are allowed to. returns the size
+// the kernel actually uses (which is twice the requested size, for bookkeeping overhead), -1 on error.
+inline int setReceiveBuffer(int fd, int bytes)
+{
+    if(bytes>0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes))<0 &&
+       setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes))<0)
+        return -1;
+    int actual;
+    socklen_t len= sizeof(actual);
+    if(getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &actual, &len)<0) return -1;
+    return actual;
+}
+
+// length of an IPv4, IPv6 or (named) UNIX socket address, 0 for anything else.
+inline socklen_t sockaddrLength(const sockaddr *sa)
+{
+    if(sa->sa_family==AF_INET) return sizeof(sockaddr_in);
+    if(sa->sa_family==AF_INET6) return sizeof(sockaddr_in6);
+    const sockaddr_un *un= (const sockaddr_un*)sa;
+    if(sa->sa_family==AF_UNIX && un->sun_path[0])
+        return offsetof(sockaddr_un, sun_path) + strnlen(un->sun_path, sizeof(un->sun_path)-1) + 1;
+    return 0;
+}
+
+// numeric address of a sender, IPv4-mapped addresses are shown as plain IPv4.
+inline string addressString(const sockaddr *sa)
+{
+    char host[NI_MAXHOST];
+    socklen_t len= (sa->sa_family==AF_INET6? sizeof(sockaddr_in6): sizeof(sockaddr_in));
+    if(getnameinfo(sa, len, host, sizeof(host), 0, 0, NI_NUMERICHOST)) return "?";
+    return strncmp(host, "::ffff:", 7)? host: host+7;
+}
+
+// resolve "HOST[:PORT]" to a UDP address. IPv6 addresses with a port are written as [ADDR]:PORT.
+inline bool resolveHostPort(const string &hostPort, int defaultPort, sockaddr_storage &addr, socklen_t &len)
+{
+    char portBuf[16];
+    snprintf(portBuf, sizeof(portBuf), "%d", defaultPort);
+    string h= hostPort, port= portBuf;
+    size_t colon= h.rfind(':');
+    if(!h.empty() && h[0]=='[')
+    {
+        size_t close= h.find(']');
+        if(close==string::npos) return false;
+        if(close+1<h.size())
+        {
+            if(h[close+1]!=':') return false;
+            port= h.substr(close+2);
+        }
+        h= h.substr(1, close-1);
+    }
+    else if(colon!=string::npos && h.find(':')==colon)
+        port= h.substr(colon+1), h= h.substr(0, colon);
+
+    addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype= SOCK_DGRAM;
+    if(getaddrinfo(h.c_str(), port.c_str(), &hints, &res)) return false;
+    memcpy(&addr, res->ai_addr, res->ai_addrlen);
+    len= res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+// parse a network "ADDRESS[/PREFIXLEN]" into an IPv6 or v4-mapped address and a prefix length in bits.
+inline bool parseNetwork(const string &spec, uint8_t *net, int &prefixLen)
+{
+    string a= spec;
+    size_t slash= a.find('/');
+    int len= -1;
+    if(slash!=string::npos)
+    {
+        char *end;
+        len= strtol(a.c_str()+slash+1, &end, 10);
+        if(*end || slash+1==a.size() || len<0) return false;
+        a.erase(slash);
+    }
+    memset(net, 0, 16);
+    in_addr a4;
+    if(inet_pton(AF_INET, a.c_str(), &a4)==1)
+    {
+        if(len>32) return false;
+        net[10]= net[11]= 0xff;
+        memcpy(net+12, &a4, 4);
+        prefixLen= 96 + (len<0? 32: len);
+    }
+    else if(inet_pton(AF_INET6, a.c_str(), net)==1)
+    {
+        if(len>128) return false;
+        prefixLen= len<0? 128: len;
+    }
+    else return false;
+    return true;
+}
+
+// the IPv6 or v4-mapped address of an IP socket address. false for anything else.
+inline bool ipv6Address(const sockaddr *sa, uint8_t *addr)
+{
+    if(sa && sa->sa_family==AF_INET6)
+        memcpy(addr, &((const sockaddr_in6*)sa)->sin6_addr, 16);
+    else if(sa && sa->sa_family==AF_INET)
+    {
+        memset(addr, 0, 10);
+        addr[10]= addr[11]= 0xff;
+        memcpy(addr+12, &((const sockaddr_in*)sa)->sin_addr, 4);
+    }
+    else return false;
+    return true;
+}
+
+inline bool prefixMatches(const uint8_t *a, const uint8_t *b, int bits)
+{
+    int bytes= bits/8, rest= bits%8;
+    if(memcmp(a, b, bytes)) return false;
+    return !rest || !((a[bytes]^b[bytes]) & (0xff00>>rest));
+}
+
+// the address to sendto() 'addr' from socket 'fd': IPv4 addresses are sent to as mapped addresses
+// from a dual-stack socket.
+inline socklen_t sendAddress(int fd, const sockaddr_storage &addr, socklen_t len, sockaddr_storage &to)
+{
+    sockaddr_storage local;
+    socklen_t localLen= sizeof(local);
+    if(addr.ss_family==AF_INET && getsockname(fd, (sockaddr*)&local, &localLen)==0 && local.ss_family==AF_INET6)
+    {
+        const sockaddr_in *v4= (const sockaddr_in*)&addr;
+        sockaddr_in6 *v6= (sockaddr_in6*)&to;
+        memset(v6, 0, sizeof(*v6));
+        v6->sin6_family= AF_INET6;
+        v6->sin6_port= v4->sin_port;
+        v6->sin6_addr.s6_addr[10]= v6->sin6_addr.s6_addr[11]= 0xff;
+        memcpy(&v6->sin6_addr.s6_addr[12], &v4->sin_addr, 4);
+        return sizeof(*v6);
+    }
+    memcpy(&to, &addr, len);
+    return len;
+}
+
+// parse a multicast group spec, "GROUP" or "GROUP INTERFACE". without an interface the kernel picks
+// one from the routing table.
+inline bool parseMulticastGroup(const string &spec, group_req &gr)
+{
+    memset(&gr, 0, sizeof(gr));
+    string group= spec, iface;
+    size_t space= spec.find_first_of(" \t");
+    if(space!=string::npos)
+    {
+        group= spec.substr(0, space);
+        iface= spec.substr(spec.find_first_not_of(" \t", space));
+        if( !(gr.gr_interface= if_nametoindex(iface.c_str())) ) return false;
+    }
+
+    addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags= AI_NUMERICHOST;
+    hints.ai_socktype= SOCK_DGRAM;
+    if(getaddrinfo(group.c_str(), 0, &hints, &res)) return false;
+    memcpy(&gr.gr_group, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if(gr.gr_group.ss_family==AF_INET)
+        return IN_MULTICAST(ntohl(((sockaddr_in*)&gr.gr_group)->sin_addr.s_addr));
+    return IN6_IS_ADDR_MULTICAST(&((sockaddr_in6*)&gr.gr_group)->sin6_addr);
+}
+
+// join or leave a multicast group. IPv4 groups can be joined on dual-stack IPv6 sockets too.
+inline bool setMulticastMembership(int fd, const string &spec, bool join)
+{
+    group_req gr;
+    if(!parseMulticastGroup(spec, gr))
+    {
+        flog(LOG_ERROR, "bad multicast group '%s'\n", spec.c_str());
+        return false;
+    }
+    int level= (gr.gr_group.ss_family==AF_INET? IPPROTO_IP: IPPROTO_IPV6);
+    if(setsockopt(fd, level, join? MCAST_JOIN_GROUP: MCAST_LEAVE_GROUP, &gr, sizeof(gr))<0 &&
+       !(join && errno==EADDRINUSE))    // already a member, e.g. after a live upgrade
+    {
+        flog(LOG_ERROR, "%s multicast group %s: %s\n", join? "join": "leave", spec.c_str(), strerror(errno));
+        return false;
+    }
+    flog(LOG_INFO, "%s multicast group %s on port %d.\n", join? "joined": "left", spec.c_str(), udpSocketPort(fd));
+    return true;
+}
+
+
+#endif //NET_H
@@ -0,0 +1,218 @@
+#ifndef OSCPATTERN_H
+#define OSCPATTERN_H
+
+// precompiled OSC address patterns. oscpkt::fullPatternMatch() re-parses the pattern on every call;
+// OscPattern parses it once into a list of match ops (literal runs, '?', character classes as
+// bitsets, alternative tables, '*' and '//') which are then run against any number of addresses.
+// matching follows oscpkt's interpreter exactly, including its quirks (e.g. '?' also matches '/',
+// the first matching {alternative} is taken without backtracking).
+
+#include <string>
+#include <vector>
+
+
+class OscPattern
+{
+    public:
+        OscPattern(): ok(false) {}
+        OscPattern(const char *pattern) { compile(pattern); }
+
+        // compile a pattern. returns false on syntax errors, the pattern then never matches.
+        bool compile(const char *pattern)
+        {
+            ops.clear(); literals.clear(); classes.clear(); alternatives.clear();
+            ok= true;
+            const char *p= pattern;
+            while(*p && ok)
+            {
+                if(*p=='?')
+                    addOp(OP_ANY, 0, 0), p++;
+                else if(*p=='[')
+                    p= compileClass(p+1);
+                else if(*p=='*')
+                {
+                    while(*p=='*') p++;
+                    addOp(OP_STAR, 0, 0);
+                }
+                else if(*p=='/' && p[1]=='/')
+                {
+                    while(p[1]=='/') p++;
+                    addOp(OP_SEGMENTS, 0, 0);   // the last '/' stays a literal
+                }
+                else if(*p=='{')
+                    p= compileAlternatives(p);
+                else
+                {
+                    // collect a literal run, appending to the previous one if possible
+                    const char *q= p;
+                    while(*q && !strchr("?[*{", *q) && !(q[0]=='/' && q[1]=='/' && q!=p)) q++;
+                    if(q==p) q++;
+                    if(!ops.empty() && ops.back().type==OP_LITERAL && ops.back().arg+ops.back().len==literals.size())
+                        ops.back().len+= q-p;
+                    else
+                        addOp(OP_LITERAL, literals.size(), q-p);
+                    literals.append(p, q-p);
+                    p= q;
+                }
+            }
+            return ok;
+        }
+
+        bool isOk() const { return ok; }
+
+        bool match(const char *path, size_t len) const
+        {
+            if(!ok) return false;
+            if(ops.size()==1 && ops[0].type==OP_LITERAL)   // plain address, no wildcards
+                return len==ops[0].len && !memcmp(path, literals.data(), len);
+            return matchOps(0, path, path+len);
+        }
+        bool match(const char *path) const
+        { return match(path, strlen(path)); }
+        bool match(const std::string &path) const
+        { return match(path.data(), path.size()); }
+
+    private:
+        enum OpType
+        {
+            OP_LITERAL,     // memcmp with literals[arg..arg+len]
+            OP_ANY,         // '?', any single character
+            OP_CLASS,       // '[...]', classes[arg] is a 256 bit set
+            OP_ALTERNATIVES,// '{a,b}', alternatives[arg..arg+len]
+            OP_STAR,        // '*', any number of characters up to the next '/'
+            OP_SEGMENTS,    // '//', any number of path segments
+        };
+        struct Op
+        {
+            OpType type;
+            size_t arg, len;
+        };
+        struct CharClass
+        { uint32_t bits[8]; };
+        struct Alternative
+        { size_t offset, len; };
+
+        bool ok;
+        std::vector<Op> ops;
+        std::string literals;           // storage for literal runs and alternatives
+        std::vector<CharClass> classes;
+        std::vector<Alternative> alternatives;
+
+        void addOp(OpType type, size_t arg, size_t len)
+        {
+            Op op= { type, arg, len };
+            ops.push_back(op);
+        }
+
+        // p points after the '['.
+        const char *compileClass(const char *p)
+        {
+            bool reverse= false;
+            if(*p=='!') reverse= true, p++;
+            CharClass cc;
+            memset(cc.bits, 0, sizeof(cc.bits));
+            for(; *p && *p!=']'; p++)
+            {
+                // same signed char comparison as the interpreter
+                char c0= *p, c1= c0;
+                if(p[1]=='-' && p[2]) { p+= 2; c1= *p; }
+                for(int c= -128; c<128; c++)
+                    if(c && c>=c0 && c<=c1) cc.bits[(uint8_t)c>>5]|= 1u<<((uint8_t)c&31);
+            }
+            if(*p!=']') { ok= false; return p; }
+            if(reverse)
+                for(int i= 0; i<8; i++) cc.bits[i]= ~cc.bits[i];
+            cc.bits[0]&= ~1u;   // never match the terminating 0
+            addOp(OP_CLASS, classes.size(), 0);
+            classes.push_back(cc);
+            return p+1;
+        }
+
+        // p points at the '{'.
+        const char *compileAlternatives(const char *p)
+        {
+            const char *end= strchr(p, '}');
+            if(!end) { ok= false; return p+strlen(p); }
+            size_t first= alternatives.size();
+            const char *q;
+            do
+            {
+                p++;
+                q= strchr(p, ',');
+                if(q==0 || q>end) q= end;
+                Alternative a= { literals.size(), size_t(q-p) };
+                literals.append(p, q-p);
+                alternatives.push_back(a);
+                p= q;
+            } while(q!=end);
+            addOp(OP_ALTERNATIVES, first, alternatives.size()-first);
+            return end+1;
+        }
+
+        bool matchOps(size_t i, const char *path, const char *end) const
+        {
+            for(; i<ops.size(); i++)
+            {
+                const Op &op= ops[i];
+                switch(op.type)
+                {
+                    case OP_LITERAL:
+                        if(size_t(end-path)<op.len || memcmp(path, literals.data()+op.arg, op.len)) return false;
+                        path+= op.len;
+                        break;
+                    case OP_ANY:
+                        if(path==end) return false;
+                        path++;
+                        break;
+                    case OP_CLASS:
+                    {
+                        if(path==end) return false;
+                        uint8_t c= *path++;
+                        if(!(classes[op.arg].bits[c>>5] & (1u<<(c&31)))) return false;
+                        break;
+                    }
+                    case OP_ALTERNATIVES:
+                    {
+                        const Alternative *a= &alternatives[op.arg], *aEnd= a+op.len;
+                        for(; a!=aEnd; a++)
+                            if(size_t(end-path)>=a->len && !memcmp(path, literals.data()+a->offset, a->len)) break;
+                        if(a==aEnd) return false;
+                        path+= a->len;
+                        break;
+                    }
+                    case OP_STAR:
+                    {
+                        // the star can't cross a '/', so only positions up to the end of the segment are candidates.
+                        const char *segEnd= (const char*)memchr(path, '/', end-path);
+                        if(!segEnd) segEnd= end;
+                        if(i+1==ops.size()) return segEnd==end;
+                        const Op &next= ops[i+1];
+                        if(next.type==OP_LITERAL)
+                        {
+                            // skip straight to the places where the following literal can start.
+                            char c= literals[next.arg];
+                            if(c=='/') return matchOps(i+1, segEnd, end);
+                            for(; path<segEnd && (path= (const char*)memchr(path, c, segEnd-path)); path++)
+                                if(matchOps(i+1, path, end)) return true;
+                            return false;
+                        }
+                        for(; path<=segEnd; path++)
+                            if(matchOps(i+1, path, end)) return true;
+                        return false;
+                    }
+                    case OP_SEGMENTS:
+                        while(true)
+                        {
+                            if(matchOps(i+1, path, end)) return true;
+                            if(path==end) return false;
+                            path= (const char*)memchr(path+1, '/', end-path-1);
+                            if(!path) return false;
+                        }
+                }
+            }
+            return path==end;
+        }
+};
+
+
+#endif //OSCPATTERN_H
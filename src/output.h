@@ -0,0 +1,329 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+// output drivers. besides the moodlamp tty (SerialIO) the lamp state goes to the fixtures added with
+// "output = ...", one line each:
+//
+//      output = artnet HOST[:PORT] UNIVERSE FIRSTLAMP COUNT    ArtDmx, lamps FIRSTLAMP.. as R, G, B from channel 1
+//      output = sacn UNIVERSE FIRSTLAMP COUNT [HOST[:PORT]]    E1.31, to the universe's multicast group unless HOST
+//      output = file PATH                                      text protocol commands to a file or fifo
+//      output = null                                           nothing, only counts (for benchmarking)
+//
+// a driver gets batches, not commands: send() is called whenever lamps are flushed and looks at the dirty
+// bits of the lamp state, which are the lamps changed since the last call. drivers for links slower than
+// the packets coming in note the changed lamps and put them out once per frame in frame(), a DMX universe
+// as one packet, the file sink as the commands for the lamps which changed. nothing blocks: when a socket
+// or fifo is full the lamps wait for the next frame.
+
+#define OUTPUT_REFRESH_MS   1000    // an unchanged DMX universe is sent again this often, receivers time out silent sources
+
+enum OutputType { OUTPUT_ARTNET, OUTPUT_SACN, OUTPUT_FILE, OUTPUT_NULL };
+
+struct OutputSpec
+{
+    string line;                // as written in the config
+    int type;
+    sockaddr_storage addr;
+    socklen_t addrLen;
+    int universe, firstLamp, count;
+    string path;
+
+    bool operator==(const OutputSpec &other) const
+    { return line==other.line; }
+};
+
+inline bool parseOutputSpec(const string &value, OutputSpec &spec)
+{
+    char type[16], host[256];
+    int n= 0;
+    spec.line= value;
+    spec.universe= spec.firstLamp= spec.count= 0;
+    spec.addrLen= 0;
+    if(sscanf(value.c_str(), "%15s%n", type, &n)!=1) return false;
+    size_t rest= value.find_first_not_of(" \t", n);
+    if(!strcmp(type, "null"))
+    {
+        spec.type= OUTPUT_NULL;
+        return rest==string::npos;
+    }
+    if(!strcmp(type, "file"))
+    {
+        spec.type= OUTPUT_FILE;
+        if(rest==string::npos) return false;
+        spec.path= value.substr(rest);
+        return true;
+    }
+    if(!strcmp(type, "artnet"))
+    {
+        spec.type= OUTPUT_ARTNET;
+        if(sscanf(value.c_str(), "%*s %255s %d %d %d%n", host, &spec.universe, &spec.firstLamp, &spec.count, &n)!=4 ||
+           value.find_first_not_of(" \t", n)!=string::npos || spec.universe<0 || spec.universe>=32768 ||
+           !resolveHostPort(host, ARTNET_PORT, spec.addr, spec.addrLen))
+            return false;
+    }
+    else if(!strcmp(type, "sacn"))
+    {
+        spec.type= OUTPUT_SACN;
+        if(sscanf(value.c_str(), "%*s %d %d %d%n", &spec.universe, &spec.firstLamp, &spec.count, &n)!=3 ||
+           spec.universe<1 || spec.universe>63999)
+            return false;
+        rest= value.find_first_not_of(" \t", n);
+        string dest= rest==string::npos? sacnGroup(spec.universe): value.substr(rest);
+        if(!resolveHostPort(dest, SACN_PORT, spec.addr, spec.addrLen)) return false;
+    }
+    else
+        return false;
+    return spec.firstLamp>=0 && spec.count>0 && spec.firstLamp+spec.count<=MAX_LAMPS && spec.count*3<=DMX_CHANNELS;
+}
+
+
+class OutputDriver
+{
+    public:
+        virtual ~OutputDriver() {}
+
+        // a batch: the lamps dirty in 'lamps' changed. called before the dirty bits are cleared.
+        virtual void send(const LampState &lamps) = 0;
+
+        // a frame of the frame clock.
+        virtual void frame(uint64_t /*nowNs*/) {}
+
+        // the driver needs the frame clock, it has lamps to put out or fixtures to refresh.
+        virtual bool wantsFrames() const { return false; }
+
+        virtual void print(FILE */*f*/) const {}
+};
+
+
+// Art-Net or sACN. the universe is kept here and sent whole whenever lamps in it changed.
+class DmxOutput: public OutputDriver
+{
+    public:
+        DmxOutput(const OutputSpec &s): spec(s), sequence(0), changed(true), lastSentNs(0), packets(0), dropped(0), errors(0)
+        {
+            memset(data, 0, sizeof(data));
+            if( (fd= socket(spec.addr.ss_family, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0))<0 ) logerror("socket");
+            // the CID names the source to sACN receivers, it's the same across restarts on a host.
+            char host[256]= "";
+            gethostname(host, sizeof(host)-1);
+            uint64_t h= 14695981039346656037ull;
+            for(const char *c= host; *c; c++) h= (h ^ (uint8_t)*c) * 1099511628211ull;
+            for(int i= 0; i<16; i++)
+            {
+                h= (h ^ i) * 1099511628211ull;
+                cid[i]= h>>56;
+            }
+        }
+
+        ~DmxOutput() { if(fd>=0) close(fd); }
+
+        void send(const LampState &lamps)
+        {
+            int end= spec.firstLamp+spec.count;
+            for(int w= spec.firstLamp/64; w<=(end-1)/64; w++)
+                for(uint64_t bits= lamps.dirty[w]; bits; bits&= bits-1)
+                {
+                    int i= w*64 + __builtin_ctzll(bits);
+                    if(i<spec.firstLamp || i>=end) continue;
+                    uint8_t *p= data+(i-spec.firstLamp)*3;
+                    p[0]= lamps.red[i], p[1]= lamps.green[i], p[2]= lamps.blue[i];
+                    changed= true;
+                }
+        }
+
+        void frame(uint64_t nowNs)
+        {
+            if(fd<0 || (!changed && nowNs-lastSentNs<OUTPUT_REFRESH_MS*1000000ull)) return;
+            uint8_t packet[SACN_HEADER+DMX_CHANNELS];
+            int length= spec.count*3;
+            size_t size= spec.type==OUTPUT_ARTNET?
+                buildArtDmx(packet, spec.universe, sequence%255+1, data, length+(length&1)):   // Art-Net wants an even length, sequence 0 is "off"
+                buildSacn(packet, cid, "moodpd", spec.universe, sequence, data, length);
+            if(sendto(fd, packet, size, MSG_DONTWAIT, (sockaddr*)&spec.addr, spec.addrLen)<0)
+            {
+                if(errno==EAGAIN || errno==EWOULDBLOCK || errno==ENOBUFS) { dropped++; return; }
+                if(errors++%1000==0) flog(LOG_ERROR, "output %s: %s\n", spec.line.c_str(), strerror(errno));
+            }
+            else
+                packets++;
+            sequence++;
+            changed= false;
+            lastSentNs= nowNs;
+        }
+
+        bool wantsFrames() const { return true; }
+
+        void print(FILE *f) const
+        {
+            fprintf(f, "output %s: %llu packets, %llu dropped, %llu errors\n", spec.line.c_str(),
+                    (unsigned long long)packets, (unsigned long long)dropped, (unsigned long long)errors);
+        }
+
+    private:
+        OutputSpec spec;
+        int fd;
+        uint8_t data[DMX_CHANNELS];
+        uint8_t cid[16];
+        uint8_t sequence;
+        bool changed;
+        uint64_t lastSentNs;
+        uint64_t packets, dropped, errors;
+};
+
+
+// the text protocol to a file or fifo, for recording or for another program driving other lamps. a fifo
+// is opened once it has a reader, until then and while it's full the lamps wait.
+class FileOutput: public OutputDriver
+{
+    public:
+        FileOutput(const OutputSpec &s): spec(s), fd(-1), cursor(0), bytes(0), dropped(0), errors(0)
+        {
+            memset(rgb, 0, sizeof(rgb));
+            memset(pending, 0, sizeof(pending));
+        }
+
+        ~FileOutput() { if(fd>=0) close(fd); }
+
+        void send(const LampState &lamps)
+        {
+            for(int w= 0; w<MAX_LAMPS/64; w++) pending[w]|= lamps.dirty[w];
+            lamps.forEachDirty([&](int i) {
+                rgb[i][0]= lamps.red[i], rgb[i][1]= lamps.green[i], rgb[i][2]= lamps.blue[i];
+            });
+        }
+
+        void frame(uint64_t /*nowNs*/)
+        {
+            if(!wantsFrames()) return;
+            if(fd<0 && (fd= open(spec.path.c_str(), O_WRONLY|O_CREAT|O_APPEND|O_NONBLOCK|O_CLOEXEC, 0644))<0)
+            {
+                // ENXIO: a fifo nobody reads yet.
+                if(errno!=ENXIO && errors++%1000==0) flog(LOG_ERROR, "output %s: %s\n", spec.path.c_str(), strerror(errno));
+                return;
+            }
+            // all lamps are less than PIPE_BUF, so a fifo takes the whole frame or nothing.
+            char buf[MAX_LAMPS*MAX_LAMP_COMMAND_SIZE];
+            uint64_t bits[MAX_LAMPS/64];
+            memcpy(bits, pending, sizeof(bits));
+            int next= cursor;
+            size_t n= formatLamps<PROTOCOL_TEXT>(buf, sizeof(buf), bits, next, rgb, [](int) {});
+            ssize_t written= write(fd, buf, n);
+            if(written==(ssize_t)n)
+            {
+                memset(pending, 0, sizeof(pending));
+                cursor= next;
+                bytes+= n;
+                return;
+            }
+            if(written<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) { dropped++; return; }
+            // the reader went away (EPIPE) or the disk is full. reopen with the next frame.
+            if(errors++%1000==0) flog(LOG_ERROR, "output %s: %s\n", spec.path.c_str(), written<0? strerror(errno): "short write");
+            close(fd);
+            fd= -1;
+        }
+
+        bool wantsFrames() const
+        {
+            for(int w= 0; w<MAX_LAMPS/64; w++) if(pending[w]) return true;
+            return false;
+        }
+
+        void print(FILE *f) const
+        {
+            fprintf(f, "output file %s: %llu bytes, %llu frames deferred, %llu errors\n", spec.path.c_str(),
+                    (unsigned long long)bytes, (unsigned long long)dropped, (unsigned long long)errors);
+        }
+
+    private:
+        OutputSpec spec;
+        int fd, cursor;
+        uint8_t rgb[MAX_LAMPS][3];
+        uint64_t pending[MAX_LAMPS/64];
+        uint64_t bytes, dropped, errors;
+};
+
+
+// takes everything and does nothing with it, to measure the rest.
+class NullOutput: public OutputDriver
+{
+    public:
+        NullOutput(): batches(0), lamps(0) {}
+
+        void send(const LampState &l)
+        {
+            for(int w= 0; w<MAX_LAMPS/64; w++) lamps+= __builtin_popcountll(l.dirty[w]);
+            batches++;
+        }
+
+        void print(FILE *f) const
+        { fprintf(f, "output null: %llu lamps in %llu batches\n", (unsigned long long)lamps, (unsigned long long)batches); }
+
+        uint64_t batches, lamps;
+};
+
+
+inline OutputDriver *createOutput(const OutputSpec &spec)
+{
+    switch(spec.type)
+    {
+        case OUTPUT_ARTNET:
+        case OUTPUT_SACN: return new DmxOutput(spec);
+        case OUTPUT_FILE: return new FileOutput(spec);
+        default: return new NullOutput;
+    }
+}
+
+
+// the configured outputs.
+class OutputSet
+{
+    public:
+        ~OutputSet() { clear(); }
+
+        // take over a new set of outputs. when it differs from the current one all outputs are recreated
+        // and start with the whole lamp state.
+        void setSpecs(const vector<OutputSpec> &newSpecs, const LampState &lamps)
+        {
+            if(newSpecs==specs) return;
+            clear();
+            specs= newSpecs;
+            LampState all= lamps;
+            all.markDirty(0, MAX_LAMPS);
+            for(size_t i= 0; i<specs.size(); i++)
+            {
+                drivers.push_back(createOutput(specs[i]));
+                drivers.back()->send(all);
+            }
+        }
+
+        bool empty() const { return drivers.empty(); }
+
+        void send(const LampState &lamps)
+        { for(size_t i= 0; i<drivers.size(); i++) drivers[i]->send(lamps); }
+
+        void frame(uint64_t nowNs)
+        { for(size_t i= 0; i<drivers.size(); i++) drivers[i]->frame(nowNs); }
+
+        bool wantsFrames() const
+        {
+            for(size_t i= 0; i<drivers.size(); i++) if(drivers[i]->wantsFrames()) return true;
+            return false;
+        }
+
+        void print(FILE *f) const
+        { for(size_t i= 0; i<drivers.size(); i++) drivers[i]->print(f); }
+
+    private:
+        vector<OutputSpec> specs;
+        vector<OutputDriver*> drivers;
+
+        void clear()
+        {
+            for(size_t i= 0; i<drivers.size(); i++) delete drivers[i];
+            drivers.clear();
+            specs.clear();
+        }
+};
+
+
+#endif //OUTPUT_H
@@ -0,0 +1,104 @@
+#ifndef PRIORITY_H
+#define PRIORITY_H
+
+// priority classes for ingest. every packet is put into a class by "priority" rules matching the local
+// port it arrived on, the sender's address or (OSC) the address of any of its messages; the most urgent
+// matching rule wins, packets matching none are "normal". whatever a packet causes on the serial line
+// goes out in its class's lane of the serial writer, which serves the most urgent lane first (see
+// NonblockWriter), so a fader move doesn't wait behind a media server's bulk stream.
+
+enum PriorityLane
+{
+    LANE_INTERACTIVE= 0,
+    LANE_NORMAL,
+    LANE_BULK,
+};
+
+enum PriorityMatch { PRIORITY_PORT, PRIORITY_SOURCE, PRIORITY_OSC };
+
+struct PriorityRule
+{
+    int lane;
+    int match;
+    int port;                   // PRIORITY_PORT
+    uint8_t net[16];            // PRIORITY_SOURCE: IPv6 or v4-mapped network
+    int prefixLen;              // in bits of 'net'
+    string prefix;              // PRIORITY_OSC: OSC address prefix
+
+    bool operator==(const PriorityRule &o) const
+    {
+        return lane==o.lane && match==o.match && port==o.port && !memcmp(net, o.net, sizeof(net)) &&
+               prefixLen==o.prefixLen && prefix==o.prefix;
+    }
+};
+
+inline const char *laneName(int lane)
+{
+    static const char *names[]= { "interactive", "normal", "bulk" };
+    return lane>=0 && lane<WRITE_LANES? names[lane]: "?";
+}
+
+// parse "CLASS port N", "CLASS source ADDRESS[/PREFIXLEN]" or "CLASS osc /PREFIX", CLASS one of
+// interactive, normal, bulk.
+inline bool parsePriorityRule(const string &value, PriorityRule &rule)
+{
+    char cls[16], match[16], arg[256];
+    int n= 0;
+    if(sscanf(value.c_str(), "%15s %15s %255s %n", cls, match, arg, &n)!=3 || value[n]) return false;
+    memset(rule.net, 0, sizeof(rule.net));
+    rule.port= 0;
+    rule.prefixLen= 0;
+    rule.prefix.clear();
+    rule.lane= -1;
+    for(int i= 0; i<WRITE_LANES; i++) if(!strcmp(cls, laneName(i))) rule.lane= i;
+    if(rule.lane<0) return false;
+
+    if(!strcmp(match, "port"))
+    {
+        char *end;
+        rule.match= PRIORITY_PORT;
+        rule.port= strtol(arg, &end, 10);
+        return !*end && rule.port>0 && rule.port<65536;
+    }
+    if(!strcmp(match, "osc"))
+    {
+        rule.match= PRIORITY_OSC;
+        rule.prefix= arg;
+        return arg[0]=='/';
+    }
+    if(strcmp(match, "source")) return false;
+    rule.match= PRIORITY_SOURCE;
+    return parseNetwork(arg, rule.net, rule.prefixLen);
+}
+
+// the more urgent of two classes, -1 meaning "no rule matched yet".
+inline int mergeLane(int a, int b)
+{ return a<0? b: b<0? a: min(a, b); }
+
+// class of a packet by the port it arrived on (0 for UNIX sockets) and its sender, -1 if no rule matches.
+inline int packetLane(const vector<PriorityRule> &rules, int port, const sockaddr *from)
+{
+    uint8_t addr[16];
+    bool haveAddr= ipv6Address(from, addr);
+    int lane= -1;
+    for(size_t i= 0; i<rules.size(); i++)
+    {
+        const PriorityRule &r= rules[i];
+        if( (r.match==PRIORITY_PORT && port==r.port) ||
+            (r.match==PRIORITY_SOURCE && haveAddr && prefixMatches(addr, r.net, r.prefixLen)) )
+            lane= mergeLane(lane, r.lane);
+    }
+    return lane;
+}
+
+// merge the class of an OSC message's address into 'lane'.
+inline int oscLane(const vector<PriorityRule> &rules, const string &address, int lane)
+{
+    for(size_t i= 0; i<rules.size(); i++)
+        if(rules[i].match==PRIORITY_OSC && !address.compare(0, rules[i].prefix.size(), rules[i].prefix))
+            lane= mergeLane(lane, rules[i].lane);
+    return lane;
+}
+
+
+#endif //PRIORITY_H
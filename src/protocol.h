@@ -0,0 +1,181 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// lamp protocols, chosen per tty with "protocol" in the config:
+//
+//      text    new firmware. "q\n" initializes the bus, "iRRGGBB\n" sets all lamps, "iRRGGBBNN\n" lamp NN (hex).
+//      muccc   muccc moodlamps. binary commands ('C' R G B sets the color, 'M' fades, see cmd_handler.h),
+//              each framed as "acP\2" COMMAND "ab". the line has a single lamp, which is bus lamp 0.
+//
+// every protocol is an Encoder specialization whose members are static and inline. code formatting many
+// commands, like the lamp state going out, is a template on the protocol and is picked once per batch
+// (see formatLamps()), so formatting a command costs neither a virtual call nor a switch on the protocol.
+// the decoding side is for the virtual lamp of the simulation.
+
+enum LampProtocol { PROTOCOL_TEXT, PROTOCOL_MUCCC, PROTOCOLS };
+
+#define MAX_LAMP_COMMAND_SIZE   10      // longest command setting one lamp, in any protocol
+
+inline const char *protocolName(int p)
+{
+    static const char *names[]= { "text", "muccc" };
+    return p>=0 && p<PROTOCOLS? names[p]: "?";
+}
+
+// protocol by name, -1 if unknown.
+inline int lampProtocol(const string &name)
+{
+    for(int i= 0; i<PROTOCOLS; i++) if(name==protocolName(i)) return i;
+    return -1;
+}
+
+template<int P> struct Encoder;
+
+template<> struct Encoder<PROTOCOL_TEXT>
+{
+    static int init(char *out)
+    {
+        memcpy(out, "q\n", 2);
+        return 2;
+    }
+
+    // all lamps.
+    static int color(char *out, uint8_t r, uint8_t g, uint8_t b)
+    {
+        static const char hex[]= "0123456789abcdef";
+        out[0]= 'i';
+        out[1]= hex[r>>4]; out[2]= hex[r&15];
+        out[3]= hex[g>>4]; out[4]= hex[g&15];
+        out[5]= hex[b>>4]; out[6]= hex[b&15];
+        out[7]= '\n';
+        return 8;
+    }
+
+    static int lamp(char *out, uint8_t r, uint8_t g, uint8_t b, int lamp)
+    { return formatLampCommand(out, r, g, b, lamp); }
+
+    // length of the complete command at the start of 'c' (n bytes so far), 0 if it isn't complete yet.
+    static int commandLength(const char *c, int n)
+    { return c[n-1]=='\n'? n: 0; }
+
+    // the color set by a complete command, lamp -1 for all lamps. false if it sets none.
+    static bool decodeColor(const char *c, int n, uint8_t *rgb, int &lamp)
+    {
+        if(c[0]!='i' || (n!=8 && n!=10)) return false;
+        int v[4];
+        for(int i= 0; i<(n-2)/2; i++) if( (v[i]= hexByte(c+1+i*2))<0 ) return false;
+        for(int i= 0; i<3; i++) rgb[i]= v[i];
+        lamp= n==10? v[3]: -1;
+        return true;
+    }
+
+    static int hexByte(const char *s)
+    {
+        int v= 0;
+        for(int i= 0; i<2; i++)
+        {
+            char c= s[i];
+            int d= c>='0' && c<='9'? c-'0': c>='a' && c<='f'? c-'a'+10: c>='A' && c<='F'? c-'A'+10: -1;
+            if(d<0) return -1;
+            v= v*16+d;
+        }
+        return v;
+    }
+};
+
+template<> struct Encoder<PROTOCOL_MUCCC>
+{
+    // some magic undocumented initialization bytes.
+    static int init(char *out)
+    {
+        static const char bytes[]= "acI\1\2\2ab" "acW\0ab";
+        memcpy(out, bytes, sizeof(bytes)-1);
+        return sizeof(bytes)-1;
+    }
+
+    static int color(char *out, uint8_t r, uint8_t g, uint8_t b)
+    {
+        const char c[]= { CMD_SET_COLOR, (char)r, (char)g, (char)b };
+        return command(out, c, 4);
+    }
+
+    // only lamp 0 is on the line, the others are dropped.
+    static int lamp(char *out, uint8_t r, uint8_t g, uint8_t b, int lamp)
+    { return lamp? 0: color(out, r, g, b); }
+
+    // frame the muccc command 'c'. 'out' has room for n+6 bytes.
+    static int command(char *out, const char *c, int n)
+    {
+        memcpy(out, "acP\2", 4);
+        memcpy(out+4, c, n);
+        memcpy(out+4+n, "ab", 2);
+        return n+6;
+    }
+
+    static int commandLength(const char *c, int n)
+    {
+        int len= 0;
+        if(n>=3 && c[2]=='I') len= 8;
+        else if(n>=3 && c[2]=='W') len= 6;
+        else if(n>=5 && c[2]=='P')
+        {
+            int args= c[4]==CMD_SET_COLOR? 3: c[4]==CMD_FADEMS? 5: c[4]==CMD_SET_BRIGHTNESS? 1:
+                      c[4]==CMD_PAUSE || c[4]==CMD_POWER? 0: -1;
+            if(args>=0) len= 7+args;
+        }
+        if(len) return n>=len? len: 0;
+        // anything else ends at the first "ab".
+        return n>=2 && c[n-2]=='a' && c[n-1]=='b'? n: 0;
+    }
+
+    static bool decodeColor(const char *c, int n, uint8_t *rgb, int &lamp)
+    {
+        if(n!=10 || memcmp(c, "acP\2", 4) || c[4]!=CMD_SET_COLOR) return false;
+        memcpy(rgb, c+5, 3);
+        lamp= 0;
+        return true;
+    }
+};
+
+
+// format the commands for the lamps with a bit set in 'pending', starting at lamp 'cursor' and wrapping around,
+// until at least 'maxBytes' are formatted. clears the bits of the lamps done, calls formatted(lamp) for each
+// lamp which got a command and leaves 'cursor' at the lamp to start from next time. 'out' has room for
+// MAX_LAMPS commands. returns the number of bytes formatted.
+template<int P, typename Fn> size_t formatLamps(char *out, size_t maxBytes, uint64_t *pending, int &cursor,
+                                                 const uint8_t (*rgb)[3], Fn formatted)
+{
+    // bits and cursor are kept in locals, through the references every byte stored to 'out' would reload them.
+    size_t n= 0;
+    int start= cursor, next= cursor;
+    for(int k= 0; k<=MAX_LAMPS/64 && n<maxBytes; k++)
+    {
+        int w= (start/64+k) % (MAX_LAMPS/64);
+        uint64_t bits= pending[w], mask= k? ~0ull: ~0ull<<(start&63);
+        for(uint64_t sel; (sel= bits&mask) && n<maxBytes; )
+        {
+            int t= w*64 + __builtin_ctzll(sel);
+            bits&= ~(sel&-sel);
+            int len= Encoder<P>::lamp(out+n, rgb[t][0], rgb[t][1], rgb[t][2], t);
+            if(len) formatted(t);
+            n+= len;
+            next= (t+1)%MAX_LAMPS;
+        }
+        pending[w]= bits;
+    }
+    cursor= next;
+    return n;
+}
+
+template<typename Fn> size_t formatLamps(int protocol, char *out, size_t maxBytes, uint64_t *pending, int &cursor,
+                                         const uint8_t (*rgb)[3], Fn formatted)
+{
+    switch(protocol)
+    {
+        case PROTOCOL_MUCCC: return formatLamps<PROTOCOL_MUCCC>(out, maxBytes, pending, cursor, rgb, formatted);
+        default: return formatLamps<PROTOCOL_TEXT>(out, maxBytes, pending, cursor, rgb, formatted);
+    }
+}
+
+
+#endif //PROTOCOL_H
@@ -0,0 +1,85 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+// real-time mode. moodpd is a single thread, so its output path is the whole process: with "realtime"
+// it runs under SCHED_FIFO, with "cpu" it is pinned to one CPU (ideally one isolated from other work),
+// and in real-time mode its memory is locked and prefaulted so a page fault can't delay a frame. glibc
+// is told to keep freed memory instead of returning it to the kernel, so memory once touched stays
+// mapped and locked.
+//
+// everything here needs privileges (CAP_SYS_NICE, CAP_IPC_LOCK or matching rlimits). failures are
+// logged and moodpd keeps running without the setting.
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <malloc.h>
+
+#define REALTIME_PREFAULT_STACK     (256*1024)
+#define REALTIME_PREFAULT_HEAP      (4*1024*1024)
+
+
+// pin the process to 'cpu', -1 for all CPUs.
+inline bool pinToCpu(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(cpu<0)
+        for(int i= 0; i<CPU_SETSIZE; i++) CPU_SET(i, &set);
+    else
+        CPU_SET(cpu, &set);
+    if(sched_setaffinity(0, sizeof(set), &set)<0 && cpu>=0)
+    {
+        logerror("sched_setaffinity");
+        return false;
+    }
+    return true;
+}
+
+// SCHED_FIFO with priority 'priority' (1..99), 0 for the normal scheduler.
+inline bool setRealtimePriority(int priority)
+{
+    sched_param sp;
+    memset(&sp, 0, sizeof(sp));
+    sp.sched_priority= priority;
+    if(sched_setscheduler(0, priority? SCHED_FIFO: SCHED_OTHER, &sp)<0)
+    {
+        logerror("sched_setscheduler");
+        return false;
+    }
+    return true;
+}
+
+// touch a stack area below the current frame, so it's mapped (and locked) before it's needed.
+__attribute__((noinline)) inline void prefaultStack()
+{
+    volatile char stack[REALTIME_PREFAULT_STACK];
+    for(size_t i= 0; i<sizeof(stack); i+= 4096) stack[i]= 0;
+}
+
+// lock all current and future memory and prefault stack and heap reserves.
+inline bool lockMemory()
+{
+    mallopt(M_TRIM_THRESHOLD, -1);  // don't give freed memory back
+    mallopt(M_MMAP_MAX, 0);         // and serve large blocks from the heap, which stays locked
+    if(mlockall(MCL_CURRENT|MCL_FUTURE)<0)
+    {
+        logerror("mlockall");
+        return false;
+    }
+    prefaultStack();
+    char *heap= (char*)malloc(REALTIME_PREFAULT_HEAP);
+    if(heap)
+    {
+        for(size_t i= 0; i<REALTIME_PREFAULT_HEAP; i+= 4096) ((volatile char*)heap)[i]= 0;
+        free(heap);
+    }
+    return true;
+}
+
+inline void unlockMemory()
+{
+    if(munlockall()<0) logerror("munlockall");
+}
+
+
+#endif //REALTIME_H
@@ -0,0 +1,138 @@
+/*
+    moodpd-replay: send packets captured with moodpd -w back to a moodpd instance.
+
+    run moodpd-replay -h for help.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <deque>
+#include <vector>
+#include <string>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <iostream>
+
+#include <oscpkt.hh>
+#include <udp.hh>
+
+using namespace std;
+
+#include "utils.h"
+#include "capture.h"
+#include "lamps.h"
+#include "dmx.h"
+
+#define DEFAULT_PORT 4242
+
+uint32_t logMask= 1<<LOG_ERROR;
+
+void printHelp(char *comm)
+{
+    printf("use: %s [options] CAPTUREFILE\n", comm);
+    printf("options:\n"
+           "    -h              print this text.\n"
+           "    -H HOST         send to HOST [localhost]\n"
+           "    -p PORT         send raw packets to PORT, OSC packets to PORT+1 [%d]\n"
+           "                    (Art-Net and sACN packets go to their standard ports)\n"
+           "    -s SPEED        replay speed factor, 1 is original timing, 0 is as fast as possible [1]\n"
+           "    -o SECONDS      start replaying at this offset into the capture [0]\n"
+           "    -i              print information about the capture and exit\n"
+           "    -q              quiet, don't print statistics\n"
+           "\n", DEFAULT_PORT);
+}
+
+int main(int argc, char *argv[])
+{
+    string host= "localhost";
+    int port= DEFAULT_PORT;
+    double speed= 1, startOffset= 0;
+    bool infoOnly= false, quiet= false;
+
+    int opt;
+    while( (opt= getopt(argc, argv, "hH:p:s:o:iq"))!=-1 )
+        switch(opt)
+        {
+            case 'h':
+                printHelp(argv[0]);
+                exit(0);
+            case 'H': host= optarg; break;
+            case 'p': port= atoi(optarg); break;
+            case 's': speed= atof(optarg); break;
+            case 'o': startOffset= atof(optarg); break;
+            case 'i': infoOnly= true; break;
+            case 'q': quiet= true; break;
+            default:
+                printHelp(argv[0]);
+                exit(1);
+        }
+    if(optind!=argc-1 || speed<0)
+    {
+        printHelp(argv[0]);
+        exit(1);
+    }
+
+    CaptureReader reader;
+    if(!reader.open(argv[optind])) exit(1);
+
+    if(infoOnly)
+    {
+        const CaptureFileHeader *h= reader.header();
+        time_t started= h->startRealtime/1000000000ull;
+        uint64_t packets= 0, bytes= 0, last= 0;
+        const CaptureRecord *r;
+        while( (r= reader.next()) )
+            packets++, bytes+= r->size, last= r->time;
+        printf("capture started: %s", ctime(&started));
+        printf("duration: %.3f s\npackets: %llu\npayload bytes: %llu\n",
+               last/1e9, (unsigned long long)packets, (unsigned long long)bytes);
+        return 0;
+    }
+
+    oscpkt::UdpSocket rawSocket, oscSocket, artnetSocket, sacnSocket;
+    if(!rawSocket.connectTo(host, port) || !oscSocket.connectTo(host, port+1) ||
+       !artnetSocket.connectTo(host, ARTNET_PORT) || !sacnSocket.connectTo(host, SACN_PORT))
+    {
+        flog(LOG_CRIT, "can't connect to %s: %s\n", host.c_str(), strerror(errno));
+        exit(1);
+    }
+
+    reader.seek(uint64_t(startOffset*1e9));
+    const CaptureRecord *r= reader.next();
+    if(!r) { flog(LOG_ERROR, "nothing to replay.\n"); return 0; }
+
+    uint64_t firstTime= r->time, start= monotonicNs();
+    uint64_t packets= 0, bytes= 0, errors= 0;
+    for(; r; r= reader.next())
+    {
+        if(speed>0)
+        {
+            uint64_t due= start + uint64_t((r->time-firstTime)/speed);
+            timespec ts= { time_t(due/1000000000ull), long(due%1000000000ull) };
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0)==EINTR);
+        }
+        oscpkt::UdpSocket &s= (r->source==CAPTURE_OSC? oscSocket: r->source==CAPTURE_ARTNET? artnetSocket:
+                               r->source==CAPTURE_SACN? sacnSocket: rawSocket);
+        if(s.sendPacket(r+1, r->size))
+            packets++, bytes+= r->size;
+        else
+            errors++;
+    }
+
+    if(!quiet)
+    {
+        double elapsed= (monotonicNs()-start)/1e9;
+        printf("sent %llu packets (%llu bytes) in %.3f s, %.0f packets/s, %llu send errors\n",
+               (unsigned long long)packets, (unsigned long long)bytes, elapsed,
+               elapsed>0? packets/elapsed: 0, (unsigned long long)errors);
+    }
+    return 0;
+}
@@ -0,0 +1,192 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+// OSC routing. with "forward = /dali/ 172.22.83.5:4243" every OSC message whose address starts with /dali/
+// goes to that host instead of being handled here, so controllers only need to know moodpd. the longest
+// matching prefix wins. messages are passed on byte for byte. the ones for a destination are collected and
+// sent once per frame as one bundle (a single message goes out as it is), from the OSC socket without
+// blocking. rules with the same host and port share their bundles.
+
+#define ROUTE_MAX_BUNDLE    8192    // a bundle this large is sent right away, not at the end of the frame
+
+
+struct ForwardRule
+{
+    string prefix;
+    string name;                // destination as written in the config
+    sockaddr_storage addr;
+    socklen_t addrLen;
+
+    bool operator==(const ForwardRule &other) const
+    { return prefix==other.prefix && name==other.name; }
+};
+
+// parse "/PREFIX HOST[:PORT]", the port defaults to the OSC port.
+inline bool parseForwardRule(const string &value, ForwardRule &rule)
+{
+    char prefix[256], host[256];
+    int n= 0;
+    if(sscanf(value.c_str(), "%255s %255s%n", prefix, host, &n)!=2 || prefix[0]!='/' ||
+       value.find_first_not_of(" \t", n)!=string::npos)
+        return false;
+    if(!resolveHostPort(host, DEFAULT_PORT+1, rule.addr, rule.addrLen)) return false;
+    rule.prefix= prefix;
+    rule.name= host;
+    return true;
+}
+
+
+// call fn(message, size) for every message in an OSC packet, including the ones in (nested) bundles.
+template<typename Fn> void forEachOscMessage(const char *p, size_t size, Fn fn)
+{
+    if(size<16 || memcmp(p, "#bundle", 8))
+    {
+        if(size && strnlen(p, size)<size) fn(p, size);
+        return;
+    }
+    for(size_t pos= 16; pos+4<=size; )
+    {
+        uint32_t len;
+        memcpy(&len, p+pos, 4);
+        len= ntohl(len);
+        pos+= 4;
+        if(len>size-pos) return;
+        forEachOscMessage(p+pos, len, fn);
+        pos+= len;
+    }
+}
+
+
+class OscRouter
+{
+    public:
+        OscRouter(): routedMessages(0), sentPackets(0), sendErrors(0) {}
+
+        // take over a new set of rules. messages still pending are dropped, flush() first.
+        void setRules(const vector<ForwardRule> &newRules)
+        {
+            if(newRules==rules) return;
+            rules= newRules;
+            destinations.clear();
+            ruleDestination.clear();
+            for(size_t r= 0; r<rules.size(); r++)
+            {
+                size_t d= 0;
+                while(d<destinations.size() && !(destinations[d].addrLen==rules[r].addrLen &&
+                      !memcmp(&destinations[d].addr, &rules[r].addr, rules[r].addrLen)))
+                    d++;
+                if(d==destinations.size())
+                {
+                    destinations.push_back(Destination());
+                    Destination &dest= destinations.back();
+                    dest.name= rules[r].name;
+                    dest.addr= rules[r].addr;
+                    dest.addrLen= rules[r].addrLen;
+                    dest.count= 0;
+                }
+                ruleDestination.push_back(d);
+            }
+        }
+
+        // the rule for a message address, -1 if the message is ours.
+        int match(const char *address) const
+        {
+            int best= -1;
+            for(size_t r= 0; r<rules.size(); r++)
+                if(!strncmp(address, rules[r].prefix.c_str(), rules[r].prefix.size()) &&
+                   (best<0 || rules[r].prefix.size()>rules[best].prefix.size()))
+                    best= r;
+            return best;
+        }
+
+        // collect the messages of an OSC packet a rule matches. they are passed on as they are.
+        // returns the number of messages routed.
+        int route(const char *packet, size_t size, int fd)
+        {
+            if(rules.empty()) return 0;
+            int routed= 0;
+            forEachOscMessage(packet, size, [&](const char *msg, size_t len) {
+                int rule= match(msg);
+                if(rule<0) return;
+                Destination &dest= destinations[ruleDestination[rule]];
+                if(dest.bundle.empty())
+                {
+                    // "#bundle", time tag "immediately"
+                    static const char header[16]= { '#', 'b', 'u', 'n', 'd', 'l', 'e', 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+                    dest.bundle.assign(header, header+16);
+                }
+                uint32_t n= htonl(len);
+                dest.bundle.insert(dest.bundle.end(), (const char*)&n, (const char*)&n+4);
+                dest.bundle.insert(dest.bundle.end(), msg, msg+len);
+                dest.count++;
+                routed++;
+                if(dest.bundle.size()>=ROUTE_MAX_BUNDLE) send(dest, fd);
+            });
+            routedMessages+= routed;
+            return routed;
+        }
+
+        // send everything collected. called once per frame.
+        void flush(int fd)
+        {
+            for(size_t d= 0; d<destinations.size(); d++)
+                if(destinations[d].count) send(destinations[d], fd);
+        }
+
+        bool pending() const
+        {
+            for(size_t d= 0; d<destinations.size(); d++)
+                if(destinations[d].count) return true;
+            return false;
+        }
+
+        void print(FILE *f) const
+        {
+            if(rules.empty()) return;
+            fprintf(f, "routed %llu OSC messages to %zu destinations in %llu packets, %llu send errors\n",
+                    (unsigned long long)routedMessages, destinations.size(), (unsigned long long)sentPackets,
+                    (unsigned long long)sendErrors);
+        }
+
+    private:
+        struct Destination
+        {
+            string name;
+            sockaddr_storage addr;
+            socklen_t addrLen;
+            vector<char> bundle;    // the frame's messages. a single one is sent without the bundle around it
+            int count;
+        };
+
+        vector<ForwardRule> rules;
+        vector<Destination> destinations;
+        vector<size_t> ruleDestination;
+        uint64_t routedMessages, sentPackets, sendErrors;
+
+        void send(Destination &dest, int fd)
+        {
+            const char *data= &dest.bundle[0];
+            size_t size= dest.bundle.size();
+            if(dest.count==1) data+= 20, size-= 20;    // bundle header and element size
+            if(fd>=0)   // there's no socket in a simulation
+            {
+                sockaddr_storage to;
+                socklen_t toLen= sendAddress(fd, dest.addr, dest.addrLen, to);
+                if(sendto(fd, data, size, MSG_DONTWAIT, (sockaddr*)&to, toLen)<0)
+                {
+                    if(sendErrors++%1000==0)
+                        flog(LOG_ERROR, "forwarding to %s: %s\n", dest.name.c_str(), strerror(errno));
+                }
+                else
+                {
+                    sentPackets++;
+                    flog(LOG_INFO, "routed %zu bytes to %s\n", size, dest.name.c_str());
+                }
+            }
+            dest.bundle.clear();
+            dest.count= 0;
+        }
+};
+
+
+#endif //ROUTER_H
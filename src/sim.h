@@ -0,0 +1,153 @@
+#ifndef SIM_H
+#define SIM_H
+
+// simulation mode (moodpd -S CAPTUREFILE). the daemon runs on the virtual clock (see utils.h) instead of
+// poll(): the packets of a capture are handed to it at the times they were recorded, frames are rendered
+// at their due times, and the tty is replaced by an emulated serial line which takes a byte every
+// 10/baud seconds. nothing depends on the wall clock or the scheduler, so an hour of show traffic runs
+// in seconds and gives the same numbers every time.
+//
+// the far end of the line is a virtual lamp which decodes the commands (in the tty's protocol, see
+// protocol.h) as their last byte leaves the line. the latency of a lamp update is measured from the first change of the lamp not yet formatted
+// for the line until the command carrying it has been sent completely, per priority class.
+
+#define SIM_DEFAULT_BAUD    230400
+#define SIM_LINE_BUFFER     4096            // the tty's output buffer
+#define SIM_START_NS        1000000000ull   // virtual time when the simulation starts
+#define SIM_DRAIN_LIMIT     (10*1000000000ull)  // longest run after the last packet until the line is idle
+
+
+class SimulatedLine
+{
+    public:
+        SimulatedLine(int baud= SIM_DEFAULT_BAUD): psPerByte(10*1000000000000ull/baud), busyUntilPs(0),
+            busyPs(0), bytes(0), lampCommands(0), allCommands(0), otherCommands(0), protocol(PROTOCOL_TEXT)
+        {
+            memset(color, 0, sizeof(color));
+            memset(requestNs, 0, sizeof(requestNs));
+            memset(latencySumNs, 0, sizeof(latencySumNs));
+            memset(latencyMaxNs, 0, sizeof(latencyMaxNs));
+        }
+
+        int baud() const { return 10*1000000000000ull/psPerByte; }
+
+        // the protocol the virtual lamp understands.
+        void setProtocol(int p) { protocol= p; }
+
+        // bytes written but not sent yet.
+        int queued(uint64_t nowNs) const
+        {
+            uint64_t now= nowNs*1000;
+            return busyUntilPs>now? (busyUntilPs-now+psPerByte-1)/psPerByte: 0;
+        }
+
+        // when fewer than 'limit' bytes will be queued.
+        uint64_t belowNs(int limit) const
+        {
+            uint64_t left= (uint64_t)max(limit-1, 0)*psPerByte;
+            return busyUntilPs>left? (busyUntilPs-left+999)/1000: 0;
+        }
+
+        // when the last byte written has been sent.
+        uint64_t idleNs() const { return (busyUntilPs+999)/1000; }
+
+        // take as much as fits into the output buffer, like write() on a non-blocking tty.
+        size_t write(const char *data, size_t size, uint64_t nowNs)
+        {
+            size_t n= min(size, (size_t)(SIM_LINE_BUFFER-queued(nowNs)));
+            uint64_t t= max(busyUntilPs, nowNs*1000);
+            for(size_t i= 0; i<n; i++)
+            {
+                t+= psPerByte;
+                command+= data[i];
+                if(protocol==PROTOCOL_MUCCC? Encoder<PROTOCOL_MUCCC>::commandLength(command.data(), command.size()):
+                                             Encoder<PROTOCOL_TEXT>::commandLength(command.data(), command.size()))
+                    received(t/1000), command.clear();
+                else if(command.size()>=64)
+                    command.clear();    // garbage
+            }
+            busyPs+= t-max(busyUntilPs, nowNs*1000);
+            busyUntilPs= t;
+            bytes+= n;
+            return n;
+        }
+
+        // the daemon changed bus lamp 'lamp'. only the oldest change not formatted yet counts.
+        void lampChanged(int lamp, uint64_t nowNs)
+        { if(!requestNs[lamp]) requestNs[lamp]= nowNs; }
+
+        // a command for bus lamp 'lamp' was formatted in lane 'lane', it carries the pending change.
+        void lampFormatted(int lamp, int lane)
+        {
+            if(!requestNs[lamp]) return;
+            inFlight[lamp].push_back(Request(requestNs[lamp], lane));
+            requestNs[lamp]= 0;
+        }
+
+        // the daemon threw away its output.
+        void dropped()
+        {
+            memset(requestNs, 0, sizeof(requestNs));
+            for(int i= 0; i<MAX_LAMPS; i++) inFlight[i].clear();
+        }
+
+        void print(FILE *f, uint64_t elapsedNs) const
+        {
+            fprintf(f, "serial: %d baud, %llu bytes, line busy %.1f%%, %llu lamp commands, %llu all-lamp commands, %llu other\n",
+                    baud(), (unsigned long long)bytes, elapsedNs? busyPs/10.0/elapsedNs: 0.0, (unsigned long long)lampCommands,
+                    (unsigned long long)allCommands, (unsigned long long)otherCommands);
+            for(int l= 0; l<WRITE_LANES; l++)
+            {
+                uint64_t n= latency[l].total();
+                if(!n) continue;
+                fprintf(f, "%s lamp updates: %llu, latency mean %.1fus, max %.1fus\n", laneName(l), (unsigned long long)n,
+                        latencySumNs[l]/1e3/n, latencyMaxNs[l]/1e3);
+                latency[l].print(f, "latency");
+            }
+            // FNV-1a of the colors the lamps show at the end, to compare runs.
+            uint32_t hash= 2166136261u;
+            for(int i= 0; i<MAX_LAMPS; i++)
+                for(int c= 0; c<3; c++) hash= (hash^color[i][c])*16777619u;
+            fprintf(f, "final lamp state: %08x\n", hash);
+        }
+
+    private:
+        uint64_t psPerByte, busyUntilPs, busyPs, bytes;
+        uint64_t lampCommands, allCommands, otherCommands;
+        int protocol;
+        string command;                     // command being received
+        uint8_t color[MAX_LAMPS][3];        // what the lamps show
+        uint64_t requestNs[MAX_LAMPS];      // oldest change per lamp not formatted yet, 0: none
+        typedef pair<uint64_t, int> Request;    // time of the change, lane
+        deque<Request> inFlight[MAX_LAMPS];     // changes formatted and on their way, oldest first
+        LatencyHistogram latency[WRITE_LANES];
+        uint64_t latencySumNs[WRITE_LANES], latencyMaxNs[WRITE_LANES];
+
+        // a complete command arrived at the lamps at 'nowNs'.
+        void received(uint64_t nowNs)
+        {
+            uint8_t rgb[3];
+            int lamp;
+            bool isColor= protocol==PROTOCOL_MUCCC? Encoder<PROTOCOL_MUCCC>::decodeColor(command.data(), command.size(), rgb, lamp):
+                                                   Encoder<PROTOCOL_TEXT>::decodeColor(command.data(), command.size(), rgb, lamp);
+            if(!isColor) { otherCommands++; return; }
+            if(lamp<0)
+            {
+                allCommands++;
+                for(int i= 0; i<MAX_LAMPS; i++) for(int k= 0; k<3; k++) color[i][k]= rgb[k];
+                return;
+            }
+            lampCommands++;
+            for(int k= 0; k<3; k++) color[lamp][k]= rgb[k];
+            if(inFlight[lamp].empty()) return;
+            uint64_t ns= nowNs-inFlight[lamp].front().first;
+            int l= inFlight[lamp].front().second;
+            inFlight[lamp].pop_front();
+            latency[l].add(ns);
+            latencySumNs[l]+= ns;
+            latencyMaxNs[l]= max(latencyMaxNs[l], ns);
+        }
+};
+
+
+#endif //SIM_H
@@ -0,0 +1,106 @@
+#ifndef SLIP_H
+#define SLIP_H
+
+// stream transports for OSC. OSC 1.1 sends packets over TCP (and here also UNIX stream sockets)
+// framed with SLIP (RFC 1055): packets end with END, END and ESC inside a packet are escaped.
+//
+// SlipDecoder keeps one read buffer per connection for its whole lifetime. data is read straight into
+// the buffer, frames are unescaped in place (nothing moves unless the frame actually contains escapes)
+// and handed to the callback as pointers into the buffer. only an incomplete frame at the end of a
+// read is moved to the front, so the common case copies nothing.
+
+#define SLIP_END        0xC0
+#define SLIP_ESC        0xDB
+#define SLIP_ESC_END    0xDC
+#define SLIP_ESC_ESC    0xDD
+
+#define SLIP_MAX_FRAME  65536
+
+
+class SlipDecoder
+{
+    public:
+        SlipDecoder(size_t maxFrame= SLIP_MAX_FRAME):
+            buffer(maxFrame), frameStart(0), out(0), len(0), escaped(false), discarding(false), dropped(0)
+        {}
+
+        // where to read the next chunk to, and how much fits.
+        char *readPtr() { return &buffer[len]; }
+        size_t readSpace() { return buffer.size()-len; }
+
+        // 'n' bytes were read to readPtr(). calls onFrame(const char *data, size_t size) for every complete frame.
+        template<typename Fn> void received(size_t n, Fn onFrame)
+        {
+            char *b= &buffer[0];
+            size_t scan= len;
+            len+= n;
+            for(; scan<len; scan++)
+            {
+                uint8_t c= b[scan];
+                if(escaped)
+                {
+                    escaped= false;
+                    if(c==SLIP_ESC_END) c= SLIP_END;
+                    else if(c==SLIP_ESC_ESC) c= SLIP_ESC;
+                    // anything else is a protocol violation, RFC 1055 says keep the byte.
+                }
+                else if(c==SLIP_ESC)
+                {
+                    escaped= true;
+                    continue;
+                }
+                else if(c==SLIP_END)
+                {
+                    if(out>frameStart && !discarding) onFrame(b+frameStart, out-frameStart);
+                    discarding= false;
+                    frameStart= out= scan+1;
+                    continue;
+                }
+                if(out!=scan) b[out]= c;
+                out++;
+            }
+
+            // keep the incomplete frame, moved to the front. a frame filling the whole buffer is dropped.
+            size_t partial= out-frameStart;
+            if(partial==buffer.size() || (discarding && partial))
+            {
+                if(!discarding) dropped++;
+                discarding= true;
+                partial= 0;
+            }
+            if(partial && frameStart) memmove(b, b+frameStart, partial);
+            frameStart= 0;
+            out= len= partial;
+        }
+
+        // number of frames dropped for being too large.
+        uint64_t droppedFrames() const { return dropped; }
+
+    private:
+        vector<char> buffer;
+        size_t frameStart;      // start of the frame being decoded
+        size_t out;             // end of the decoded part of that frame
+        size_t len;             // end of the received data
+        bool escaped;           // last byte of the previous read was ESC
+        bool discarding;        // skipping an oversized frame up to the next END
+        uint64_t dropped;
+};
+
+// SLIP-encode 'size' bytes into 'out', which needs room for 2*size+2 bytes. returns the encoded size.
+inline size_t slipEncode(const void *data, size_t size, char *out)
+{
+    const uint8_t *p= (const uint8_t*)data;
+    char *o= out;
+    *o++= SLIP_END;
+    for(size_t i= 0; i<size; i++)
+    {
+        if(p[i]==SLIP_END) *o++= SLIP_ESC, *o++= SLIP_ESC_END;
+        else if(p[i]==SLIP_ESC) *o++= SLIP_ESC, *o++= SLIP_ESC_ESC;
+        else *o++= p[i];
+    }
+    *o++= SLIP_END;
+    return o-out;
+}
+
+
+#endif //SLIP_H
@@ -0,0 +1,149 @@
+#ifndef STATS_H
+#define STATS_H
+
+// ingest statistics per socket: packets, datagrams the kernel dropped because the receive buffer was
+// full (SO_RXQ_OVFL), and two latency histograms. queue delay is the time from the kernel's receive
+// timestamp (SO_TIMESTAMPNS) until moodpd read the packet, processing is the time moodpd spent on it.
+// together they tell whether latency comes from the daemon falling behind or from somewhere else. heap
+// allocations while processing are counted too (alloc.h).
+// printed on the console with 's' and to the log on SIGUSR1.
+
+#define HISTOGRAM_BUCKETS 24    // bucket i: below 2^i microseconds, the last one everything above
+
+
+class LatencyHistogram
+{
+    public:
+        LatencyHistogram() { memset(count, 0, sizeof(count)); }
+
+        void add(uint64_t ns)
+        {
+            uint64_t us= ns/1000;
+            int bucket= us? 64-__builtin_clzll(us): 0;
+            count[min(bucket, HISTOGRAM_BUCKETS-1)]++;
+        }
+
+        uint64_t total() const
+        {
+            uint64_t n= 0;
+            for(int i= 0; i<HISTOGRAM_BUCKETS; i++) n+= count[i];
+            return n;
+        }
+
+        // upper bound in microseconds of the bucket holding the given fraction of the samples.
+        uint64_t percentile(double fraction) const
+        {
+            uint64_t n= total(), sum= 0;
+            for(int i= 0; i<HISTOGRAM_BUCKETS; i++)
+                if( (sum+= count[i]) && sum>=fraction*n ) return 1ull<<i;
+            return 1ull<<(HISTOGRAM_BUCKETS-1);
+        }
+
+        void print(FILE *f, const char *name) const
+        {
+            if(!total()) return;
+            fprintf(f, "    %-12s p50 <%lluus  p99 <%lluus  max <%lluus |", name, (unsigned long long)percentile(0.5),
+                    (unsigned long long)percentile(0.99), (unsigned long long)percentile(1.0));
+            for(int i= 0; i<HISTOGRAM_BUCKETS; i++)
+                if(count[i]) fprintf(f, " <%lluus:%llu", 1ull<<i, (unsigned long long)count[i]);
+            fprintf(f, "\n");
+        }
+
+    private:
+        uint64_t count[HISTOGRAM_BUCKETS];
+};
+
+
+class SocketStats
+{
+    public:
+        SocketStats(const char *_name): name(_name), packets(0), kernelDrops(0), lastDropCounter(0), lastDropLogNs(0) {}
+
+        // a packet was read. 'info' is what the kernel said about it.
+        void received(const RecvInfo &info)
+        {
+            packets++;
+            if(info.kernelNs)
+            {
+                uint64_t now= monotonicNs(CLOCK_REALTIME);
+                queueDelay.add(now>info.kernelNs? now-info.kernelNs: 0);
+            }
+            // the counter is per socket and starts over when the socket changes.
+            if(info.drops>=0 && (uint32_t)info.drops!=lastDropCounter)
+            {
+                kernelDrops+= (uint32_t)info.drops>lastDropCounter? info.drops-lastDropCounter: info.drops;
+                lastDropCounter= info.drops;
+                uint64_t now= monotonicNs();
+                if(now-lastDropLogNs>=1000000000ull)    // at most once a second, overload is no time for logging
+                {
+                    flog(LOG_ERROR, "%s socket: receive buffer overflow, %llu packets dropped by the kernel so far.\n",
+                         name, (unsigned long long)kernelDrops);
+                    lastDropLogNs= now;
+                }
+            }
+        }
+
+        // moodpd spent 'ns' on a packet and allocated 'allocations' times.
+        void processed(uint64_t ns, uint64_t allocations)
+        {
+            processing.add(ns);
+            allocs.add(allocations);
+        }
+
+        // the socket was replaced, its drop counter starts from 0.
+        void socketChanged() { lastDropCounter= 0; }
+
+        void print(FILE *f, int fd) const
+        {
+            int rcvbuf= -1;
+            socklen_t len= sizeof(rcvbuf);
+            if(fd>=0) getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+            fprintf(f, "%s socket: %llu packets, %llu dropped by the kernel, receive buffer %d bytes\n", name,
+                    (unsigned long long)packets, (unsigned long long)kernelDrops, rcvbuf);
+            queueDelay.print(f, "queue delay");
+            processing.print(f, "processing");
+            allocs.print(f, "    ");
+        }
+
+    private:
+        const char *name;
+        uint64_t packets, kernelDrops;
+        uint32_t lastDropCounter;
+        uint64_t lastDropLogNs;
+        LatencyHistogram queueDelay, processing;
+        PacketAllocations allocs;
+};
+
+
+// jitter of the frame clock: how late the last byte of each frame's output was written to the tty,
+// against the time the frame was due. ticks the clock skipped because the daemon was late for more than
+// a whole interval count as missed.
+class FrameJitter
+{
+    public:
+        FrameJitter(): frames(0), missed(0), maxNs(0) {}
+
+        void add(uint64_t lateNs)
+        {
+            frames++;
+            maxNs= max(maxNs, lateNs);
+            lateness.add(lateNs);
+        }
+
+        void missedTicks(uint64_t n) { missed+= n; }
+
+        void print(FILE *f) const
+        {
+            if(!frames) return;
+            fprintf(f, "frame clock: %llu frames, %llu missed, max %.1fus late\n", (unsigned long long)frames,
+                    (unsigned long long)missed, maxNs/1e3);
+            lateness.print(f, "lateness");
+        }
+
+    private:
+        uint64_t frames, missed, maxNs;
+        LatencyHistogram lateness;
+};
+
+
+#endif //STATS_H
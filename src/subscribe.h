@@ -0,0 +1,219 @@
+#ifndef SUBSCRIBE_H
+#define SUBSCRIBE_H
+
+// lamp state subscriptions. a client sends "/moodpd/subscribe FIRST COUNT [MAXRATE]" and from then on
+// gets the lamps in that range whenever they change, as one OSC bundle of /moodpd/lamps/rgb messages
+// (one per run of changed lamps) per frame, at most MAXRATE bundles a second. the first bundle holds
+// the whole range. every subscriber has its own changed-lamps bitmap, filled from the lamp state's
+// dirty bits each time lamps are flushed, so the cost is proportional to the changes and not to the
+// traffic that caused them. subscriptions expire after SUBSCRIPTION_LEASE_SECONDS unless renewed by
+// subscribing again.
+//
+// a UDP sender address is easily forged, and one small subscribe message makes moodpd send bundles to
+// that address for a minute. so only local clients (UNIX datagram sockets, loopback) may subscribe,
+// plus the networks listed with "subscribers = ADDRESS[/PREFIXLEN]".
+
+#define SUBSCRIBE_ADDRESS       "/moodpd/subscribe"     // int32 first lamp, int32 count, [int32 max bundles per second]
+#define UNSUBSCRIBE_ADDRESS     "/moodpd/unsubscribe"
+#define MAX_SUBSCRIBERS         32
+#define SUBSCRIPTION_LEASE_SECONDS 60
+
+
+struct SubscriberNetwork
+{
+    uint8_t net[16];            // IPv6 or v4-mapped
+    int prefixLen;
+
+    bool operator==(const SubscriberNetwork &o) const
+    { return !memcmp(net, o.net, sizeof(net)) && prefixLen==o.prefixLen; }
+};
+
+inline bool parseSubscriberNetwork(const string &value, SubscriberNetwork &n)
+{ return parseNetwork(value, n.net, n.prefixLen); }
+
+// 'from' may subscribe: a UNIX socket, loopback or an address in one of 'nets'.
+inline bool subscriberAllowed(const vector<SubscriberNetwork> &nets, const sockaddr *from)
+{
+    if(from->sa_family==AF_UNIX) return true;
+    static const uint8_t loopback6[16]= { 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,1 };
+    static const uint8_t loopback4[16]= { 0,0,0,0, 0,0,0,0, 0,0,0xff,0xff, 127,0,0,0 };
+    uint8_t addr[16];
+    if(!ipv6Address(from, addr)) return false;
+    if(prefixMatches(addr, loopback6, 128) || prefixMatches(addr, loopback4, 104)) return true;
+    for(size_t i= 0; i<nets.size(); i++)
+        if(prefixMatches(addr, nets[i].net, nets[i].prefixLen)) return true;
+    return false;
+}
+
+
+class Subscriptions
+{
+    public:
+        Subscriptions(): address("/moodpd/lamps/rgb"), sentBundles(0), sendErrors(0) {}
+
+        // add or renew the subscription of 'addr', whose packets arrived on 'fd' (replies go out there too).
+        bool subscribe(int fd, const sockaddr *addr, socklen_t addrLen, int first, int count, int maxRate, uint64_t nowNs)
+        {
+            Subscriber *s= find(fd, addr, addrLen);
+            if(!s)
+            {
+                if(subscribers.size()>=MAX_SUBSCRIBERS) return false;
+                subscribers.push_back(Subscriber());
+                s= &subscribers.back();
+                s->fd= fd;
+                memcpy(&s->addr, addr, addrLen);
+                s->addrLen= addrLen;
+                s->lastSentNs= 0;
+            }
+            s->firstLamp= first;
+            s->lastLamp= first+count-1;
+            s->minIntervalNs= maxRate>0? 1000000000ull/maxRate: 0;
+            s->expiresNs= nowNs + SUBSCRIPTION_LEASE_SECONDS*1000000000ull;
+            memset(s->pending, 0, sizeof(s->pending));
+            for(int i= first; i<first+count; i++) s->pending[i>>6]|= 1ull<<(i&63);     // start with a full snapshot
+            return true;
+        }
+
+        void unsubscribe(int fd, const sockaddr *addr, socklen_t addrLen)
+        {
+            Subscriber *s= find(fd, addr, addrLen);
+            if(s) subscribers.erase(subscribers.begin() + (s-&subscribers[0]));
+        }
+
+        // drop subscriptions going out through 'fd', it's being closed.
+        void dropFd(int fd)
+        {
+            for(size_t i= 0; i<subscribers.size(); )
+                if(subscribers[i].fd==fd) subscribers.erase(subscribers.begin()+i);
+                else i++;
+        }
+
+        bool empty() const { return subscribers.empty(); }
+
+        // note the lamps which are dirty now. called before the dirty bits are cleared.
+        void collect(const LampState &lamps)
+        {
+            for(size_t i= 0; i<subscribers.size(); i++)
+                for(int w= 0; w<MAX_LAMPS/64; w++)
+                    subscribers[i].pending[w]|= lamps.dirty[w] & subscribers[i].mask(w);
+        }
+
+        // any subscriber has changes not sent yet.
+        bool pending() const
+        {
+            for(size_t i= 0; i<subscribers.size(); i++)
+                for(int w= 0; w<MAX_LAMPS/64; w++)
+                    if(subscribers[i].pending[w]) return true;
+            return false;
+        }
+
+        // drop the subscriptions which weren't renewed in time.
+        void expire(uint64_t nowNs)
+        {
+            for(size_t i= 0; i<subscribers.size(); )
+                if(nowNs>=subscribers[i].expiresNs)
+                {
+                    flog(LOG_INFO, "subscription of %s expired.\n", addressString((sockaddr*)&subscribers[i].addr).c_str());
+                    subscribers.erase(subscribers.begin()+i);
+                }
+                else i++;
+        }
+
+        // when the next subscription expires, 0 if there are none.
+        uint64_t nextExpiryNs() const
+        {
+            uint64_t next= 0;
+            for(size_t i= 0; i<subscribers.size(); i++)
+                if(!next || subscribers[i].expiresNs<next) next= subscribers[i].expiresNs;
+            return next;
+        }
+
+        // send pending changes to every subscriber whose rate allows it, drop expired subscriptions.
+        // subscribers on 'udp' get their bundles through it, those on UNIX datagram sockets directly.
+        void send(const LampState &lamps, uint64_t nowNs, oscpkt::UdpSocket &udp)
+        {
+            expire(nowNs);
+            for(size_t i= 0; i<subscribers.size(); i++)
+            {
+                Subscriber &s= subscribers[i];
+                // allow a little jitter, so a rate of half the frame rate means every other frame.
+                if(nowNs-s.lastSentNs < s.minIntervalNs-s.minIntervalNs/8) continue;
+                bool empty= true;
+                for(int lamp= s.firstLamp; lamp<=s.lastLamp; lamp++)
+                {
+                    if(!s.isPending(lamp)) continue;
+                    int first= lamp;
+                    for(; lamp<=s.lastLamp && s.isPending(lamp); lamp++)
+                    {
+                        rgb[(lamp-first)*3]= lamps.red[lamp];
+                        rgb[(lamp-first)*3+1]= lamps.green[lamp];
+                        rgb[(lamp-first)*3+2]= lamps.blue[lamp];
+                    }
+                    if(empty) writer.init().startBundle(), empty= false;
+                    msg.init(address).pushInt32(first).pushBlob(rgb, (lamp-first)*3);
+                    writer.addMessage(msg);
+                }
+                if(empty) continue;
+                writer.endBundle();
+                memset(s.pending, 0, sizeof(s.pending));
+                s.lastSentNs= nowNs;
+                bool sent;
+                if(s.fd==udp.socketHandle())
+                {
+                    oscpkt::SockAddr to;
+                    memcpy(&to.addr(), &s.addr, s.addrLen);
+                    sent= udp.sendPacketTo(writer.packetData(), writer.packetSize(), to);
+                }
+                else
+                    sent= sendto(s.fd, writer.packetData(), writer.packetSize(), MSG_DONTWAIT, (sockaddr*)&s.addr, s.addrLen)>=0;
+                if(!sent)
+                {
+                    if(sendErrors++%1000==0)
+                        flog(LOG_ERROR, "sending to subscriber %s: %s\n", addressString((sockaddr*)&s.addr).c_str(), strerror(errno));
+                }
+                else sentBundles++;
+            }
+        }
+
+        uint64_t bundlesSent() const { return sentBundles; }
+
+    private:
+        struct Subscriber
+        {
+            int fd;
+            sockaddr_storage addr;
+            socklen_t addrLen;
+            int firstLamp, lastLamp;
+            uint64_t minIntervalNs, lastSentNs, expiresNs;
+            uint64_t pending[MAX_LAMPS/64];     // changed since the last bundle
+
+            bool isPending(int lamp) const
+            { return pending[lamp>>6] & (1ull<<(lamp&63)); }
+
+            // bits of the subscribed range in word 'w'.
+            uint64_t mask(int w) const
+            {
+                int lo= max(firstLamp-w*64, 0), hi= min(lastLamp-w*64, 63);
+                if(lo>hi) return 0;
+                return (~0ull>>(63-hi)) & (~0ull<<lo);
+            }
+        };
+
+        vector<Subscriber> subscribers;
+        oscpkt::PacketWriter writer;
+        oscpkt::Message msg;
+        const string address;
+        uint8_t rgb[MAX_LAMPS*3];
+        uint64_t sentBundles, sendErrors;
+
+        Subscriber *find(int fd, const sockaddr *addr, socklen_t addrLen)
+        {
+            for(size_t i= 0; i<subscribers.size(); i++)
+                if(subscribers[i].fd==fd && subscribers[i].addrLen==addrLen && !memcmp(&subscribers[i].addr, addr, addrLen))
+                    return &subscribers[i];
+            return 0;
+        }
+};
+
+
+#endif //SUBSCRIBE_H
@@ -0,0 +1,285 @@
+#ifndef URING_H
+#define URING_H
+
+// minimal io_uring wrapper built on the raw syscalls, so we don't need liburing.
+// it only does what the moodpd main loop needs: submission/completion ring access,
+// a few request types and provided buffer rings for multishot receives.
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+
+class IoUring
+{
+    public:
+        IoUring(): ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes((io_uring_sqe*)MAP_FAILED)
+        { }
+
+        ~IoUring() { close(); }
+
+        // set up a ring with room for 'entries' submissions. returns false if io_uring is unavailable.
+        bool open(unsigned entries)
+        {
+            io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            p.flags= IORING_SETUP_CQSIZE;
+            p.cq_entries= entries*8;    // multishot requests can post lots of completions
+            ringFd= syscall(__NR_io_uring_setup, entries, &p);
+            if(ringFd<0)
+            {
+                logerror("io_uring_setup");
+                return false;
+            }
+
+            sqRingSize= p.sq_off.array + p.sq_entries*sizeof(unsigned);
+            cqRingSize= p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+            if(p.features & IORING_FEAT_SINGLE_MMAP)
+                sqRingSize= cqRingSize= max(sqRingSize, cqRingSize);
+
+            sqRing= mmap(0, sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+            if(sqRing==MAP_FAILED) { logerror("io_uring: mmap sq ring"); close(); return false; }
+            if(p.features & IORING_FEAT_SINGLE_MMAP)
+                cqRing= sqRing;
+            else
+            {
+                cqRing= mmap(0, cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+                if(cqRing==MAP_FAILED) { logerror("io_uring: mmap cq ring"); close(); return false; }
+            }
+            sqesSize= p.sq_entries*sizeof(io_uring_sqe);
+            sqes= (io_uring_sqe*)mmap(0, sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFd, IORING_OFF_SQES);
+            if(sqes==MAP_FAILED) { logerror("io_uring: mmap sqes"); close(); return false; }
+
+            char *sq= (char*)sqRing, *cq= (char*)cqRing;
+            sqHead= (unsigned*)(sq + p.sq_off.head);
+            sqTail= (unsigned*)(sq + p.sq_off.tail);
+            sqMask= *(unsigned*)(sq + p.sq_off.ring_mask);
+            sqEntries= *(unsigned*)(sq + p.sq_off.ring_entries);
+            sqArray= (unsigned*)(sq + p.sq_off.array);
+            cqHead= (unsigned*)(cq + p.cq_off.head);
+            cqTail= (unsigned*)(cq + p.cq_off.tail);
+            cqMask= *(unsigned*)(cq + p.cq_off.ring_mask);
+            cqes= (io_uring_cqe*)(cq + p.cq_off.cqes);
+            sqeTail= *sqTail;
+            return true;
+        }
+
+        void close()
+        {
+            for(size_t i= 0; i<bufRings.size(); i++)
+            {
+                if(bufRings[i].ring) munmap(bufRings[i].ring, bufRings[i].ringSize);
+                if(bufRings[i].storage) munmap(bufRings[i].storage, bufRings[i].storageSize);
+            }
+            bufRings.clear();
+            if(sqes!=MAP_FAILED) munmap(sqes, sqesSize);
+            if(cqRing!=MAP_FAILED && cqRing!=sqRing) munmap(cqRing, cqRingSize);
+            if(sqRing!=MAP_FAILED) munmap(sqRing, sqRingSize);
+            sqes= (io_uring_sqe*)MAP_FAILED;
+            sqRing= cqRing= MAP_FAILED;
+            if(ringFd>=0) ::close(ringFd);
+            ringFd= -1;
+        }
+
+        bool isOpen() { return ringFd>=0; }
+
+        // get a cleared submission entry, or 0 if the submission queue is full.
+        io_uring_sqe *getSqe()
+        {
+            unsigned head= __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            if(sqeTail-head>=sqEntries) return 0;
+            io_uring_sqe *sqe= &sqes[sqeTail & sqMask];
+            sqeTail++;
+            memset(sqe, 0, sizeof(*sqe));
+            return sqe;
+        }
+
+        // number of submission entries getSqe() can still hand out.
+        unsigned sqSpace()
+        { return sqEntries-(sqeTail-__atomic_load_n(sqHead, __ATOMIC_ACQUIRE)); }
+
+        // submit everything queued since the last call and wait for at least waitNr completions.
+        // returns the number of submitted entries or -errno.
+        int submitAndWait(unsigned waitNr)
+        {
+            unsigned tail= *sqTail;
+            unsigned toSubmit= sqeTail-tail;
+            for(; tail!=sqeTail; tail++)
+                sqArray[tail & sqMask]= tail & sqMask;
+            __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+            int r= syscall(__NR_io_uring_enter, ringFd, toSubmit, waitNr, waitNr? IORING_ENTER_GETEVENTS: 0, 0, 0);
+            return r<0? -errno: r;
+        }
+
+        // return the next completion or 0 if there is none. call cqeSeen() when done with it.
+        io_uring_cqe *peekCqe()
+        {
+            unsigned head= *cqHead;
+            if(head==__atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return 0;
+            return &cqes[head & cqMask];
+        }
+
+        void cqeSeen()
+        { __atomic_store_n(cqHead, *cqHead+1, __ATOMIC_RELEASE); }
+
+        // register a provided buffer ring with 'count' buffers (must be a power of 2) of 'size' bytes each.
+        // 'slack' bytes after each buffer are never handed to the kernel, e.g. for zero-terminating payloads.
+        bool setupBufferRing(uint16_t bgid, unsigned count, size_t size, size_t slack= 0)
+        {
+            if(bufRings.size()<=bgid) bufRings.resize(bgid+1);
+            BufferRing &br= bufRings[bgid];
+            br.ringSize= count*sizeof(io_uring_buf);
+            br.ring= (io_uring_buf_ring*)mmap(0, br.ringSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            if(br.ring==MAP_FAILED)
+            {
+                br.ring= 0;
+                logerror("io_uring: mmap buffer ring");
+                return false;
+            }
+            br.mask= count-1;
+            br.tail= 0;
+            br.size= size;
+            br.stride= size+slack;
+            br.storageSize= count*br.stride;
+            br.storage= (char*)mmap(0, br.storageSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            if(br.storage==MAP_FAILED)
+            {
+                br.storage= 0;
+                logerror("io_uring: mmap buffers");
+                return false;
+            }
+
+            io_uring_buf_reg reg;
+            memset(&reg, 0, sizeof(reg));
+            reg.ring_addr= (uint64_t)br.ring;
+            reg.ring_entries= count;
+            reg.bgid= bgid;
+            if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1)<0)
+            {
+                logerror("io_uring: register buffer ring");
+                munmap(br.ring, br.ringSize);
+                br.ring= 0;
+                return false;
+            }
+            for(unsigned i= 0; i<count; i++)
+                recycleBuffer(bgid, i);
+            return true;
+        }
+
+        char *buffer(uint16_t bgid, uint16_t bid)
+        { return bufRings[bgid].storage + bid*bufRings[bgid].stride; }
+
+        // give a buffer back to the kernel after its data has been consumed.
+        void recycleBuffer(uint16_t bgid, uint16_t bid)
+        {
+            BufferRing &br= bufRings[bgid];
+            // don't use br.ring->bufs, in c++ the kernel header's flex array macro puts it at the wrong offset.
+            io_uring_buf *b= (io_uring_buf*)br.ring + (br.tail & br.mask);
+            b->addr= (uint64_t)buffer(bgid, bid);
+            b->len= br.size;
+            b->bid= bid;
+            br.tail++;
+            __atomic_store_n(&br.ring->tail, br.tail, __ATOMIC_RELEASE);
+        }
+
+        // multishot recvmsg into buffers from group 'bgid'. 'msg' is only used as a template for
+        // name and control lengths, but must stay valid while the request is active.
+        bool prepRecvMsgMultishot(int fd, msghdr *msg, uint16_t bgid, uint64_t userData)
+        {
+            io_uring_sqe *sqe= getSqe();
+            if(!sqe) return false;
+            sqe->opcode= IORING_OP_RECVMSG;
+            sqe->fd= fd;
+            sqe->addr= (uint64_t)msg;
+            sqe->len= 1;
+            sqe->ioprio= IORING_RECV_MULTISHOT;
+            sqe->flags= IOSQE_BUFFER_SELECT;
+            sqe->buf_group= bgid;
+            sqe->user_data= userData;
+            return true;
+        }
+
+        bool prepPoll(int fd, unsigned events, uint64_t userData, bool multishot= false, bool link= false)
+        {
+            io_uring_sqe *sqe= getSqe();
+            if(!sqe) return false;
+            sqe->opcode= IORING_OP_POLL_ADD;
+            sqe->fd= fd;
+            sqe->poll32_events= events;
+            sqe->len= multishot? IORING_POLL_ADD_MULTI: 0;
+            sqe->flags= link? IOSQE_IO_LINK: 0;
+            sqe->user_data= userData;
+            return true;
+        }
+
+        bool prepPollRemove(uint64_t targetUserData, uint64_t userData)
+        {
+            io_uring_sqe *sqe= getSqe();
+            if(!sqe) return false;
+            sqe->opcode= IORING_OP_POLL_REMOVE;
+            sqe->fd= -1;
+            sqe->addr= targetUserData;
+            sqe->user_data= userData;
+            return true;
+        }
+
+        // cancel the request(s) submitted with user data 'targetUserData'.
+        bool prepCancel(uint64_t targetUserData, uint64_t userData)
+        {
+            io_uring_sqe *sqe= getSqe();
+            if(!sqe) return false;
+            sqe->opcode= IORING_OP_ASYNC_CANCEL;
+            sqe->fd= -1;
+            sqe->addr= targetUserData;
+            sqe->user_data= userData;
+            return true;
+        }
+
+        bool prepWrite(int fd, const void *data, unsigned size, uint64_t userData)
+        {
+            io_uring_sqe *sqe= getSqe();
+            if(!sqe) return false;
+            sqe->opcode= IORING_OP_WRITE;
+            sqe->fd= fd;
+            sqe->addr= (uint64_t)data;
+            sqe->len= size;
+            sqe->off= (uint64_t)-1;     // use (and advance) the file position, like write(2)
+            sqe->user_data= userData;
+            return true;
+        }
+
+        // parse a multishot recvmsg completion buffer. the control messages (out->controllen bytes) are at 'control'.
+        static io_uring_recvmsg_out *recvMsgOut(char *buf, const msghdr *msg, char *&name, char *&control, char *&payload)
+        {
+            io_uring_recvmsg_out *out= (io_uring_recvmsg_out*)buf;
+            name= buf + sizeof(io_uring_recvmsg_out);
+            control= name + msg->msg_namelen;
+            payload= control + msg->msg_controllen;
+            return out;
+        }
+
+    private:
+        struct BufferRing
+        {
+            io_uring_buf_ring *ring;
+            size_t ringSize;
+            unsigned mask;
+            uint16_t tail;
+            size_t size, stride;
+            char *storage;
+            size_t storageSize;
+            BufferRing(): ring(0), storage(0) {}
+        };
+
+        int ringFd;
+        void *sqRing, *cqRing;
+        size_t sqRingSize, cqRingSize, sqesSize;
+        io_uring_sqe *sqes;
+        unsigned *sqHead, *sqTail, *sqArray, sqMask, sqEntries, sqeTail;
+        unsigned *cqHead, *cqTail, cqMask;
+        io_uring_cqe *cqes;
+        vector<BufferRing> bufRings;
+};
+
+
+#endif //URING_H
@@ -17,6 +17,20 @@ enum Loglevel
 
 extern uint32_t logMask;
 
+// simulated time (moodpd -S). while it's enabled, monotonicNs() returns 'now' for every clock and the
+// log shows it instead of the date.
+struct VirtualClock
+{
+    bool enabled;
+    uint64_t now;
+};
+
+inline VirtualClock &virtualClock()
+{
+    static VirtualClock clock= { false, 0 };
+    return clock;
+}
+
 inline void flog(Loglevel level, const char *fmt, ...)
 {
     if( !(logMask & (1<<level)) && level!=LOG_CRIT ) return;
@@ -27,7 +41,9 @@ inline void flog(Loglevel level, const char *fmt, ...)
 
     t= time(0);
     tmp= localtime(&t);
-    if(!tmp)
+    if(virtualClock().enabled)
+        snprintf(timeStr, sizeof(timeStr), "sim %.6f", virtualClock().now/1e9);
+    else if(!tmp)
         strcpy(timeStr, "localtime failed");
     else if(strftime(timeStr, sizeof(timeStr), "%F %H:%M.%S", tmp)==0)
         strcpy(timeStr, "strftime returned 0");
@@ -39,6 +55,15 @@ inline void flog(Loglevel level, const char *fmt, ...)
     va_end(ap);
 }
 
+// current time in ns.
+inline uint64_t monotonicNs(clockid_t clock= CLOCK_MONOTONIC)
+{
+    if(virtualClock().enabled) return virtualClock().now;
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
 #define logerror(str)   \
     flog(LOG_ERROR, "%s: %s\n", str, strerror(errno))
 
@@ -71,48 +96,139 @@ inline bool setNonblocking(int fd, bool on= true)
 }
 
 
-// base class for handling buffered writes to a non-blocking fd.
+// number of priority lanes of a NonblockWriter, lane 0 is the most urgent.
+#define WRITE_LANES 3
+
+// largest chunk handed to write() at once. it can't be preempted, so this bounds how long urgent
+// data waits behind a chunk already being written.
+#define WRITE_CHUNK_SIZE 256
+
+
+// the buffered data of one lane: the bytes in order and where each piece written ends, so a chunk is
+// always cut between two pieces (commands) and lanes never interleave within one. both only grow to the
+// most that was ever buffered, from then on buffering doesn't allocate.
+struct LaneBuffer
+{
+    vector<char> bytes;
+    vector<size_t> ends;
+    size_t head, headEnd;   // bytes and pieces taken already
+
+    LaneBuffer(): head(0), headEnd(0)
+    {
+        bytes.reserve(4*WRITE_CHUNK_SIZE);
+        ends.reserve(4*WRITE_CHUNK_SIZE/8);
+    }
+
+    bool empty() const { return head==bytes.size(); }
+    size_t size() const { return bytes.size()-head; }
+
+    void append(const char *data, size_t len)
+    {
+        bytes.insert(bytes.end(), data, data+len);
+        ends.push_back(bytes.size());
+    }
+
+    void clear()
+    {
+        bytes.clear();
+        ends.clear();
+        head= headEnd= 0;
+    }
+
+    // move the first piece and as many of the following ones as fit into 'maxSize' to 'out'.
+    void take(vector<char> &out, size_t maxSize)
+    {
+        size_t end= ends[headEnd++];
+        while(headEnd<ends.size() && ends[headEnd]-head<=maxSize) end= ends[headEnd++];
+        out.insert(out.end(), bytes.begin()+head, bytes.begin()+end);
+        head= end;
+        if(empty()) clear();
+        else if(head>=WRITE_CHUNK_SIZE && head*2>=bytes.size())
+        {
+            // a lane which never drains completely: move the rest to the front.
+            bytes.erase(bytes.begin(), bytes.begin()+head);
+            ends.erase(ends.begin(), ends.begin()+headEnd);
+            for(size_t i= 0; i<ends.size(); i++) ends[i]-= head;
+            head= headEnd= 0;
+        }
+    }
+};
+
+// base class for handling buffered writes to a non-blocking fd. buffered data is kept in lanes: the most
+// urgent lane with data is written first, except that a lane which has been waiting for more than the
+// maximum lane wait gets its turn (so bulk data still trickles out under a constant urgent load). data
+// within a lane keeps its order. subclasses can keep data of their own per lane and produce it on demand
+// (see hasLazyData()).
 class NonblockWriter
 {
     public:
-        NonblockWriter(): fd(-1) {}
+        NonblockWriter(): fd(-1), deferredFlush(false), lane(WRITE_LANES/2), maxLaneWaitNs(0)
+        {
+            memset(lastServedNs, 0, sizeof(lastServedNs));
+            current.reserve(4*WRITE_CHUNK_SIZE);
+        }
 
-        void setFd(int _fd) { fd= _fd; setNonblocking(fd); }
+        void setFd(int _fd) { fd= _fd; if(fd>=0) setNonblocking(fd); }
 		int getFd() { return fd; }
 
+        // lane for the following writes.
+        void setLane(int l) { lane= l; }
+        int getLane() const { return lane; }
+
+        // how long a lane with data may be passed over by more urgent ones (0: strict priority).
+        void setMaxLaneWait(uint64_t ns) { maxLaneWaitNs= ns; }
+
         // try flushing the write buffer.
         bool flush()
         {
-            while(!buffer.empty())
+            bool wrote= false;
+            while(!current.empty() || (!writeBufferEmpty() && !writeThrottled()))
             {
-                size_t sz= writeToFile(&buffer.front()[0], buffer.front().size());
-                if(sz==buffer.front().size())
-                    buffer.pop_front();
+                if(!nextChunk()) break;
+                size_t sz= writeToFile(&current[0], current.size());
+                wrote|= sz>0;
+                if(sz==current.size())
+                    current.clear();
                 else
                 {
-                    buffer.front().erase(buffer.front().begin(), buffer.front().begin()+sz);
+                    current.erase(current.begin(), current.begin()+sz);
                     return false;
                 }
             }
+            if(!writeBufferEmpty()) return false;
+            if(wrote) drained();
             return true;
         }
 
+        // the fd's own buffer holds enough already. data is held back here then, where more urgent data
+        // can still overtake it.
+        virtual bool writeThrottled() { return false; }
+
         bool writeBufferEmpty()
-        { return buffer.empty(); }
-		
-		void write(vector<char> data)
-		{
-            buffer.push_back(data);
-            flush();
-		}
+        {
+            if(!current.empty()) return false;
+            for(int l= 0; l<WRITE_LANES; l++) if(laneHasData(l)) return false;
+            return true;
+        }
+
+        // throw away everything not yet written.
+        void clearBuffer()
+        {
+            current.clear();
+            for(int l= 0; l<WRITE_LANES; l++) buffer[l].clear();
+            dropLazyData();
+        }
 		
 		void write(const char *data, size_t len)
 		{
-			write( vector<char>(data+0, data+len) );
+            // lazy data of this lane was written before, it must stay in front.
+            if(hasLazyData(lane)) produceLazyData(lane, buffer[lane], ~(size_t)0);
+            buffer[lane].append(data, len);
+            if(!deferredFlush) flush();
 		}
 
         // write or buffer a string.
-        void writeString(const string s)
+        void writeString(const string &s)
         {
 			write(s.data(), s.size());
         }
@@ -123,29 +239,117 @@ class NonblockWriter
             char c[2048];
             va_list ap;
             va_start(ap, fmt);
-            vsnprintf(c, sizeof(c), fmt, ap);
+            int n= vsnprintf(c, sizeof(c), fmt, ap);
             va_end(ap);
-            writeString(c);
+            if(n>0) write(c, min(n, (int)sizeof(c)-1));
         }
 
-        // calculate the size of the write buffer in bytes.
+        // calculate the size of the write buffer in bytes, not counting lazy data.
         size_t getWritebufferSize()
         {
-            size_t ret= 0;
-            for(deque< vector<char> >::iterator it= buffer.begin(); it!=buffer.end(); it++)
-                ret+= it->size();
+            size_t ret= current.size();
+            for(int l= 0; l<WRITE_LANES; l++) ret+= buffer[l].size();
             return ret;
         }
 
+        // if set, write() only buffers and the caller is responsible for getting the data out
+        // (the io_uring backend submits the writes itself).
+        void setDeferredFlush(bool on)
+        { deferredFlush= on; }
+
+        // the next chunk to write. the data stays valid until the next call to consume(), even if more
+        // data is written in the meantime.
+        size_t pendingData(const char *&data)
+        {
+            if(!nextChunk()) return 0;
+            data= &current[0];
+            return current.size();
+        }
+
+        // everything not yet written as one chunk, in the order it would have been written.
+        size_t allPendingData(const char *&data)
+        {
+            while(true)
+            {
+                int l= pickLane();
+                if(l<0) break;
+                if(buffer[l].empty()) produceLazyData(l, buffer[l], ~(size_t)0);
+                while(!buffer[l].empty()) buffer[l].take(current, ~(size_t)0);
+            }
+            data= current.empty()? 0: &current[0];
+            return current.size();
+        }
+
+        // remove bytes which were written by someone else from the front of the buffer.
+        void consume(size_t size)
+        {
+            if(size>=current.size()) current.clear();
+            else current.erase(current.begin(), current.begin()+size);
+            if(writeBufferEmpty()) drained();
+        }
+
         // error callback.
         virtual void writeFailed(int _errno)= 0;
 
+    protected:
+        // data a subclass keeps itself and formats only when it's about to be written, so it's always
+        // current. produceLazyData() appends at most about 'maxBytes' of it to 'out'.
+        virtual bool hasLazyData(int /*l*/) { return false; }
+        virtual void produceLazyData(int /*l*/, LaneBuffer &/*out*/, size_t /*maxBytes*/) { }
+        virtual void dropLazyData() { }
+
+        // the last buffered byte has been written.
+        virtual void drained() { }
+
+        // lazy data was added, write it unless the caller takes care of that.
+        void lazyDataAdded()
+        { if(!deferredFlush) flush(); }
+
     private:
         int fd;
-        deque< vector<char> > buffer;
+        bool deferredFlush;
+        int lane;
+        uint64_t maxLaneWaitNs;
+        LaneBuffer buffer[WRITE_LANES];
+        vector<char> current;                   // chunk being written
+        uint64_t lastServedNs[WRITE_LANES];     // when the lane was last written or had nothing to write
+
+        bool laneHasData(int l)
+        { return !buffer[l].empty() || hasLazyData(l); }
+
+        // the lane to write from next, -1 if there's nothing to write.
+        int pickLane()
+        {
+            uint64_t now= maxLaneWaitNs? monotonicNs(): 0;
+            int urgent= -1, starved= -1;
+            for(int l= 0; l<WRITE_LANES; l++)
+            {
+                if(!laneHasData(l)) { lastServedNs[l]= now; continue; }
+                if(urgent<0) urgent= l;
+                else if(maxLaneWaitNs && now-lastServedNs[l]>maxLaneWaitNs &&
+                        (starved<0 || lastServedNs[l]<lastServedNs[starved]))
+                    starved= l;
+            }
+            int l= starved>=0? starved: urgent;
+            if(l>=0) lastServedNs[l]= now;
+            return l;
+        }
+
+        // make sure 'current' holds data to write, coalescing chunks of one lane up to WRITE_CHUNK_SIZE.
+        bool nextChunk()
+        {
+            if(!current.empty()) return true;
+            int l= pickLane();
+            if(l<0) return false;
+            if(buffer[l].empty()) produceLazyData(l, buffer[l], WRITE_CHUNK_SIZE);
+            if(buffer[l].empty()) return false;
+            buffer[l].take(current, WRITE_CHUNK_SIZE);
+            return true;
+        }
 
+    protected:
         // write a piece of data without buffering. return number of bytes written.
-        size_t writeToFile(const char *data, size_t size)
+        virtual size_t writeToFile(const char *data, size_t size)
         {
             ssize_t sz= ::write(fd, data, size);
             if(sz<0)